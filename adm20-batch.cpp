@@ -0,0 +1,359 @@
+/*
+ * BSIDE-ADM20 batch frame decoding
+ *
+ * For chewing through archived captures.  Frames are decoded 16
+ * (SSE4.1) or 32 (AVX2) at a time in to a structure of arrays, the
+ * segment bytes go through a pshufb lookup of the same table that
+ * adm20_digit() uses and the annunciator bytes are turned in to
+ * unit/prefix codes with compare masks.  The results match
+ * adm20_decode() exactly, including its "later bit wins" rules,
+ * and anything left over at the end goes through adm20_decode().
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ADM20_BATCH_X86 1
+#endif
+
+/*
+ * Digit values for the pshufb lookup, 0x80 marks anything that
+ * isn't a number so a single sign test finds the NaN lanes.
+ *
+ */
+struct adm20_value_table {
+	uint8_t v[128];
+};
+
+constexpr struct adm20_value_table adm20_make_value_table(void) {
+	struct adm20_value_table t = {};
+
+	for (int i = 0; i < 128; i++) {
+		if (adm20_segments.s[i].glyph && adm20_segments.s[i].value >= 0) t.v[i] = adm20_segments.s[i].value;
+		else t.v[i] = 0x80;
+	}
+
+	return t;
+}
+
+alignas(32) static constexpr struct adm20_value_table value_table = adm20_make_value_table();
+
+/*
+ * Columns pulled out of each frame, in this order
+ *
+ */
+#define COL_D4 0
+#define COL_D5 1
+#define COL_D6 2
+#define COL_D7 3
+#define COL_D8 4
+#define COL_D18 5
+#define COL_D19 6
+#define COL_COUNT 7
+
+static void gather(const uint8_t *frames, int n, uint8_t cols[COL_COUNT][32]) {
+	for (int i = 0; i < n; i++) {
+		const uint8_t *d = frames + i *ADM20_FRAME_SIZE;
+		cols[COL_D4][i] = d[4];
+		cols[COL_D5][i] = d[5];
+		cols[COL_D6][i] = d[6];
+		cols[COL_D7][i] = d[7];
+		cols[COL_D8][i] = d[8];
+		cols[COL_D18][i] = d[18];
+		cols[COL_D19][i] = d[19];
+	}
+}
+
+static void decode_scalar(const uint8_t *frames, size_t first, size_t count, struct adm20_batch *b) {
+	struct adm20_reading r;
+
+	for (size_t i = first; i < count; i++) {
+		adm20_decode(frames + i *ADM20_FRAME_SIZE, 0, &r);
+		b->mantissa[i] = r.mantissa;
+		b->exponent[i] = r.exponent;
+		b->prefix[i] = r.prefix;
+		b->unit[i] = r.unit;
+		b->flags[i] = r.flags;
+	}
+}
+
+#ifdef ADM20_BATCH_X86
+
+/*
+ * Unit and prefix bits in the order adm20_decode() tests them,
+ * so applying them in sequence gives the same "later wins" result.
+ *
+ */
+static const struct { uint8_t col, bit, code; } unit_bits[] = {
+	{ COL_D18, 0x80, ADM20_UNIT_FARAD },
+	{ COL_D18, 0x02, ADM20_UNIT_DEGF },
+	{ COL_D18, 0x01, ADM20_UNIT_DEGC },
+	{ COL_D19, 0x80, ADM20_UNIT_HERTZ },
+	{ COL_D19, 0x40, ADM20_UNIT_OHM },
+	{ COL_D19, 0x08, ADM20_UNIT_VOLT },
+	{ COL_D19, 0x04, ADM20_UNIT_AMP },
+};
+
+static const struct { uint8_t col, bit, code; } prefix_bits[] = {
+	{ COL_D18, 0x40, ADM20_PREFIX_NANO },
+	{ COL_D18, 0x20, ADM20_PREFIX_MICRO },
+	{ COL_D19, 0x20, ADM20_PREFIX_KILO },
+	{ COL_D19, 0x10, ADM20_PREFIX_MEGA },
+	{ COL_D19, 0x02, ADM20_PREFIX_MILLI },
+	{ COL_D19, 0x01, ADM20_PREFIX_MICRO },
+};
+
+__attribute__((target("sse4.1")))
+static inline __m128i lookup16(__m128i s) {
+	__m128i x = _mm_and_si128(s, _mm_set1_epi8(0x7F));
+	__m128i lo = _mm_and_si128(x, _mm_set1_epi8(0x0F));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi8(0x0F));
+	__m128i v = _mm_setzero_si128();
+
+	for (int k = 0; k < 8; k++) {
+		__m128i t = _mm_load_si128((const __m128i *)(value_table.v + k *16));
+		__m128i m = _mm_cmpeq_epi8(hi, _mm_set1_epi8(k));
+		v = _mm_or_si128(v, _mm_and_si128(_mm_shuffle_epi8(t, lo), m));
+	}
+
+	return v;
+}
+
+__attribute__((target("sse4.1")))
+static void decode16(const uint8_t *frames, size_t at, struct adm20_batch *b) {
+	alignas(32) uint8_t cols[COL_COUNT][32];
+	__m128i c[COL_COUNT];
+	__m128i zero = _mm_setzero_si128();
+
+	gather(frames + at *ADM20_FRAME_SIZE, 16, cols);
+	for (int i = 0; i < COL_COUNT; i++) c[i] = _mm_load_si128((const __m128i *)cols[i]);
+
+	__m128i v4 = lookup16(c[COL_D4]);
+	__m128i v5 = lookup16(c[COL_D5]);
+	__m128i v6 = lookup16(c[COL_D6]);
+	__m128i v7 = lookup16(c[COL_D7]);
+
+	__m128i nan = _mm_cmplt_epi8(_mm_or_si128(_mm_or_si128(v4, v5), _mm_or_si128(v6, v7)), zero);
+	__m128i neg = _mm_cmpeq_epi8(_mm_and_si128(c[COL_D8], _mm_set1_epi8(0x08)), _mm_set1_epi8(0x08));
+
+	__m128i L = _mm_set1_epi8(0x58);
+	__m128i m7 = _mm_set1_epi8(0x7F);
+	__m128i ol = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(c[COL_D4], m7), L), _mm_cmpeq_epi8(_mm_and_si128(c[COL_D5], m7), L)),
+			_mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(c[COL_D6], m7), L), _mm_cmpeq_epi8(_mm_and_si128(c[COL_D7], m7), L)));
+
+	__m128i flags = _mm_and_si128(neg, _mm_set1_epi8(ADM20_READING_NEGATIVE));
+	flags = _mm_or_si128(flags, _mm_and_si128(nan, _mm_set1_epi8(ADM20_READING_NAN)));
+	flags = _mm_or_si128(flags, _mm_and_si128(_mm_and_si128(nan, ol), _mm_set1_epi8(ADM20_READING_OVERLOAD)));
+
+	__m128i exp = zero;
+	exp = _mm_blendv_epi8(exp, _mm_set1_epi8(-1), _mm_cmplt_epi8(c[COL_D4], zero));
+	exp = _mm_blendv_epi8(exp, _mm_set1_epi8(-2), _mm_cmplt_epi8(c[COL_D5], zero));
+	exp = _mm_blendv_epi8(exp, _mm_set1_epi8(-3), _mm_cmplt_epi8(c[COL_D6], zero));
+	exp = _mm_andnot_si128(nan, exp);
+
+	__m128i unit = zero;
+	for (auto &u : unit_bits) {
+		__m128i bit = _mm_set1_epi8(u.bit);
+		__m128i m = _mm_cmpeq_epi8(_mm_and_si128(c[u.col], bit), bit);
+		unit = _mm_blendv_epi8(unit, _mm_set1_epi8(u.code), m);
+	}
+
+	__m128i prefix = zero;
+	for (auto &p : prefix_bits) {
+		__m128i bit = _mm_set1_epi8(p.bit);
+		__m128i m = _mm_cmpeq_epi8(_mm_and_si128(c[p.col], bit), bit);
+		prefix = _mm_blendv_epi8(prefix, _mm_set1_epi8(p.code), m);
+	}
+
+	_mm_storeu_si128((__m128i *)(b->exponent + at), exp);
+	_mm_storeu_si128((__m128i *)(b->unit + at), unit);
+	_mm_storeu_si128((__m128i *)(b->prefix + at), prefix);
+	_mm_storeu_si128((__m128i *)(b->flags + at), flags);
+
+	/*
+	 * Mantissa in 16 bit lanes (9999 max), then widened for the
+	 * sign and the int32 store.  NaN lanes come out as 0.
+	 *
+	 */
+	for (int h = 0; h < 2; h++) {
+		__m128i d4 = _mm_cvtepu8_epi16(h ? _mm_srli_si128(v4, 8) : v4);
+		__m128i d5 = _mm_cvtepu8_epi16(h ? _mm_srli_si128(v5, 8) : v5);
+		__m128i d6 = _mm_cvtepu8_epi16(h ? _mm_srli_si128(v6, 8) : v6);
+		__m128i d7 = _mm_cvtepu8_epi16(h ? _mm_srli_si128(v7, 8) : v7);
+		__m128i m = _mm_add_epi16(
+				_mm_add_epi16(_mm_mullo_epi16(d7, _mm_set1_epi16(1000)), _mm_mullo_epi16(d6, _mm_set1_epi16(100))),
+				_mm_add_epi16(_mm_mullo_epi16(d5, _mm_set1_epi16(10)), d4));
+		__m128i n16 = _mm_cvtepi8_epi16(h ? _mm_srli_si128(neg, 8) : neg);
+		__m128i z16 = _mm_cvtepi8_epi16(h ? _mm_srli_si128(nan, 8) : nan);
+
+		m = _mm_sub_epi16(_mm_xor_si128(m, n16), n16); // negate where n16 is all ones
+		m = _mm_andnot_si128(z16, m);
+
+		_mm_storeu_si128((__m128i *)(b->mantissa + at + h *8), _mm_cvtepi16_epi32(m));
+		_mm_storeu_si128((__m128i *)(b->mantissa + at + h *8 +4), _mm_cvtepi16_epi32(_mm_srli_si128(m, 8)));
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lookup32(__m256i s) {
+	__m256i x = _mm256_and_si256(s, _mm256_set1_epi8(0x7F));
+	__m256i lo = _mm256_and_si256(x, _mm256_set1_epi8(0x0F));
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), _mm256_set1_epi8(0x0F));
+	__m256i v = _mm256_setzero_si256();
+
+	for (int k = 0; k < 8; k++) {
+		__m256i t = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(value_table.v + k *16)));
+		__m256i m = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k));
+		v = _mm256_or_si256(v, _mm256_and_si256(_mm256_shuffle_epi8(t, lo), m));
+	}
+
+	return v;
+}
+
+__attribute__((target("avx2")))
+static void decode32(const uint8_t *frames, size_t at, struct adm20_batch *b) {
+	alignas(32) uint8_t cols[COL_COUNT][32];
+	__m256i c[COL_COUNT];
+	__m256i zero = _mm256_setzero_si256();
+
+	gather(frames + at *ADM20_FRAME_SIZE, 32, cols);
+	for (int i = 0; i < COL_COUNT; i++) c[i] = _mm256_load_si256((const __m256i *)cols[i]);
+
+	__m256i v4 = lookup32(c[COL_D4]);
+	__m256i v5 = lookup32(c[COL_D5]);
+	__m256i v6 = lookup32(c[COL_D6]);
+	__m256i v7 = lookup32(c[COL_D7]);
+
+	__m256i nan = _mm256_cmpgt_epi8(zero, _mm256_or_si256(_mm256_or_si256(v4, v5), _mm256_or_si256(v6, v7)));
+	__m256i neg = _mm256_cmpeq_epi8(_mm256_and_si256(c[COL_D8], _mm256_set1_epi8(0x08)), _mm256_set1_epi8(0x08));
+
+	__m256i L = _mm256_set1_epi8(0x58);
+	__m256i m7 = _mm256_set1_epi8(0x7F);
+	__m256i ol = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_and_si256(c[COL_D4], m7), L), _mm256_cmpeq_epi8(_mm256_and_si256(c[COL_D5], m7), L)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_and_si256(c[COL_D6], m7), L), _mm256_cmpeq_epi8(_mm256_and_si256(c[COL_D7], m7), L)));
+
+	__m256i flags = _mm256_and_si256(neg, _mm256_set1_epi8(ADM20_READING_NEGATIVE));
+	flags = _mm256_or_si256(flags, _mm256_and_si256(nan, _mm256_set1_epi8(ADM20_READING_NAN)));
+	flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_and_si256(nan, ol), _mm256_set1_epi8(ADM20_READING_OVERLOAD)));
+
+	__m256i exp = zero;
+	exp = _mm256_blendv_epi8(exp, _mm256_set1_epi8(-1), _mm256_cmpgt_epi8(zero, c[COL_D4]));
+	exp = _mm256_blendv_epi8(exp, _mm256_set1_epi8(-2), _mm256_cmpgt_epi8(zero, c[COL_D5]));
+	exp = _mm256_blendv_epi8(exp, _mm256_set1_epi8(-3), _mm256_cmpgt_epi8(zero, c[COL_D6]));
+	exp = _mm256_andnot_si256(nan, exp);
+
+	__m256i unit = zero;
+	for (auto &u : unit_bits) {
+		__m256i bit = _mm256_set1_epi8(u.bit);
+		__m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(c[u.col], bit), bit);
+		unit = _mm256_blendv_epi8(unit, _mm256_set1_epi8(u.code), m);
+	}
+
+	__m256i prefix = zero;
+	for (auto &p : prefix_bits) {
+		__m256i bit = _mm256_set1_epi8(p.bit);
+		__m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(c[p.col], bit), bit);
+		prefix = _mm256_blendv_epi8(prefix, _mm256_set1_epi8(p.code), m);
+	}
+
+	_mm256_storeu_si256((__m256i *)(b->exponent + at), exp);
+	_mm256_storeu_si256((__m256i *)(b->unit + at), unit);
+	_mm256_storeu_si256((__m256i *)(b->prefix + at), prefix);
+	_mm256_storeu_si256((__m256i *)(b->flags + at), flags);
+
+	for (int h = 0; h < 2; h++) {
+		__m256i d4 = _mm256_cvtepu8_epi16(h ? _mm256_extracti128_si256(v4, 1) : _mm256_castsi256_si128(v4));
+		__m256i d5 = _mm256_cvtepu8_epi16(h ? _mm256_extracti128_si256(v5, 1) : _mm256_castsi256_si128(v5));
+		__m256i d6 = _mm256_cvtepu8_epi16(h ? _mm256_extracti128_si256(v6, 1) : _mm256_castsi256_si128(v6));
+		__m256i d7 = _mm256_cvtepu8_epi16(h ? _mm256_extracti128_si256(v7, 1) : _mm256_castsi256_si128(v7));
+		__m256i m = _mm256_add_epi16(
+				_mm256_add_epi16(_mm256_mullo_epi16(d7, _mm256_set1_epi16(1000)), _mm256_mullo_epi16(d6, _mm256_set1_epi16(100))),
+				_mm256_add_epi16(_mm256_mullo_epi16(d5, _mm256_set1_epi16(10)), d4));
+		__m256i n16 = _mm256_cvtepi8_epi16(h ? _mm256_extracti128_si256(neg, 1) : _mm256_castsi256_si128(neg));
+		__m256i z16 = _mm256_cvtepi8_epi16(h ? _mm256_extracti128_si256(nan, 1) : _mm256_castsi256_si128(nan));
+
+		m = _mm256_sub_epi16(_mm256_xor_si256(m, n16), n16);
+		m = _mm256_andnot_si256(z16, m);
+
+		_mm256_storeu_si256((__m256i *)(b->mantissa + at + h *16), _mm256_cvtepi16_epi32(_mm256_castsi256_si128(m)));
+		_mm256_storeu_si256((__m256i *)(b->mantissa + at + h *16 +8), _mm256_cvtepi16_epi32(_mm256_extracti128_si256(m, 1)));
+	}
+}
+
+#endif
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_decode_batch_path
+  Returns Type	: int
+  ----Parameter List
+  1. const uint8_t *frames, count *ADM20_FRAME_SIZE packed frames
+  2. size_t count,
+  3. struct adm20_batch *b, arrays of at least count entries each
+  4. int path, ADM20_BATCH_*
+  ------------------
+  Exit Codes	: the widest path actually used, -1 if the CPU can't
+  		  run the one asked for
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Lets the benchmark pin each path so they can be checked
+	against adm20_decode() on the same machine.  A forced path
+	still finishes the tail with the narrower ones.
+
+\------------------------------------------------------------------*/
+int adm20_decode_batch_path(const uint8_t *frames, size_t count, struct adm20_batch *b, int path) {
+	size_t i = 0;
+	int used = ADM20_BATCH_SCALAR;
+
+#ifdef ADM20_BATCH_X86
+	int avx2 = __builtin_cpu_supports("avx2");
+	int sse41 = __builtin_cpu_supports("sse4.1");
+
+	if ((path == ADM20_BATCH_AVX2 && !avx2) || (path == ADM20_BATCH_SSE41 && !sse41)) return -1;
+
+	if (avx2 && (path == ADM20_BATCH_AUTO || path == ADM20_BATCH_AVX2)) {
+		for (; i + 32 <= count; i += 32) decode32(frames, i, b);
+		used = ADM20_BATCH_AVX2;
+	}
+	if (sse41 && path != ADM20_BATCH_SCALAR) {
+		for (; i + 16 <= count; i += 16) decode16(frames, i, b);
+		if (used == ADM20_BATCH_SCALAR) used = ADM20_BATCH_SSE41;
+	}
+#else
+	if (path == ADM20_BATCH_AVX2 || path == ADM20_BATCH_SSE41) return -1;
+#endif
+
+	decode_scalar(frames, i, count, b);
+
+	return used;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_decode_batch
+  Returns Type	: void
+  ----Parameter List
+  1. const uint8_t *frames, count *ADM20_FRAME_SIZE packed frames
+  2. size_t count,
+  3. struct adm20_batch *b, arrays of at least count entries each
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Picks the widest vector unit the CPU has at run time.  Frames
+	aren't validated here, feed it what adm20_reader_next() passed.
+
+\------------------------------------------------------------------*/
+void adm20_decode_batch(const uint8_t *frames, size_t count, struct adm20_batch *b) {
+	adm20_decode_batch_path(frames, count, b, ADM20_BATCH_AUTO);
+}
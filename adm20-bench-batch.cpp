@@ -0,0 +1,192 @@
+/*
+ * BSIDE-ADM20 batch decode check and benchmark
+ *
+ * Runs the same random frames through each adm20_decode_batch_path()
+ * this CPU can do (AVX2, SSE4.1, scalar) and compares every field
+ * against adm20_decode() one frame at a time, then times each path.
+ * Any mismatch is printed and the run exits non-zero, so it doubles
+ * as the test for the vector code.
+ *
+ * Half the frames are fully random bytes so every segment pattern,
+ * decimal point and annunciator combination gets a look in, the
+ * other half are built from real digits so the numeric lanes are
+ * exercised as much as the NaN ones.
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+
+#define FL __FILE__,__LINE__
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define DEFAULT_FRAMES 1000003  // not a multiple of 32, so the tails get checked too
+#define DEFAULT_ROUNDS 5
+#define MAX_REPORTED 10
+
+static const struct { int path; const char *name; } paths[] = {
+	{ ADM20_BATCH_AVX2, "avx2" },
+	{ ADM20_BATCH_SSE41, "sse4.1" },
+	{ ADM20_BATCH_SCALAR, "scalar" },
+};
+
+static int batch_alloc(struct adm20_batch *b, size_t count) {
+	b->mantissa = (int32_t *)calloc(count, sizeof(int32_t));
+	b->exponent = (int8_t *)calloc(count, 1);
+	b->prefix = (uint8_t *)calloc(count, 1);
+	b->unit = (uint8_t *)calloc(count, 1);
+	b->flags = (uint8_t *)calloc(count, 1);
+
+	return (b->mantissa && b->exponent && b->prefix && b->unit && b->flags) ? 0 : -1;
+}
+
+static void make_frames(uint8_t *frames, size_t count) {
+	static const uint8_t codes[] = { 0x5F, 0x06, 0x6B, 0x2F, 0x36, 0x3D, 0x7D, 0x07, 0x7F, 0x3F };
+	size_t i;
+	int j;
+
+	for (i = 0; i < count; i++) {
+		uint8_t *d = frames + i *ADM20_FRAME_SIZE;
+
+		for (j = 0; j < ADM20_FRAME_SIZE; j++) d[j] = rand();
+		if (i & 1) {
+			for (j = 4; j < 8; j++) d[j] = codes[rand() % sizeof(codes)] | (d[j] & ADM20_SEGMENT_DP);
+		}
+		d[ADM20_FRAME_SIZE -1] = ADM20_FRAME_END;
+	}
+}
+
+/*
+ * Field by field against adm20_decode(), the batch has no mode,
+ * timestamp or segment copy so only the shared fields are checked.
+ *
+ */
+static size_t compare(const uint8_t *frames, size_t count, const struct adm20_batch *b, const char *name) {
+	struct adm20_reading r;
+	size_t i, bad = 0;
+
+	for (i = 0; i < count; i++) {
+		const uint8_t *d = frames + i *ADM20_FRAME_SIZE;
+
+		adm20_decode(d, 0, &r);
+		if (b->mantissa[i] == r.mantissa
+				&& b->exponent[i] == r.exponent
+				&& b->prefix[i] == r.prefix
+				&& b->unit[i] == r.unit
+				&& b->flags[i] == r.flags) continue;
+
+		if (bad++ < MAX_REPORTED) {
+			fprintf(stderr,"%s:%d: %s frame %zu [%02x %02x %02x %02x %02x .. %02x %02x]:"
+					" mantissa %d/%d exponent %d/%d prefix %d/%d unit %d/%d flags %02x/%02x\r\n"
+					, FL, name, i, d[4], d[5], d[6], d[7], d[8], d[18], d[19]
+					, b->mantissa[i], r.mantissa
+					, b->exponent[i], r.exponent
+					, b->prefix[i], r.prefix
+					, b->unit[i], r.unit
+					, b->flags[i], r.flags
+					);
+		}
+	}
+
+	return bad;
+}
+
+int main(int argc, char **argv) {
+	struct adm20_batch b;
+	struct adm20_reading r;
+	size_t count = DEFAULT_FRAMES, bad, failed = 0, i;
+	int rounds = DEFAULT_ROUNDS, k, p;
+	uint64_t t, best, sum = 0;
+	uint8_t *frames;
+
+	for (k = 1; k < argc; k++) {
+		if (argv[k][0] != '-') continue;
+		switch (argv[k][1]) {
+			case 'n': if (++k < argc) count = strtoul(argv[k], NULL, 10); break;
+			case 'r': if (++k < argc) rounds = atoi(argv[k]); break;
+			case 'h':
+				fprintf(stdout,"BSIDE ADM20 batch decode check and benchmark\r\n"
+						"Build %d / %s\r\n"
+						"\r\n"
+						" [-n <frames>] [-r <rounds>]\r\n"
+						"\r\n"
+						"\t-n <frames>: Frames per round (default %d)\r\n"
+						"\t-r <rounds>: Best of this many rounds (default %d)\r\n"
+						, BUILD_VER, BUILD_DATE, DEFAULT_FRAMES, DEFAULT_ROUNDS);
+				exit(0);
+		}
+	}
+	if (!count || rounds < 1) {
+		fprintf(stderr,"%s:%d: Need at least one frame and one round\r\n", FL);
+		exit(1);
+	}
+
+	frames = (uint8_t *)malloc(count *ADM20_FRAME_SIZE);
+	if (!frames || batch_alloc(&b, count)) {
+		fprintf(stderr,"%s:%d: Unable to allocate %zu frames\r\n", FL, count);
+		exit(1);
+	}
+	srand(1);
+	make_frames(frames, count);
+
+	fprintf(stdout,"%zu frames, best of %d\r\n", count, rounds);
+
+	best = 0;
+	for (k = 0; k < rounds; k++) {
+		t = adm20_monotonic_ns();
+		for (i = 0; i < count; i++) {
+			adm20_decode(frames + i *ADM20_FRAME_SIZE, 0, &r);
+			sum += r.mantissa;
+		}
+		t = adm20_monotonic_ns() - t;
+		if (!k || t < best) best = t;
+	}
+	fprintf(stdout,"  %-14s %8.2f ns/frame %12.0f frames/s\r\n", "adm20_decode()", best / (double)count, count *1e9 / best);
+
+	for (p = 0; p < (int)(sizeof(paths) / sizeof(paths[0])); p++) {
+		memset(b.mantissa, 0x55, count *sizeof(int32_t));
+		memset(b.flags, 0x55, count);
+		if (adm20_decode_batch_path(frames, count, &b, paths[p].path) < 0) {
+			fprintf(stdout,"  %-14s not supported on this CPU, skipped\r\n", paths[p].name);
+			continue;
+		}
+
+		bad = compare(frames, count, &b, paths[p].name);
+		failed += bad;
+
+		best = 0;
+		for (k = 0; k < rounds; k++) {
+			t = adm20_monotonic_ns();
+			adm20_decode_batch_path(frames, count, &b, paths[p].path);
+			t = adm20_monotonic_ns() - t;
+			if (!k || t < best) best = t;
+			sum += b.mantissa[k % count];
+		}
+		fprintf(stdout,"  %-14s %8.2f ns/frame %12.0f frames/s  %s\r\n"
+				, paths[p].name, best / (double)count, count *1e9 / best
+				, bad ? "MISMATCH" : "ok");
+	}
+
+	fprintf(stdout,"( checksum %llu )\r\n", (unsigned long long)sum);
+
+	if (failed) {
+		fprintf(stderr,"%s:%d: %zu frames decoded differently from adm20_decode()\r\n", FL, failed);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * BSIDE-ADM20 decode microbenchmark
+ *
+ * The segment table and adm20_decode() against the digit() switch
+ * and snprintf() chain they replaced, kept here as the reference.
+ * Both run over the same random frames; the old path builds the
+ * display string the way the front ends used to, the new one is
+ * timed both bare (typed reading only) and with
+ * adm20_reading_format() on top, which is the fair comparison for
+ * the sinks that still want text.
+ *
+ * Every digit the old switch knows has to come out the same from
+ * adm20_digit(), the run fails if one doesn't.
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+
+#define FL __FILE__,__LINE__
+
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define SSIZE 1024
+
+#define uu "µ"
+#define dd "°"
+#define oo "Ω"
+
+#define DEFAULT_FRAMES 1000000
+#define DEFAULT_ROUNDS 5
+
+/*
+ * The original, as it was in each of the front ends
+ *
+ */
+static char digit( unsigned char dg ) {
+
+	char g;
+
+	switch ((dg) & 0x7F) {
+		case 0x5F: g = '0'; break;
+		case 0x06: g = '1'; break;
+		case 0x6B: g = '2'; break;
+		case 0x2F: g = '3'; break;
+		case 0x36: g = '4'; break;
+		case 0x3D: g = '5'; break;
+		case 0x7D: g = '6'; break;
+		case 0x07: g = '7'; break;
+		case 0x7F: g = '8'; break;
+		case 0x3F: g = '9'; break;
+		case 0x79: g = 'E'; break;
+		case 0x58: g = 'L'; break;
+		default: g = ' ';
+	}
+	return g;
+}
+
+static int old_decode(const uint8_t *d, char *linetmp, size_t len) {
+	char prefix[SSIZE], units[SSIZE], mmmode[SSIZE];
+
+	snprintf(prefix, sizeof(prefix), " ");
+	units[0] = '\0';
+	mmmode[0] = '\0';
+
+	if (d[16] & 0x80) snprintf(mmmode,sizeof(mmmode),"REL");
+	if (d[16] & 0x20) snprintf(mmmode,sizeof(mmmode),"AUTO");
+
+	if (d[17] & 0x40) snprintf(mmmode,sizeof(mmmode),"hFE");
+	if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"%%");
+	if (d[17] & 0x08) snprintf(mmmode,sizeof(mmmode),"MIN");
+
+	if (d[18] & 0x80) snprintf(units,sizeof(units),"F");
+	if (d[18] & 0x40) snprintf(prefix,sizeof(prefix),"n");
+	if (d[18] & 0x20) snprintf(prefix,sizeof(prefix),"%s",uu);
+	if (d[18] & 0x02) snprintf(units,sizeof(units),"%sF",dd);
+	if (d[18] & 0x01) snprintf(units,sizeof(units),"%sC",dd);
+
+	if (d[19] & 0x80) snprintf(units,sizeof(units),"Hz");
+	if (d[19] & 0x40) snprintf(units,sizeof(units),"%s",oo);
+	if (d[19] & 0x20) snprintf(prefix,sizeof(prefix),"k");
+	if (d[19] & 0x10) snprintf(prefix,sizeof(prefix),"M");
+	if (d[19] & 0x08) snprintf(units,sizeof(units),"V");
+	if (d[19] & 0x04) snprintf(units,sizeof(units),"A");
+	if (d[19] & 0x02) snprintf(prefix,sizeof(prefix),"m");
+	if (d[19] & 0x01) snprintf(prefix,sizeof(prefix),"%s",uu);
+
+	return snprintf(linetmp,len, "%s%c%s%c%s%c%s%c%s%s"
+			, d[8]&0x08?"-":" "
+			, digit(d[7])
+			, d[6]&0x80?".":""
+			, digit(d[6])
+			, d[5]&0x80?".":""
+			, digit(d[5])
+			, d[4]&0x80?".":""
+			, digit(d[4])
+			, prefix
+			, units
+			);
+}
+
+/*
+ * Mostly digits with the odd letter, one unit and one prefix bit,
+ * the way a real meter's frames look
+ *
+ */
+static void make_frames(uint8_t *frames, size_t count) {
+	static const uint8_t codes[] = { 0x5F, 0x06, 0x6B, 0x2F, 0x36, 0x3D, 0x7D, 0x07, 0x7F, 0x3F, 0x00, 0x79, 0x58, 0x20 };
+	size_t i;
+	int j;
+
+	for (i = 0; i < count; i++) {
+		uint8_t *d = frames + i *ADM20_FRAME_SIZE;
+
+		memset(d, 0, ADM20_FRAME_SIZE);
+		for (j = 4; j < 8; j++) d[j] = codes[rand() % sizeof(codes)];
+		if (rand() & 1) d[4 + rand() % 3] |= ADM20_SEGMENT_DP;
+		if (rand() & 1) d[8] |= 0x08;
+		d[16] = rand() & 0xA0;
+		d[17] = rand() & 0x68;
+		if (rand() & 1) d[18] = 1 << (rand() % 8);
+		else d[19] = 1 << (rand() % 8);
+		d[ADM20_FRAME_SIZE -1] = ADM20_FRAME_END;
+	}
+}
+
+static double run_old(const uint8_t *frames, size_t count, uint64_t *sum) {
+	char line[SSIZE];
+	uint64_t t = adm20_monotonic_ns();
+	size_t i;
+
+	for (i = 0; i < count; i++) *sum += old_decode(frames + i *ADM20_FRAME_SIZE, line, sizeof(line)) + line[1];
+
+	return (adm20_monotonic_ns() - t) / (double)count;
+}
+
+static double run_new(const uint8_t *frames, size_t count, int format, uint64_t *sum) {
+	struct adm20_reading r;
+	char line[SSIZE];
+	uint64_t t = adm20_monotonic_ns();
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		adm20_decode(frames + i *ADM20_FRAME_SIZE, 0, &r);
+		*sum += r.mantissa + r.unit;
+		if (format) *sum += adm20_reading_format(&r, line, sizeof(line), ADM20_FORMAT_DISPLAY);
+	}
+
+	return (adm20_monotonic_ns() - t) / (double)count;
+}
+
+int main(int argc, char **argv) {
+	size_t count = DEFAULT_FRAMES;
+	int rounds = DEFAULT_ROUNDS, i;
+	double best_old = 0, best_new = 0, best_fmt = 0, ns;
+	uint64_t sum = 0;
+	uint8_t *frames;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') continue;
+		switch (argv[i][1]) {
+			case 'n': if (++i < argc) count = strtoul(argv[i], NULL, 10); break;
+			case 'r': if (++i < argc) rounds = atoi(argv[i]); break;
+			case 'h':
+				fprintf(stdout,"BSIDE ADM20 decode microbenchmark\r\n"
+						"Build %d / %s\r\n"
+						"\r\n"
+						" [-n <frames>] [-r <rounds>]\r\n"
+						"\r\n"
+						"\t-n <frames>: Frames per round (default %d)\r\n"
+						"\t-r <rounds>: Best of this many rounds (default %d)\r\n"
+						, BUILD_VER, BUILD_DATE, DEFAULT_FRAMES, DEFAULT_ROUNDS);
+				exit(0);
+		}
+	}
+	if (!count || rounds < 1) {
+		fprintf(stderr,"%s:%d: Need at least one frame and one round\r\n", FL);
+		exit(1);
+	}
+
+	/*
+	 * The table has to agree with the switch on everything the
+	 * switch knew, it only adds patterns the switch showed blank
+	 *
+	 */
+	for (i = 0; i < 256; i++) {
+		if (digit(i) != ' ' && adm20_digit(i) != digit(i)) {
+			fprintf(stderr,"%s:%d: segment 0x%02x: switch '%c', table '%c'\r\n", FL, i, digit(i), adm20_digit(i));
+			exit(1);
+		}
+	}
+
+	frames = (uint8_t *)malloc(count *ADM20_FRAME_SIZE);
+	if (!frames) {
+		fprintf(stderr,"%s:%d: Unable to allocate %zu frames\r\n", FL, count);
+		exit(1);
+	}
+	srand(1);
+	make_frames(frames, count);
+
+	for (i = 0; i < rounds; i++) {
+		ns = run_old(frames, count, &sum);
+		if (!i || ns < best_old) best_old = ns;
+		ns = run_new(frames, count, 0, &sum);
+		if (!i || ns < best_new) best_new = ns;
+		ns = run_new(frames, count, 1, &sum);
+		if (!i || ns < best_fmt) best_fmt = ns;
+	}
+
+	fprintf(stdout,"%zu frames, best of %d ( checksum %llu )\r\n", count, rounds, (unsigned long long)sum);
+	fprintf(stdout,"  digit() switch + snprintf   %8.1f ns/frame %12.0f frames/s\r\n", best_old, 1e9 / best_old);
+	fprintf(stdout,"  adm20_decode()              %8.1f ns/frame %12.0f frames/s  %6.1fx\r\n", best_new, 1e9 / best_new, best_old / best_new);
+	fprintf(stdout,"  adm20_decode() + format     %8.1f ns/frame %12.0f frames/s  %6.1fx\r\n", best_fmt, 1e9 / best_fmt, best_old / best_fmt);
+
+	free(frames);
+
+	return 0;
+}
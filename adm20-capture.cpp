@@ -0,0 +1,569 @@
+/*
+ * BSIDE-ADM20 raw frame capture files
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adm20-capture.h"
+
+#define FL __FILE__,__LINE__
+
+static int64_t realtime_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec *1000000000LL + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *p, size_t len) {
+	const uint8_t *b = (const uint8_t *)p;
+
+	while (len > 0) {
+		ssize_t w = write(fd, b, len);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		b += w;
+		len -= w;
+	}
+
+	return 0;
+}
+
+static int footer_valid(const struct adm20_capture_footer *f, uint64_t size) {
+	if (memcmp(f->magic, ADM20_CAPTURE_INDEX_MAGIC, sizeof(f->magic))) return 0;
+	if (!f->every) return 0;
+	if (f->records > size || f->entries > size) return 0;
+
+	return sizeof(struct adm20_capture_header)
+		+ f->records *sizeof(struct adm20_capture_record)
+		+ f->entries *sizeof(struct adm20_capture_index)
+		+ sizeof(struct adm20_capture_footer) == size;
+}
+
+/*
+ * The index is allocated once in adm20_capture_open() and never
+ * grows, so capturing stays allocation free.  When it fills, every
+ * other entry is dropped and the spacing doubles, which keeps the
+ * search to a handful of pages and costs one pass over an array
+ * that is only touched once every few thousand records.
+ *
+ */
+static void index_add(struct adm20_capture *c, int64_t wall, uint64_t record) {
+	if (!c->index_ok) return;
+
+	if (c->index_count == c->index_size) {
+		uint64_t i;
+
+		for (i = 0; i < (c->index_count +1) / 2; i++) c->index[i] = c->index[i *2];
+		c->index_count = i;
+		c->index_every *= 2;
+		if (record % c->index_every) return;
+	}
+
+	c->index[c->index_count].wall = wall;
+	c->index[c->index_count].record = record;
+	c->index_count++;
+}
+
+int adm20_capture_check_header(const struct adm20_capture_header *h) {
+	if (memcmp(h->magic, ADM20_CAPTURE_MAGIC, sizeof(h->magic))) return -1;
+	if (h->version != ADM20_CAPTURE_VERSION) return -1;
+	if (h->header_size != sizeof(struct adm20_capture_header)) return -1;
+	if (h->record_size != sizeof(struct adm20_capture_record)) return -1;
+	if (h->frame_size != ADM20_FRAME_SIZE) return -1;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_capture_open
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_capture *c,
+  2. const char *path,
+  3. int sync_interval, seconds between fsync()s, 0 to only sync on close
+  ------------------
+  Exit Codes	: 0 on success, -1 with the reason already reported
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	An existing capture is appended to, as long as its header
+	matches what we write.  Its index footer, or a partial record
+	left by a crash, is trimmed off so the records stay aligned,
+	and the in-memory index is rebuilt by reading one record in
+	every ADM20_CAPTURE_INDEX_EVERY.
+
+	The index gets all the memory it will ever use here, room for
+	ADM20_CAPTURE_INDEX_ENTRIES or twice what the existing capture
+	needs, whichever is more.  If that can't be had the capture
+	still goes ahead, it just won't get a footer.
+
+\------------------------------------------------------------------*/
+int adm20_capture_open(struct adm20_capture *c, const char *path, int sync_interval) {
+	struct adm20_capture_header h;
+	struct stat st;
+	uint64_t need;
+
+	c->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (c->fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open capture file '%s' (%s)\r\n", FL, path, strerror(errno));
+		return -1;
+	}
+
+	c->sync_interval = sync_interval;
+	c->last_sync = adm20_monotonic_ns();
+	c->records = 0;
+	c->total = 0;
+	c->used = 0;
+	c->index_ok = 1;
+	c->index_count = 0;
+	c->index_every = ADM20_CAPTURE_INDEX_EVERY;
+
+	fstat(c->fd, &st);
+	need = (uint64_t)st.st_size / sizeof(struct adm20_capture_record) / ADM20_CAPTURE_INDEX_EVERY *2;
+	c->index_size = need > ADM20_CAPTURE_INDEX_ENTRIES ? need : ADM20_CAPTURE_INDEX_ENTRIES;
+	c->index = (struct adm20_capture_index *)malloc(c->index_size *sizeof(struct adm20_capture_index));
+	if (!c->index) {
+		/*
+		 * No footer is better than a wrong one, readers fall
+		 * back to searching the records directly.
+		 *
+		 */
+		c->index_ok = 0;
+		c->index_size = 0;
+	}
+
+	if (st.st_size == 0) {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, ADM20_CAPTURE_MAGIC, sizeof(h.magic));
+		h.version = ADM20_CAPTURE_VERSION;
+		h.header_size = sizeof(struct adm20_capture_header);
+		h.record_size = sizeof(struct adm20_capture_record);
+		h.frame_size = ADM20_FRAME_SIZE;
+		h.created_mono = adm20_monotonic_ns();
+		h.created_wall = realtime_ns();
+
+		if (write_all(c->fd, &h, sizeof(h))) {
+			fprintf(stderr,"%s:%d: Unable to write capture header to '%s' (%s)\r\n", FL, path, strerror(errno));
+			close(c->fd);
+			c->fd = -1;
+			free(c->index);
+			c->index = NULL;
+			return -1;
+		}
+
+	} else {
+		struct adm20_capture_footer ft;
+		struct adm20_capture_record rec;
+		off_t end = st.st_size;
+		uint64_t n;
+
+		if (pread(c->fd, &h, sizeof(h), 0) != sizeof(h) || adm20_capture_check_header(&h)) {
+			fprintf(stderr,"%s:%d: '%s' exists and is not an ADM20 capture file\r\n", FL, path);
+			close(c->fd);
+			c->fd = -1;
+			free(c->index);
+			c->index = NULL;
+			return -1;
+		}
+
+		if (pread(c->fd, &ft, sizeof(ft), st.st_size - sizeof(ft)) == sizeof(ft) && footer_valid(&ft, st.st_size)) {
+			end = sizeof(h) + ft.records *sizeof(struct adm20_capture_record);
+		}
+
+		end -= (end - sizeof(h)) % sizeof(struct adm20_capture_record);
+		if (end != st.st_size && ftruncate(c->fd, end)) {
+			fprintf(stderr,"%s:%d: Unable to trim '%s' for appending (%s)\r\n", FL, path, strerror(errno));
+			close(c->fd);
+			c->fd = -1;
+			free(c->index);
+			c->index = NULL;
+			return -1;
+		}
+
+		c->total = (end - sizeof(h)) / sizeof(struct adm20_capture_record);
+		for (n = 0; n < c->total; n += c->index_every) {
+			if (pread(c->fd, &rec, sizeof(rec), sizeof(h) + n *sizeof(rec)) != sizeof(rec)) break;
+			index_add(c, adm20_capture_wall(&rec), n);
+		}
+	}
+
+	lseek(c->fd, 0, SEEK_END);
+
+	return 0;
+}
+
+int adm20_capture_flush(struct adm20_capture *c) {
+	int r = 0;
+
+	if (c->fd < 0 || !c->used) return 0;
+
+	r = write_all(c->fd, c->buf, c->used *sizeof(struct adm20_capture_record));
+	c->used = 0;
+
+	return r;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_capture_write
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_capture *c,
+  2. uint64_t mono, CLOCK_MONOTONIC ns the frame arrived
+  3. uint16_t status, ADM20_CAPTURE_*
+  4. const uint8_t *frame, NULL if there's nothing to keep
+  5. int len,
+  ------------------
+  Exit Codes	: 0, -1 if a flush failed
+  Side Effects	: may write() and fsync()
+  --------------------------------------------------------------------
+Comments:
+	Normally just a copy in to the record buffer.
+
+\------------------------------------------------------------------*/
+int adm20_capture_write(struct adm20_capture *c, uint64_t mono, uint16_t status, const uint8_t *frame, int len) {
+	struct adm20_capture_record *rec;
+	int r = 0;
+
+	if (c->fd < 0) return -1;
+
+	if (!frame || len < 0) len = 0;
+	if (len > ADM20_FRAME_SIZE) len = ADM20_FRAME_SIZE;
+
+	rec = &c->buf[c->used++];
+	memset(rec, 0, sizeof(*rec));
+	rec->mono = mono;
+	rec->wall_offset = realtime_ns() - (int64_t)adm20_monotonic_ns();
+	rec->status = status;
+	rec->len = len;
+	if (len) memcpy(rec->frame, frame, len);
+	c->records++;
+
+	if (c->total % c->index_every == 0) index_add(c, adm20_capture_wall(rec), c->total);
+	c->total++;
+
+	if (c->used == ADM20_CAPTURE_BUFFER) r = adm20_capture_flush(c);
+
+	if (c->sync_interval && mono - c->last_sync >= (uint64_t)c->sync_interval *1000000000ULL) {
+		if (adm20_capture_flush(c)) r = -1;
+		fdatasync(c->fd);
+		c->last_sync = mono;
+	}
+
+	return r;
+}
+
+void adm20_capture_close(struct adm20_capture *c) {
+	if (c->fd < 0) return;
+
+	if (!adm20_capture_flush(c) && c->index_ok) {
+		struct adm20_capture_footer ft;
+
+		memset(&ft, 0, sizeof(ft));
+		memcpy(ft.magic, ADM20_CAPTURE_INDEX_MAGIC, sizeof(ft.magic));
+		ft.every = c->index_every;
+		ft.entries = c->index_count;
+		ft.records = c->total;
+
+		if (write_all(c->fd, c->index, c->index_count *sizeof(struct adm20_capture_index)) == 0) {
+			write_all(c->fd, &ft, sizeof(ft));
+		}
+	}
+
+	fdatasync(c->fd);
+	close(c->fd);
+	c->fd = -1;
+
+	free(c->index);
+	c->index = NULL;
+	c->index_count = c->index_size = 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_capture_map_open
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_capture_map *m,
+  2. const char *path,
+  ------------------
+  Exit Codes	: 0 on success, -1 with the reason already reported
+  Side Effects	: maps the whole file
+  --------------------------------------------------------------------
+Comments:
+	Nothing is read here beyond the header and footer, pages come
+	in only as the records are searched or visited.  A capture
+	still being written has no footer yet, any partial record at
+	the end is ignored.
+
+\------------------------------------------------------------------*/
+int adm20_capture_map_open(struct adm20_capture_map *m, const char *path) {
+	const struct adm20_capture_footer *ft;
+	struct stat st;
+	void *p;
+	int fd;
+
+	memset(m, 0, sizeof(*m));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open capture file '%s' (%s)\r\n", FL, path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct adm20_capture_header)) {
+		fprintf(stderr,"%s:%d: '%s' is not an ADM20 capture file\r\n", FL, path);
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr,"%s:%d: Unable to map '%s' (%s)\r\n", FL, path, strerror(errno));
+		return -1;
+	}
+
+	m->base = (const uint8_t *)p;
+	m->size = st.st_size;
+	m->header = (const struct adm20_capture_header *)m->base;
+
+	if (adm20_capture_check_header(m->header)) {
+		fprintf(stderr,"%s:%d: '%s' is not an ADM20 capture file\r\n", FL, path);
+		adm20_capture_map_close(m);
+		return -1;
+	}
+
+	m->records = (const struct adm20_capture_record *)(m->base + sizeof(struct adm20_capture_header));
+
+	ft = (const struct adm20_capture_footer *)(m->base + m->size - sizeof(struct adm20_capture_footer));
+	if (m->size >= sizeof(struct adm20_capture_header) + sizeof(*ft) && footer_valid(ft, m->size)) {
+		m->count = ft->records;
+		m->index = (const struct adm20_capture_index *)(m->records + m->count);
+		m->index_count = ft->entries;
+		m->every = ft->every;
+	} else {
+		m->count = (m->size - sizeof(struct adm20_capture_header)) / sizeof(struct adm20_capture_record);
+	}
+
+	madvise((void *)m->base, m->size, MADV_RANDOM);
+
+	return 0;
+}
+
+void adm20_capture_map_close(struct adm20_capture_map *m) {
+	if (m->base) munmap((void *)m->base, m->size);
+	memset(m, 0, sizeof(*m));
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_capture_seek
+  Returns Type	: uint64_t
+  ----Parameter List
+  1. const struct adm20_capture_map *m,
+  2. int64_t wall, CLOCK_REALTIME ns
+  ------------------
+  Exit Codes	: the first record at or after wall, m->count if none
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Binary search of the index narrows it to one block of records,
+	then a binary search of that block.  Without an index the
+	records are searched directly, still O(log n) but over more
+	pages.  Assumes the wall clock only goes forward; a clock step
+	mid-capture just means times either side of it land close to,
+	rather than exactly on, the step.
+
+\------------------------------------------------------------------*/
+uint64_t adm20_capture_seek(const struct adm20_capture_map *m, int64_t wall) {
+	uint64_t lo = 0, hi = m->count;
+
+	if (m->index && m->index_count) {
+		uint64_t a = 0, b = m->index_count;
+
+		while (a < b) {
+			uint64_t mid = a + (b - a) / 2;
+			if (m->index[mid].wall < wall) a = mid +1;
+			else b = mid;
+		}
+
+		if (a > 0) lo = m->index[a -1].record;
+		if (a < m->index_count) hi = m->index[a].record;
+	}
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (adm20_capture_wall(&m->records[mid]) < wall) lo = mid +1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+adm20_capture_range adm20_capture_window(const struct adm20_capture_map *m, int64_t from, int64_t to) {
+	uint64_t first = adm20_capture_seek(m, from);
+	uint64_t last = adm20_capture_seek(m, to);
+
+	if (last < first) last = first;
+
+	return adm20_capture_range(m->records + first, m->records + last);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_replay_speed
+  Returns Type	: int
+  ----Parameter List
+  1. const char *s, "max", "Nx" or "N"
+  2. double *speed,
+  ------------------
+  Exit Codes	: 0 on success, -1 if it's not a speed
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+int adm20_replay_speed(const char *s, double *speed) {
+	char *end;
+	double v;
+
+	if (!strcmp(s, "max")) {
+		*speed = ADM20_REPLAY_MAX;
+		return 0;
+	}
+
+	v = strtod(s, &end);
+	if (end == s || v <= 0.0) return -1;
+	if (*end == 'x' || *end == 'X') end++;
+	if (*end) return -1;
+
+	*speed = v;
+
+	return 0;
+}
+
+int adm20_replay_open(struct adm20_replay *p, const char *path, double speed) {
+	if (adm20_capture_map_open(&p->map, path)) return -1;
+
+	madvise((void *)p->map.base, p->map.size, MADV_SEQUENTIAL);
+
+	p->speed = speed;
+	p->next = 0;
+	p->records = 0;
+	p->start = adm20_monotonic_ns();
+	p->due = p->start;
+	p->due_for = 0;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_replay_due
+  Returns Type	: uint64_t
+  ----Parameter List
+  1. struct adm20_replay *p,
+  ------------------
+  Exit Codes	: CLOCK_MONOTONIC ns the next record should be fed, 0 for
+  		  right away (max speed, or nothing left)
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	For callers with their own event loop, arm a timer for this
+	and call adm20_replay_feed() when it fires, it won't sleep.
+
+	Paces on the gap to the previous record rather than from the
+	first, a capture appended to after a reboot has its monotonic
+	clock start over.  No gap is waited out for longer than
+	ADM20_REPLAY_GAP_MAX_MS.
+
+\------------------------------------------------------------------*/
+uint64_t adm20_replay_due(struct adm20_replay *p) {
+	const struct adm20_capture_record *rec;
+
+	if (p->speed == ADM20_REPLAY_MAX || p->next >= p->map.count) return 0;
+
+	if (p->due_for != p->next) {
+		rec = &p->map.records[p->next];
+		if (p->next > 0 && rec->mono > rec[-1].mono) {
+			uint64_t gap = (uint64_t)((rec->mono - rec[-1].mono) / p->speed);
+
+			if (gap > ADM20_REPLAY_GAP_MAX_MS * 1000000ULL) gap = ADM20_REPLAY_GAP_MAX_MS * 1000000ULL;
+			p->due += gap;
+		}
+		p->due_for = p->next;
+	}
+
+	return p->due;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_replay_feed
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_replay *p,
+  2. struct adm20_reader *r,
+  ------------------
+  Exit Codes	: 1 if a record was fed, 0 at the end of the capture,
+  		  -1 with errno EINTR if a signal cut the wait short
+  Side Effects	: sleeps until the record is due unless at max speed
+  --------------------------------------------------------------------
+Comments:
+	Call in place of adm20_reader_fill() whenever the reader wants
+	more.  The reader sees each record's bytes with the original
+	arrival time, so readings carry the timestamps they had live.
+	A truncated frame was captured without its bytes, a lone
+	terminator reproduces the same rejection in the parser.
+
+\------------------------------------------------------------------*/
+int adm20_replay_feed(struct adm20_replay *p, struct adm20_reader *r) {
+	static const uint8_t truncated[1] = { ADM20_FRAME_END };
+	const struct adm20_capture_record *rec;
+
+	if (p->next >= p->map.count) return 0;
+
+	rec = &p->map.records[p->next];
+
+	/*
+	 * A signal cuts the wait short, and nothing is fed, so the
+	 * caller gets to look at whatever flag it set.  The record is
+	 * still due at the same time when it calls again.
+	 *
+	 */
+	if (p->speed != ADM20_REPLAY_MAX) {
+		struct timespec ts;
+		uint64_t due = adm20_replay_due(p);
+		int rc;
+
+		ts.tv_sec = due / 1000000000ULL;
+		ts.tv_nsec = due % 1000000000ULL;
+		rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		if (rc) {
+			errno = rc;
+			return -1;
+		}
+	}
+
+	if (rec->len) adm20_reader_feed(r, rec->frame, rec->len, rec->mono);
+	else adm20_reader_feed(r, truncated, sizeof(truncated), rec->mono);
+
+	p->next++;
+	p->records++;
+
+	return 1;
+}
+
+void adm20_replay_close(struct adm20_replay *p) {
+	adm20_capture_map_close(&p->map);
+}
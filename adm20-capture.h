@@ -0,0 +1,211 @@
+/*
+ * BSIDE-ADM20 raw frame capture files
+ *
+ * Append-only binary file, a fixed 64 byte header followed by fixed
+ * 48 byte records each holding the CLOCK_MONOTONIC arrival time, the
+ * offset to wall-clock time at that moment, status flags and the raw
+ * frame bytes exactly as they came off the port.  Records are
+ * buffered in memory and written in blocks, with an fsync() at a
+ * configurable interval, so capturing costs the read loop little
+ * more than a memcpy().
+ *
+ * A clean close adds a sparse index footer, the wall-clock time of
+ * every ADM20_CAPTURE_INDEX_EVERY'th record (or some power of two
+ * multiple of that on very long captures) followed by a fixed
+ * trailer, so a reader can binary search a capture of any length
+ * touching only a handful of pages.  The footer is cut off again
+ * when the capture is reopened for appending.  Files without one
+ * (the writer crashed) are still searchable, just over the records
+ * themselves.
+ *
+ * All fields are little-endian, native on everything we build for.
+ *
+ */
+#ifndef ADM20_CAPTURE_H
+#define ADM20_CAPTURE_H
+
+#include <stdint.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+
+#define ADM20_CAPTURE_MAGIC "ADM20CAP"
+#define ADM20_CAPTURE_VERSION 1
+
+#define ADM20_CAPTURE_BUFFER 64       // records held before a write()
+#define ADM20_CAPTURE_SYNC_DEFAULT 5  // seconds between fsync()s
+
+#define ADM20_CAPTURE_INDEX_MAGIC "ADM20IDX"
+#define ADM20_CAPTURE_INDEX_EVERY 1024  // records per index entry, doubled as the index fills
+#define ADM20_CAPTURE_INDEX_ENTRIES 4096  // index entries allocated at open, 64kB
+
+/*
+ * Record status flags
+ *
+ */
+#define ADM20_CAPTURE_OK 0x0001        // frame accepted by the parser
+#define ADM20_CAPTURE_REJECTED 0x0002  // candidate thrown away, len 0 if truncated
+
+struct adm20_capture_header {
+	char magic[8];          // ADM20_CAPTURE_MAGIC, no terminator
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t frame_size;
+	uint64_t created_mono;  // CLOCK_MONOTONIC ns when the file was created
+	int64_t created_wall;   // CLOCK_REALTIME ns at the same moment
+	uint8_t reserved[24];
+};
+
+struct adm20_capture_record {
+	uint64_t mono;          // CLOCK_MONOTONIC ns the frame arrived
+	int64_t wall_offset;    // add to mono for CLOCK_REALTIME ns
+	uint16_t status;        // ADM20_CAPTURE_*
+	uint8_t len;            // valid bytes in frame[]
+	uint8_t reserved;
+	uint8_t frame[ADM20_FRAME_SIZE];
+	uint8_t pad[6];
+};
+
+struct adm20_capture_index {
+	int64_t wall;           // CLOCK_REALTIME ns of the record
+	uint64_t record;        // record number, 0 is the first after the header
+};
+
+struct adm20_capture_footer {
+	char magic[8];          // ADM20_CAPTURE_INDEX_MAGIC
+	uint32_t every;         // records between index entries
+	uint32_t reserved;
+	uint64_t entries;       // index entries before this footer
+	uint64_t records;       // records before the index
+};
+
+static_assert(sizeof(struct adm20_capture_header) == 64, "capture header layout");
+static_assert(sizeof(struct adm20_capture_record) == 48, "capture record layout");
+static_assert(sizeof(struct adm20_capture_index) == 16, "capture index layout");
+static_assert(sizeof(struct adm20_capture_footer) == 32, "capture footer layout");
+
+static inline int64_t adm20_capture_wall(const struct adm20_capture_record *rec) {
+	return (int64_t)rec->mono + rec->wall_offset;
+}
+
+struct adm20_capture {
+	int fd;
+	int sync_interval;      // seconds, 0 = only when the buffer fills or on close
+	uint64_t last_sync;
+	uint64_t records;       // written this session
+	uint64_t total;         // records in the file, including this session's
+	uint32_t used;
+	uint8_t index_ok;       // cleared if the index couldn't be kept
+	struct adm20_capture_index *index;  // allocated at open, never grown
+	uint64_t index_count, index_size;
+	uint32_t index_every;   // records between index entries
+	struct adm20_capture_record buf[ADM20_CAPTURE_BUFFER];
+};
+
+int adm20_capture_open(struct adm20_capture *c, const char *path, int sync_interval);
+int adm20_capture_write(struct adm20_capture *c, uint64_t mono, uint16_t status, const uint8_t *frame, int len);
+int adm20_capture_flush(struct adm20_capture *c);
+void adm20_capture_close(struct adm20_capture *c);
+
+int adm20_capture_check_header(const struct adm20_capture_header *h);
+
+/*
+ * Read side, the whole capture mmap()ed read-only
+ *
+ */
+struct adm20_capture_map {
+	const uint8_t *base;
+	size_t size;
+	const struct adm20_capture_header *header;
+	const struct adm20_capture_record *records;
+	uint64_t count;
+	const struct adm20_capture_index *index;  // NULL without a footer
+	uint64_t index_count;
+	uint32_t every;
+};
+
+int adm20_capture_map_open(struct adm20_capture_map *m, const char *path);
+void adm20_capture_map_close(struct adm20_capture_map *m);
+uint64_t adm20_capture_seek(const struct adm20_capture_map *m, int64_t wall);
+
+/*
+ * Iterator range over the accepted frames between two wall-clock
+ * times, decoded as they're visited:
+ *
+ *	for (auto &r : adm20_capture_window(&m, from, to)) ...
+ *
+ */
+struct adm20_capture_reading {
+	int64_t wall;                 // CLOCK_REALTIME ns
+	struct adm20_reading reading; // timestamp is the original CLOCK_MONOTONIC ns
+};
+
+class adm20_capture_range {
+	public:
+		class iterator {
+			public:
+				iterator(const struct adm20_capture_record *rec, const struct adm20_capture_record *end) : rec(rec), end(end) { skip(); }
+
+				const struct adm20_capture_reading &operator*() {
+					value.wall = adm20_capture_wall(rec);
+					adm20_decode(rec->frame, rec->mono, &value.reading);
+					return value;
+				}
+				const struct adm20_capture_record *record() const { return rec; }
+				iterator &operator++() { ++rec; skip(); return *this; }
+				bool operator==(const iterator &o) const { return rec == o.rec; }
+				bool operator!=(const iterator &o) const { return rec != o.rec; }
+
+			private:
+				void skip() { while (rec != end && !(rec->status & ADM20_CAPTURE_OK)) ++rec; }
+
+				const struct adm20_capture_record *rec, *end;
+				struct adm20_capture_reading value;
+		};
+
+		adm20_capture_range(const struct adm20_capture_record *first, const struct adm20_capture_record *last) : first(first), last(last) {}
+
+		iterator begin() const { return iterator(first, last); }
+		iterator end() const { return iterator(last, last); }
+		uint64_t size() const { return last - first; }  // records, rejected ones included
+
+	private:
+		const struct adm20_capture_record *first, *last;
+};
+
+adm20_capture_range adm20_capture_window(const struct adm20_capture_map *m, int64_t from, int64_t to);
+
+/*
+ * Replay, feeds a capture's records back through an adm20_reader
+ * either at the original pace (scaled by speed) or as fast as the
+ * reader takes them.
+ *
+ */
+#define ADM20_REPLAY_MAX 0.0  // speed, no pacing at all
+
+/*
+ * Longest a replay waits between two records.  A capture appended
+ * to by a later session can have hours between them, that's a break
+ * in the capture rather than something anyone wants to sit through.
+ *
+ */
+#define ADM20_REPLAY_GAP_MAX_MS 2000
+
+struct adm20_replay {
+	struct adm20_capture_map map;
+	double speed;
+	uint64_t next;        // next record to feed
+	uint64_t start;       // CLOCK_MONOTONIC ns the replay started
+	uint64_t due;         // CLOCK_MONOTONIC ns the next record is due
+	uint64_t due_for;     // record due was worked out for
+	uint64_t records;     // fed so far
+};
+
+int adm20_replay_open(struct adm20_replay *p, const char *path, double speed);
+uint64_t adm20_replay_due(struct adm20_replay *p);
+int adm20_replay_feed(struct adm20_replay *p, struct adm20_reader *r);
+void adm20_replay_close(struct adm20_replay *p);
+int adm20_replay_speed(const char *s, double *speed);
+
+#endif
@@ -0,0 +1,592 @@
+/*
+ * BSIDE-ADM20 multi-meter daemon
+ *
+ * One process looking after every meter on the bench.  Each -p port
+ * gets its own frame reader and decoder state, all of them are
+ * serviced from a single epoll loop, and every reading is passed on
+ * tagged with the meter it came from; a line on stdout and, with -m,
+ * a shared memory segment per meter that adm20-watch can follow.
+ *
+ * Nothing here scales with the number of meters other than the
+ * meter table itself, epoll only ever hands back the ports that
+ * actually have something waiting.  A meter whose adapter is pulled
+ * shows as disconnected and is picked up again when it's plugged
+ * back in, the others carry on regardless.
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+#include "adm20-serial.h"
+#include "adm20-shm.h"
+#include "adm20-latency.h"
+#include "adm20-health.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * Should be defined in the Makefile to pass to the compiler from
+ * the github build revision
+ *
+ */
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define SSIZE 1024
+
+#define MAX_EVENTS 64   // ready ports handled per epoll_wait()
+#define TAG_SIZE 32
+
+struct meter {
+	char *device;
+	char *serial_config;        // NULL to use the default -s
+	char tag[TAG_SIZE];         // what its readings are labelled with
+	struct serial_params_s serial_params;
+	struct adm20_reader reader;
+	struct adm20_reading reading;
+	int dt_loaded;
+	struct adm20_reconnect reconnect;
+	struct adm20_health health; // frame gaps and the kernel's line error counts
+	int watching;               // reconnect.ifd has been added to the epoll set
+	struct adm20_shm *shm;
+	char shm_name[SSIZE];
+	uint64_t readings;
+};
+
+struct glb {
+	uint8_t debug;
+	uint8_t quiet;
+	uint8_t low_latency;
+	char *serial_config;        // default for ports without their own -s
+	char *shm_prefix;
+	char *stats_file;
+
+	struct meter *meters;
+	int count;
+	int lost;                   // meters currently waiting for their port to come back
+	uint64_t polled;            // when the loop last went in to epoll_wait()
+};
+
+/*
+ * Shared by every meter, they all go through the same loop
+ *
+ */
+static struct adm20_latency stages;
+
+int init(struct glb *g) {
+	g->debug = 0;
+	g->quiet = 0;
+	g->low_latency = 0;
+	g->serial_config = NULL;
+	g->shm_prefix = NULL;
+	g->stats_file = NULL;
+	g->meters = NULL;
+	g->count = 0;
+	g->lost = 0;
+	g->polled = 0;
+
+	return 0;
+}
+
+void show_help(void) {
+	fprintf(stdout,"BSIDE ADM20 multi-meter daemon\r\n"
+			"By Paul L Daniels / pldaniels@gmail.com\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			" -p <comport> [-s <config>] [-n <tag>] [-p ...] [-m <prefix>] [--low-latency] [--stats <file>] [-d] [-q]\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-p <comport>: Add a meter, give -p once per meter\r\n"
+			"\t-s <[9600|4800|2400|1200]:[7|8][o|e|n][1|2]>: Serial config for the -p before it,\r\n"
+			"\t\tor for every port without its own if given before the first -p (default %s)\r\n"
+			"\t-n <tag>: Label the -p before it's readings with <tag> (default the device name)\r\n"
+			"\t-m <prefix>: Publish each meter to shared memory as <prefix>-<tag>\r\n"
+			"\t--low-latency: Have the serial drivers pass bytes on straight away\r\n"
+			"\t--stats <file>: Append the latency and per meter link stats as JSON here (default stderr)\r\n"
+			"\t-d: debug enabled\r\n"
+			"\t-q: quiet, don't print readings\r\n"
+			"\t-v: show version\r\n"
+			"\r\n"
+			"\tSIGUSR1 prints the per meter counters, link health and latency histograms\r\n"
+			"\r\n"
+			"\texample: adm20-daemon -p /dev/ttyUSB0 -p /dev/ttyUSB1 -s 9600:8n1 -n psu -m /bside-adm20\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			, ADM20_DEFAULT_SERIAL_CONFIG
+			);
+}
+
+static const char *basename_of(const char *path) {
+	const char *p = strrchr(path, '/');
+	return p ? p +1 : path;
+}
+
+/*
+ * -s and -n belong to the -p in front of them, so the meter table is
+ * sized first and then filled in order.
+ *
+ */
+int parse_parameters(struct glb *g, int argc, char **argv) {
+	struct meter *m = NULL;
+	int i, ports = 0;
+
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] == '-' && argv[i][1] == 'p') ports++;
+	}
+	if (ports) {
+		g->meters = (struct meter *)calloc(ports, sizeof(struct meter));
+		if (!g->meters) {
+			fprintf(stderr,"%s:%d: Unable to allocate %d meters\r\n", FL, ports);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			/* parameter */
+			switch (argv[i][1]) {
+				case 'h':
+					show_help();
+					exit(0);
+					break;
+
+				case 'd': g->debug = 1; break;
+
+				case 'q': g->quiet = 1; break;
+
+				case '-':
+					if (!strcmp(argv[i], "--low-latency")) {
+						g->low_latency = 1;
+					} else if (!strcmp(argv[i], "--stats")) {
+						if (++i >= argc) {
+							fprintf(stderr,"Insufficient parameters; --stats <file>\n");
+							exit(1);
+						}
+						g->stats_file = argv[i];
+					}
+					break;
+
+				case 'v':
+					fprintf(stdout,"Build %d\r\n", BUILD_VER);
+					exit(0);
+					break;
+
+				case 'p':
+				case 's':
+				case 'n':
+				case 'm':
+					if (i +1 >= argc) {
+						fprintf(stderr,"Insufficient parameters; -%c requires a value\n", argv[i][1]);
+						exit(1);
+					}
+					switch (argv[i][1]) {
+						case 'p':
+							m = &g->meters[g->count++];
+							m->device = argv[i +1];
+							snprintf(m->tag, sizeof(m->tag), "%s", basename_of(m->device));
+							break;
+
+						case 's':
+							if (m) m->serial_config = argv[i +1];
+							else g->serial_config = argv[i +1];
+							break;
+
+						case 'n':
+							if (!m) {
+								fprintf(stderr,"-n <tag> goes after the -p it names\n");
+								exit(1);
+							}
+							if (strchr(argv[i +1], '/')) {
+								fprintf(stderr,"Tag '%s' can't contain a '/'\n", argv[i +1]);
+								exit(1);
+							}
+							snprintf(m->tag, sizeof(m->tag), "%s", argv[i +1]);
+							break;
+
+						case 'm': g->shm_prefix = argv[i +1]; break;
+					}
+					i++;
+					break;
+
+				default: break;
+			} // switch
+		}
+	}
+
+	return 0;
+}
+
+static int meter_watch(struct meter *m, int efd, int fd) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = m;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev)) {
+		fprintf(stderr,"%s:%d: Unable to watch '%s' (%s)\r\n", FL, m->device, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: meter_open
+  Returns Type	: int
+  ----Parameter List
+  1. struct glb *g,
+  2. struct meter *m,
+  3. int efd, epoll instance to add the port to
+  ------------------
+  Exit Codes	: 0 on success, -1 with the reason already reported
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	The port is switched to non-blocking, a wakeup that turns out
+	to have nothing behind it must never stall every other meter.
+
+\------------------------------------------------------------------*/
+static int meter_open(struct glb *g, struct meter *m, int efd) {
+	m->serial_params.device = m->device;
+	if (adm20_open_port(&m->serial_params, m->serial_config ? m->serial_config : g->serial_config) < 0) return -1;
+	if (g->low_latency) adm20_serial_low_latency(&m->serial_params, ADM20_LATENCY_DRIVER);
+	fcntl(m->serial_params.fd, F_SETFL, O_NONBLOCK);
+	adm20_reader_init(&m->reader, m->serial_params.fd);
+	adm20_reconnect_init(&m->reconnect);
+	adm20_health_init(&m->health);
+	adm20_health_port(&m->health, m->serial_params.fd);
+
+	if (g->shm_prefix) {
+		snprintf(m->shm_name, sizeof(m->shm_name), "%s-%s", g->shm_prefix, m->tag);
+		if (!(m->shm = adm20_shm_create(m->shm_name))) return -1;
+	}
+
+	return meter_watch(m, efd, m->serial_params.fd);
+}
+
+/*
+ * Every sink gets the same reading with the meter's tag on it
+ *
+ */
+static void meter_publish(struct glb *g, struct meter *m) {
+	char line[SSIZE];
+
+	uint64_t t;
+
+	m->readings++;
+	if (m->shm) {
+		t = adm20_monotonic_ns();
+		adm20_shm_publish(m->shm, &m->reading);
+		adm20_latency_record(&stages, ADM20_STAGE_SHM, adm20_monotonic_ns() - t);
+	}
+	if (!g->quiet) {
+		adm20_reading_format(&m->reading, line, sizeof(line), ADM20_FORMAT_LOG);
+		fprintf(stdout,"%s %.3f %s%s\r\n"
+				, m->tag
+				, m->reading.timestamp / 1e9
+				, line
+				, m->reading.flags & ADM20_READING_DISCONNECTED ? " (disconnected)"
+				: m->reading.flags & ADM20_READING_STALE ? " (stale)" : ""
+				);
+		if (!(m->reading.flags & ADM20_READING_STALE)) adm20_latency_record(&stages, ADM20_STAGE_CONSOLE, adm20_monotonic_ns() - m->reading.timestamp);
+	}
+}
+
+/*
+ * The port's gone, the sinks hear about it and we start watching
+ * for it to come back
+ *
+ */
+static void meter_lost(struct glb *g, struct meter *m, int efd, ssize_t got) {
+	int err = errno;
+
+	epoll_ctl(efd, EPOLL_CTL_DEL, m->serial_params.fd, NULL);
+	adm20_health_poll(&m->health, m->serial_params.fd, 0);
+	errno = err;
+	adm20_reconnect_lost(&m->reconnect, &m->serial_params, got);
+	m->reader.fd = -1;
+	if (!m->watching && m->reconnect.ifd >= 0) m->watching = !meter_watch(m, efd, m->reconnect.ifd);
+	g->lost++;
+
+	adm20_reading_disconnected(&m->reading, m->reconnect.lost);
+	m->dt_loaded = 0;
+	meter_publish(g, m);
+}
+
+static void meter_reconnect(struct glb *g, struct meter *m, int efd) {
+	if (adm20_reconnect_try(&m->reconnect, &m->serial_params) < 0) return;
+
+	/*
+	 * The inotify fd comes out of the set while we're connected,
+	 * nothing reads it then
+	 *
+	 */
+	epoll_ctl(efd, EPOLL_CTL_DEL, m->reconnect.ifd, NULL);
+	m->watching = 0;
+
+	fcntl(m->serial_params.fd, F_SETFL, O_NONBLOCK);
+	adm20_reader_attach(&m->reader, m->serial_params.fd);
+	adm20_health_port(&m->health, m->serial_params.fd);
+	g->lost--;
+
+	/*
+	 * Back but we'd never hear from it, as good as still lost
+	 *
+	 */
+	if (meter_watch(m, efd, m->serial_params.fd)) meter_lost(g, m, efd, -1);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: meter_service
+  Returns Type	: void
+  ----Parameter List
+  1. struct glb *g,
+  2. struct meter *m,
+  3. int efd,
+  ------------------
+  Exit Codes	:
+  Side Effects	: drops the meter from the loop if its port has gone
+  --------------------------------------------------------------------
+Comments:
+	One read() per wakeup, then every frame it completed.  Anything
+	left over is a partial frame, epoll tells us when the rest is in.
+
+\------------------------------------------------------------------*/
+static void meter_service(struct glb *g, struct meter *m, int efd) {
+	const uint8_t *frame;
+	ssize_t got;
+	uint64_t t;
+
+	got = adm20_reader_fill(&m->reader);
+	if (got > 0) adm20_latency_record(&stages, ADM20_STAGE_READ_WAIT, m->reader.fill_time - g->polled);
+	if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+		meter_lost(g, m, efd, got);
+		return;
+	}
+
+	for (;;) {
+		switch (adm20_reader_next(&m->reader, &frame)) {
+			case ADM20_FRAME_MORE:
+				return;
+
+			case ADM20_FRAME_REJECTED:
+				if (g->debug) fprintf(stderr,"[%s] Rejected %u byte frame\r\n", m->tag, m->reader.frame_len);
+				if (!m->dt_loaded) continue;
+				m->reading.flags |= ADM20_READING_STALE;
+				break;
+
+			case ADM20_FRAME_OK:
+				t = adm20_monotonic_ns();
+				adm20_latency_record(&stages, ADM20_STAGE_ASSEMBLY, t - m->reader.fill_time);
+				adm20_decode(frame, m->reader.fill_time, &m->reading);
+				adm20_latency_record(&stages, ADM20_STAGE_DECODE, adm20_monotonic_ns() - t);
+				adm20_health_frame(&m->health, m->reader.fill_time);
+				adm20_health_poll(&m->health, m->reader.fd, t);
+				m->dt_loaded = 1;
+				break;
+		}
+
+		meter_publish(g, m);
+	}
+}
+
+static void report(struct glb *g, uint64_t start, uint64_t wakeups, uint64_t events) {
+	struct rusage ru;
+	double secs = (adm20_monotonic_ns() - start) / 1e9;
+	double cpu;
+	uint64_t readings = 0;
+	int i;
+
+	for (i = 0; i < g->count; i++) {
+		struct meter *m = &g->meters[i];
+
+		fprintf(stderr,"%-16s %-24s %s readings %llu, ok %llu, rejected %llu, discarded %llu bytes\r\n"
+				, m->tag
+				, m->device
+				, m->reconnect.lost ? "lost" : "up  "
+				, (unsigned long long)m->readings
+				, (unsigned long long)m->reader.frames_ok
+				, (unsigned long long)m->reader.frames_rejected
+				, (unsigned long long)m->reader.bytes_discarded
+				);
+		if (m->reconnect.drops) {
+			fprintf(stderr,"%-16s lost the port %u times, down %.0f ms in all, longest %.0f ms\r\n"
+					, ""
+					, m->reconnect.drops
+					, m->reconnect.down_total / 1e6
+					, m->reconnect.down_max / 1e6
+					);
+		}
+		readings += m->readings;
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	fprintf(stderr,"%d meters ( %d up ), %llu readings in %.1f s, %llu wakeups ( %.2f ports each )\r\n"
+			, g->count
+			, g->count - g->lost
+			, (unsigned long long)readings
+			, secs
+			, (unsigned long long)wakeups
+			, wakeups ? (double)events / wakeups : 0.0
+			);
+	fprintf(stderr,"CPU %.3f s ( %.2f%%, %.1f us per reading ), max RSS %ld kB\r\n"
+			, cpu
+			, secs > 0 ? 100.0 * cpu / secs : 0.0
+			, readings ? cpu * 1e6 / readings : 0.0
+			, ru.ru_maxrss
+			);
+}
+
+/*
+ * The latency histograms and every meter's link health, table to
+ * stderr and JSON to --stats
+ *
+ */
+static void dump_stats(struct glb *g) {
+	int i;
+
+	adm20_latency_dump(&stages, g->stats_file);
+	for (i = 0; i < g->count; i++) {
+		struct meter *m = &g->meters[i];
+
+		adm20_health_poll(&m->health, m->reader.fd, 0);
+		adm20_health_dump(&m->health, &m->reader, m->tag, g->stats_file);
+	}
+}
+
+int main(int argc, char **argv) {
+	struct glb g;
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct signalfd_siginfo si;
+	sigset_t mask;
+	uint64_t start, wakeups = 0, handled = 0;
+	int efd, sfd, i, n, timeout = -1, quit = 0;
+
+	init(&g);
+	parse_parameters(&g, argc, argv);
+
+	if (!g.count) {
+		fprintf(stderr,"%s:%d: No com ports specified, use -p <com port> for each meter\r\n", FL);
+		exit(1);
+	}
+
+	/*
+	 * Signals come in through the loop like everything else
+	 *
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (efd < 0 || sfd < 0) {
+		fprintf(stderr,"%s:%d: Unable to set up the event loop (%s)\r\n", FL, strerror(errno));
+		exit(1);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+
+	for (i = 0; i < g.count; i++) {
+		for (n = 0; n < i; n++) {
+			if (!strcmp(g.meters[n].tag, g.meters[i].tag)) {
+				fprintf(stderr,"%s:%d: '%s' and '%s' would both be tagged '%s', use -n\r\n", FL, g.meters[n].device, g.meters[i].device, g.meters[i].tag);
+				exit(1);
+			}
+		}
+		if (meter_open(&g, &g.meters[i], efd)) exit(1);
+		if (g.debug) fprintf(stderr,"%s:%d: [%s] %s at %s\r\n", FL, g.meters[i].tag, g.meters[i].device, g.meters[i].serial_config ? g.meters[i].serial_config : g.serial_config ? g.serial_config : ADM20_DEFAULT_SERIAL_CONFIG);
+	}
+
+	start = adm20_monotonic_ns();
+	adm20_latency_init(&stages);
+
+	while (!quit) {
+		g.polled = adm20_monotonic_ns();
+		n = epoll_wait(efd, events, MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr,"%s:%d: epoll_wait() failed (%s)\r\n", FL, strerror(errno));
+			break;
+		}
+		wakeups++;
+		handled += n;
+
+		for (i = 0; i < n; i++) {
+			struct meter *m = (struct meter *)events[i].data.ptr;
+
+			if (!m) {
+				if (read(sfd, &si, sizeof(si)) != sizeof(si)) continue;
+				if (si.ssi_signo == SIGUSR1) {
+					report(&g, start, wakeups, handled);
+					dump_stats(&g);
+				} else quit = 1;
+				continue;
+			}
+
+			if (!m->reconnect.lost) meter_service(&g, m, efd);
+		}
+
+		/*
+		 * Only once something's actually been unplugged do we
+		 * have to look at every meter, to see which are back and
+		 * when the next blind retry is due.
+		 *
+		 */
+		timeout = -1;
+		for (i = 0; g.lost && i < g.count; i++) {
+			struct meter *m = &g.meters[i];
+			int t;
+
+			if (!m->reconnect.lost) continue;
+			meter_reconnect(&g, m, efd);
+			t = adm20_reconnect_timeout(&m->reconnect);
+			if (t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+		}
+		fflush(stdout);
+	}
+
+	report(&g, start, wakeups, handled);
+	dump_stats(&g);
+
+	for (i = 0; i < g.count; i++) {
+		struct meter *m = &g.meters[i];
+
+		if (m->shm) {
+			adm20_shm_detach(m->shm);
+			adm20_shm_unlink(m->shm_name);
+		}
+		adm20_close_port(&m->serial_params);
+		adm20_reconnect_close(&m->reconnect);
+	}
+	close(efd);
+	close(sfd);
+	free(g.meters);
+
+	return 0;
+}
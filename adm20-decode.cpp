@@ -0,0 +1,164 @@
+/*
+ * BSIDE-ADM20 frame decoding
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "adm20-decode.h"
+
+/*
+ * Indexed by ADM20_PREFIX_* / ADM20_UNIT_*
+ *
+ * Prefix "none" is a single space, prevents the annoying string
+ * width jump on monospace displays
+ * ( see https://www.youtube.com/watch?v=5HUyEykicEQ )
+ *
+ */
+const char *adm20_prefix_text[] = { " ", "n", "\u00B5", "m", "k", "M" };
+const char *adm20_unit_text[] = { "", "V", "A", "\u03A9", "F", "Hz", "\u00B0C", "\u00B0F" };
+
+static const int8_t prefix_exponent[] = { 0, -9, -6, -3, 3, 6 };
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_decode
+  Returns Type	: void
+  ----Parameter List
+  1. const uint8_t *d, validated frame
+  2. uint64_t timestamp, CLOCK_MONOTONIC ns
+  3. struct adm20_reading *r,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	While the data sheet gives a very nice matrix for the RANGE and
+	FUNCTION values it's probably more human-readable to break it
+	down bit by bit.  Where more than one unit or prefix bit is set
+	the later test wins, same as the old snprintf() chain did.
+
+\------------------------------------------------------------------*/
+void adm20_decode(const uint8_t *d, uint64_t timestamp, struct adm20_reading *r) {
+	r->timestamp = timestamp;
+	r->flags = 0;
+	r->mode = 0;
+	r->prefix = ADM20_PREFIX_NONE;
+	r->unit = ADM20_UNIT_NONE;
+
+	r->segments[0] = d[7];
+	r->segments[1] = d[6];
+	r->segments[2] = d[5];
+	r->segments[3] = d[4];
+
+	if (d[8] & 0x08) r->flags |= ADM20_READING_NEGATIVE;
+
+	if (!adm20_decode_value(d, &r->mantissa, &r->exponent)) {
+		r->mantissa = 0;
+		r->exponent = 0;
+		r->flags |= ADM20_READING_NAN;
+		if (adm20_digit(d[7]) == 'L' || adm20_digit(d[6]) == 'L' || adm20_digit(d[5]) == 'L' || adm20_digit(d[4]) == 'L') {
+			r->flags |= ADM20_READING_OVERLOAD;
+		}
+	}
+
+	if (d[16] & 0x80) r->mode |= ADM20_MODE_REL;
+	if (d[16] & 0x20) r->mode |= ADM20_MODE_AUTO;
+	if (d[17] & 0x40) r->mode |= ADM20_MODE_HFE;
+	if (d[17] & 0x20) r->mode |= ADM20_MODE_DUTY;
+	if (d[17] & 0x08) r->mode |= ADM20_MODE_MIN;
+
+	if (d[18] & 0x80) r->unit = ADM20_UNIT_FARAD;
+	if (d[18] & 0x40) r->prefix = ADM20_PREFIX_NANO;
+	if (d[18] & 0x20) r->prefix = ADM20_PREFIX_MICRO;
+	if (d[18] & 0x02) r->unit = ADM20_UNIT_DEGF;
+	if (d[18] & 0x01) r->unit = ADM20_UNIT_DEGC;
+
+	if (d[19] & 0x80) r->unit = ADM20_UNIT_HERTZ;
+	if (d[19] & 0x40) r->unit = ADM20_UNIT_OHM;
+	if (d[19] & 0x20) r->prefix = ADM20_PREFIX_KILO;
+	if (d[19] & 0x10) r->prefix = ADM20_PREFIX_MEGA;
+	if (d[19] & 0x08) r->unit = ADM20_UNIT_VOLT;
+	if (d[19] & 0x04) r->unit = ADM20_UNIT_AMP;
+	if (d[19] & 0x02) r->prefix = ADM20_PREFIX_MILLI;
+	if (d[19] & 0x01) r->prefix = ADM20_PREFIX_MICRO;
+}
+
+/*
+ * What the sinks are handed while the meter's port has gone, dashes
+ * across the display and flagged so nobody takes it for a reading
+ *
+ */
+void adm20_reading_disconnected(struct adm20_reading *r, uint64_t timestamp) {
+	memset(r, 0, sizeof(*r));
+	r->timestamp = timestamp;
+	r->flags = ADM20_READING_NAN | ADM20_READING_STALE | ADM20_READING_DISCONNECTED;
+	r->segments[0] = r->segments[1] = r->segments[2] = r->segments[3] = 0x20;
+}
+
+/*
+ * Value in base units, ie 12.34mV => 0.01234
+ *
+ */
+double adm20_reading_value(const struct adm20_reading *r) {
+	double v = r->mantissa;
+	int e = r->exponent + prefix_exponent[r->prefix];
+
+	while (e > 0) { v *= 10.0; e--; }
+	while (e < 0) { v /= 10.0; e++; }
+
+	return v;
+}
+
+/*
+ * Single most relevant annunciator for a status line
+ *
+ */
+const char *adm20_mode_text(uint8_t mode) {
+	if (mode & ADM20_MODE_MIN) return "MIN";
+	if (mode & ADM20_MODE_DUTY) return "%";
+	if (mode & ADM20_MODE_HFE) return "hFE";
+	if (mode & ADM20_MODE_AUTO) return "AUTO";
+	if (mode & ADM20_MODE_REL) return "REL";
+	return "";
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_reading_format
+  Returns Type	: int
+  ----Parameter List
+  1. const struct adm20_reading *r,
+  2. char *buf,
+  3. size_t size,
+  4. int style, ADM20_FORMAT_DISPLAY or ADM20_FORMAT_LOG
+  ------------------
+  Exit Codes	: snprintf() result
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Rebuilt from the raw segments rather than the mantissa so that
+	whatever the LCD is showing (OL, dashes etc) comes through.
+
+\------------------------------------------------------------------*/
+int adm20_reading_format(const struct adm20_reading *r, char *buf, size_t size, int style) {
+	const char *sign = (style == ADM20_FORMAT_DISPLAY) ? " " : "";
+
+	if (r->flags & ADM20_READING_NEGATIVE) sign = "-";
+
+	return snprintf(buf, size, "%s%c%s%c%s%c%s%c%s%s%s"
+			, sign
+			, adm20_digit(r->segments[0])
+			, r->segments[1] & ADM20_SEGMENT_DP ? "." : ""
+			, adm20_digit(r->segments[1])
+			, r->segments[2] & ADM20_SEGMENT_DP ? "." : ""
+			, adm20_digit(r->segments[2])
+			, r->segments[3] & ADM20_SEGMENT_DP ? "." : ""
+			, adm20_digit(r->segments[3])
+			, adm20_prefix_text[r->prefix]
+			, adm20_unit_text[r->unit]
+			, (style == ADM20_FORMAT_DISPLAY) && (r->flags & ADM20_READING_STALE) ? "?" : ""
+			);
+}
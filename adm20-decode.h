@@ -0,0 +1,216 @@
+/*
+ * BSIDE-ADM20 7-segment decoding
+ *
+ * One table, built at compile time, that maps the low 7 bits of
+ * a segment byte to both the character we'd print and the numeric
+ * value of the digit.  The table and value helpers are header only
+ * so the Windows build can use them without any extra objects.
+ *
+ * adm20_decode() turns a whole frame in to a typed reading in one
+ * pass, text is only produced by adm20_reading_format() for the
+ * sinks that actually want it.
+ *
+ * Segment bit layout as the meter sends it, bit 7 is the
+ * decimal point preceding the digit.
+ *
+ *     --01--
+ *    |      |
+ *    10     02
+ *    |      |
+ *     --20--
+ *    |      |
+ *    40     04
+ *    |      |
+ *     --08--
+ *
+ */
+#ifndef ADM20_DECODE_H
+#define ADM20_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ADM20_SEGMENT_DP 0x80
+#define ADM20_SEGMENT_MASK 0x7F
+
+#define ADM20_DIGIT_NONE -1  // a valid glyph, but not a number (E, L, -, letters)
+
+struct adm20_segment {
+	char glyph;    // 0 if the pattern isn't one the meter displays
+	int8_t value;  // 0..9, or ADM20_DIGIT_NONE
+};
+
+struct adm20_segment_table {
+	struct adm20_segment s[128];
+};
+
+constexpr struct adm20_segment_table adm20_make_segment_table(void) {
+	struct adm20_segment_table t = {};
+	const struct { uint8_t code; char glyph; int8_t value; } codes[] = {
+		{ 0x5F, '0', 0 }, { 0x06, '1', 1 }, { 0x6B, '2', 2 }, { 0x2F, '3', 3 },
+		{ 0x36, '4', 4 }, { 0x3D, '5', 5 }, { 0x7D, '6', 6 }, { 0x07, '7', 7 },
+		{ 0x7F, '8', 8 }, { 0x3F, '9', 9 },
+		{ 0x00, ' ', 0 }, // leading blanks count as zero
+		{ 0x79, 'E', ADM20_DIGIT_NONE }, { 0x58, 'L', ADM20_DIGIT_NONE },
+		{ 0x20, '-', ADM20_DIGIT_NONE }, { 0x77, 'A', ADM20_DIGIT_NONE },
+		{ 0x7C, 'b', ADM20_DIGIT_NONE }, { 0x59, 'C', ADM20_DIGIT_NONE },
+		{ 0x68, 'c', ADM20_DIGIT_NONE }, { 0x6E, 'd', ADM20_DIGIT_NONE },
+		{ 0x71, 'F', ADM20_DIGIT_NONE }, { 0x76, 'H', ADM20_DIGIT_NONE },
+		{ 0x74, 'h', ADM20_DIGIT_NONE }, { 0x64, 'n', ADM20_DIGIT_NONE },
+		{ 0x6C, 'o', ADM20_DIGIT_NONE }, { 0x73, 'P', ADM20_DIGIT_NONE },
+		{ 0x60, 'r', ADM20_DIGIT_NONE }, { 0x78, 't', ADM20_DIGIT_NONE },
+		{ 0x5E, 'U', ADM20_DIGIT_NONE }, { 0x4C, 'u', ADM20_DIGIT_NONE },
+	};
+
+	for (auto &c : codes) {
+		t.s[c.code].glyph = c.glyph;
+		t.s[c.code].value = c.value;
+	}
+
+	return t;
+}
+
+constexpr struct adm20_segment_table adm20_segments = adm20_make_segment_table();
+
+static_assert(adm20_segments.s[0x5F].value == 0 && adm20_segments.s[0x3F].value == 9, "segment table");
+
+/*
+ * Character to show for a segment byte, unknown patterns come
+ * out as a space just like the old digit() switch.
+ *
+ */
+constexpr inline char adm20_digit(uint8_t s) {
+	return adm20_segments.s[s & ADM20_SEGMENT_MASK].glyph ? adm20_segments.s[s & ADM20_SEGMENT_MASK].glyph : ' ';
+}
+
+constexpr inline int adm20_segment_valid(uint8_t s) {
+	return adm20_segments.s[s & ADM20_SEGMENT_MASK].glyph != 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_decode_value
+  Returns Type	: int
+  ----Parameter List
+  1. const uint8_t *d, raw frame
+  2. int32_t *mantissa, signed integer value of the four digits
+  3. int8_t *exponent, power of ten to apply, 0 to -3
+  ------------------
+  Exit Codes	: 1 if the display is a number, 0 for OL, E, dashes etc
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	d[7] is the most significant digit, the DP bit on d[6], d[5]
+	or d[4] puts the decimal point in front of that digit.  The
+	sign lives in d[8].
+
+\------------------------------------------------------------------*/
+constexpr inline int adm20_decode_value(const uint8_t *d, int32_t *mantissa, int8_t *exponent) {
+	int v7 = adm20_segments.s[d[7] & ADM20_SEGMENT_MASK].value;
+	int v6 = adm20_segments.s[d[6] & ADM20_SEGMENT_MASK].value;
+	int v5 = adm20_segments.s[d[5] & ADM20_SEGMENT_MASK].value;
+	int v4 = adm20_segments.s[d[4] & ADM20_SEGMENT_MASK].value;
+
+	if (!adm20_segment_valid(d[7]) || !adm20_segment_valid(d[6]) || !adm20_segment_valid(d[5]) || !adm20_segment_valid(d[4])) return 0;
+	if ((v7 | v6 | v5 | v4) < 0) return 0;
+
+	int32_t m = v7 *1000 + v6 *100 + v5 *10 + v4;
+	*mantissa = (d[8] & 0x08) ? -m : m;
+
+	if (d[6] & ADM20_SEGMENT_DP) *exponent = -3;
+	else if (d[5] & ADM20_SEGMENT_DP) *exponent = -2;
+	else if (d[4] & ADM20_SEGMENT_DP) *exponent = -1;
+	else *exponent = 0;
+
+	return 1;
+}
+
+#define ADM20_PREFIX_NONE 0
+#define ADM20_PREFIX_NANO 1
+#define ADM20_PREFIX_MICRO 2
+#define ADM20_PREFIX_MILLI 3
+#define ADM20_PREFIX_KILO 4
+#define ADM20_PREFIX_MEGA 5
+
+#define ADM20_UNIT_NONE 0
+#define ADM20_UNIT_VOLT 1
+#define ADM20_UNIT_AMP 2
+#define ADM20_UNIT_OHM 3
+#define ADM20_UNIT_FARAD 4
+#define ADM20_UNIT_HERTZ 5
+#define ADM20_UNIT_DEGC 6
+#define ADM20_UNIT_DEGF 7
+
+/*
+ * Annunciators, more than one can be lit at once
+ *
+ */
+#define ADM20_MODE_REL 0x01
+#define ADM20_MODE_AUTO 0x02
+#define ADM20_MODE_HFE 0x04
+#define ADM20_MODE_DUTY 0x08
+#define ADM20_MODE_MIN 0x10
+
+#define ADM20_READING_NEGATIVE 0x01
+#define ADM20_READING_OVERLOAD 0x02  // OL on the display
+#define ADM20_READING_NAN 0x04       // display isn't a number, mantissa is 0
+#define ADM20_READING_STALE 0x08     // repeat of an earlier frame
+#define ADM20_READING_DISCONNECTED 0x10  // the port has gone, see adm20_reading_disconnected()
+
+struct adm20_reading {
+	uint64_t timestamp;   // CLOCK_MONOTONIC ns when the frame arrived
+	int32_t mantissa;     // signed display digits as an integer
+	int8_t exponent;      // decimal point position, 0 to -3
+	uint8_t prefix;       // ADM20_PREFIX_*
+	uint8_t unit;         // ADM20_UNIT_*
+	uint8_t flags;        // ADM20_READING_*
+	uint8_t mode;         // ADM20_MODE_*
+	uint8_t segments[4];  // raw d[7], d[6], d[5], d[4], most significant first
+};
+
+/*
+ * adm20_reading_format() styles
+ *
+ * DISPLAY pads the sign and empty prefix with spaces so the
+ * digits don't jump about on a monospace display and marks stale
+ * readings with a trailing '?'.  LOG is the bare value for files.
+ *
+ */
+#define ADM20_FORMAT_DISPLAY 0
+#define ADM20_FORMAT_LOG 1
+
+extern const char *adm20_prefix_text[];
+extern const char *adm20_unit_text[];
+
+void adm20_decode(const uint8_t *d, uint64_t timestamp, struct adm20_reading *r);
+void adm20_reading_disconnected(struct adm20_reading *r, uint64_t timestamp);
+double adm20_reading_value(const struct adm20_reading *r);
+const char *adm20_mode_text(uint8_t mode);
+int adm20_reading_format(const struct adm20_reading *r, char *buf, size_t size, int style);
+
+/*
+ * Structure of arrays for adm20_decode_batch(), same meaning as
+ * the matching adm20_reading fields.
+ *
+ */
+struct adm20_batch {
+	int32_t *mantissa;
+	int8_t *exponent;
+	uint8_t *prefix;
+	uint8_t *unit;
+	uint8_t *flags;
+};
+
+/*
+ * adm20_decode_batch_path() paths, AUTO is what adm20_decode_batch()
+ * does, the others are there so the benchmark can pin one.
+ *
+ */
+#define ADM20_BATCH_AUTO 0
+#define ADM20_BATCH_SCALAR 1
+#define ADM20_BATCH_SSE41 2
+#define ADM20_BATCH_AVX2 3
+
+void adm20_decode_batch(const uint8_t *frames, size_t count, struct adm20_batch *b);
+int adm20_decode_batch_path(const uint8_t *frames, size_t count, struct adm20_batch *b, int path);
+
+#endif
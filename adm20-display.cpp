@@ -0,0 +1,159 @@
+/*
+ * BSIDE-ADM20 display change tracking
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <string.h>
+#include <sys/resource.h>
+
+#include "adm20-frame.h"
+#include "adm20-display.h"
+
+void adm20_display_init(struct adm20_display *d) {
+	memset(d, 0, sizeof(*d));
+	d->start = adm20_monotonic_ns();
+}
+
+/*
+ * Exposed, resized or otherwise lost, draw all of it next time
+ *
+ */
+void adm20_display_invalidate(struct adm20_display *d) {
+	d->valid = 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_utf8_next
+  Returns Type	: uint32_t
+  ----Parameter List
+  1. const char **p, moved past the character
+  ------------------
+  Exit Codes	: the codepoint, a stray byte comes back as itself
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Only as much UTF-8 as our own strings use, nothing beyond
+	the BMP.
+
+\------------------------------------------------------------------*/
+uint32_t adm20_utf8_next(const char **p) {
+	const uint8_t *s = (const uint8_t *)*p;
+	uint32_t c = *s++;
+
+	if (c >= 0xE0 && (s[0] & 0xC0) == 0x80 && (s[1] & 0xC0) == 0x80) {
+		c = ((c & 0x0F) << 12) | ((s[0] & 0x3F) << 6) | (s[1] & 0x3F);
+		s += 2;
+	} else if (c >= 0xC0 && (s[0] & 0xC0) == 0x80) {
+		c = ((c & 0x1F) << 6) | (s[0] & 0x3F);
+		s++;
+	}
+	*p = (const char *)s;
+
+	return c;
+}
+
+/*
+ * Encode c in to buf, which needs room for 4 bytes, returns the length
+ *
+ */
+int adm20_utf8_put(uint32_t c, char *buf) {
+	if (c < 0x80) {
+		buf[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		buf[0] = 0xC0 | (c >> 6);
+		buf[1] = 0x80 | (c & 0x3F);
+		return 2;
+	}
+	buf[0] = 0xE0 | ((c >> 12) & 0x0F);
+	buf[1] = 0x80 | ((c >> 6) & 0x3F);
+	buf[2] = 0x80 | (c & 0x3F);
+	return 3;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_display_update
+  Returns Type	: uint64_t
+  ----Parameter List
+  1. struct adm20_display *d,
+  2. const char *text, UTF-8 line about to be shown
+  ------------------
+  Exit Codes	: one bit per cell that needs drawing, 0 if the screen is already right
+  Side Effects	: d->cell[] now holds the new line
+  --------------------------------------------------------------------
+Comments:
+	A line shorter than the last one leaves the cells past its
+	end as blanks, and those count as changed, so the caller can
+	just draw every cell with its bit set.
+
+\------------------------------------------------------------------*/
+uint64_t adm20_display_update(struct adm20_display *d, const char *text) {
+	uint64_t dirty = 0;
+	int i = 0, old = d->count;
+
+	d->updates++;
+
+	while (*text && i < ADM20_DISPLAY_CELLS) {
+		uint32_t c = adm20_utf8_next(&text);
+
+		if (!d->valid || i >= old || d->cell[i] != c) {
+			d->cell[i] = c;
+			dirty |= 1ULL << i;
+		}
+		i++;
+	}
+
+	d->count = i;
+	for (; i < old; i++) {
+		if (!d->valid || d->cell[i] != ' ') dirty |= 1ULL << i;
+		d->cell[i] = ' ';
+		d->count = i +1;
+	}
+
+	d->valid = 1;
+	if (dirty) {
+		d->draws++;
+		d->cells_drawn += __builtin_popcountll(dirty);
+	}
+
+	return dirty;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_display_report
+  Returns Type	: void
+  ----Parameter List
+  1. const struct adm20_display *d,
+  2. FILE *f,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	CPU is for the whole process since it started, all threads,
+	which is what matters for a meter left running all day.
+
+\------------------------------------------------------------------*/
+void adm20_display_report(const struct adm20_display *d, FILE *f) {
+	struct rusage ru;
+	double secs = (adm20_monotonic_ns() - d->start) / 1e9;
+	double cpu = 0.0;
+
+	if (!getrusage(RUSAGE_SELF, &ru)) {
+		cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	}
+
+	fprintf(f,"\r\nDisplay: %llu readings, %llu drawn ( %.2f/s ), %llu unchanged, %.1f cells per draw, CPU %.3f s ( %.2f%% ) over %.1f s\r\n"
+			, (unsigned long long)d->updates
+			, (unsigned long long)d->draws
+			, secs > 0 ? d->draws / secs : 0.0
+			, (unsigned long long)(d->updates - d->draws)
+			, d->draws ? (double)d->cells_drawn / d->draws : 0.0
+			, cpu
+			, secs > 0 ? cpu *100.0 / secs : 0.0
+			, secs
+			);
+}
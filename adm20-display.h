@@ -0,0 +1,41 @@
+/*
+ * BSIDE-ADM20 display change tracking
+ *
+ * The meter sits on the same reading most of the time, so the front
+ * ends keep a copy of what's on screen as a row of character cells
+ * and only draw the cells a new line changes.  When nothing changed
+ * there's nothing to draw, and with the SDL2 front end nothing to
+ * present either.
+ *
+ * Counts of what was and wasn't drawn are kept for the report at
+ * exit along with the CPU the whole process used.
+ *
+ */
+#ifndef ADM20_DISPLAY_H
+#define ADM20_DISPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define ADM20_DISPLAY_CELLS 64   // one bit each in the dirty mask
+
+struct adm20_display {
+	int count;                          // cells on screen
+	uint32_t cell[ADM20_DISPLAY_CELLS]; // codepoint showing in each
+	uint8_t valid;                      // cleared when the screen needs everything again
+
+	uint64_t start;                     // CLOCK_MONOTONIC ns, for the rates
+	uint64_t updates;                   // lines offered
+	uint64_t draws;                     // lines that changed something
+	uint64_t cells_drawn;
+};
+
+void adm20_display_init(struct adm20_display *d);
+void adm20_display_invalidate(struct adm20_display *d);
+uint64_t adm20_display_update(struct adm20_display *d, const char *text);
+void adm20_display_report(const struct adm20_display *d, FILE *f);
+
+uint32_t adm20_utf8_next(const char **p);
+int adm20_utf8_put(uint32_t c, char *buf);
+
+#endif
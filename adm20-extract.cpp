@@ -0,0 +1,270 @@
+/*
+ * BSIDE-ADM20 capture extractor
+ *
+ * Pulls the readings between two times out of a capture file made
+ * with -c, as CSV with millisecond timestamps.  The capture is
+ * mmap()ed and binary searched, so the cost depends on the size of
+ * the window rather than the size of the file.
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "adm20-decode.h"
+#include "adm20-capture.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * Should be defined in the Makefile to pass to the compiler from
+ * the github build revision
+ *
+ */
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define SSIZE 1024
+
+struct glb {
+	uint8_t debug;
+	uint8_t info;
+	uint8_t header;
+	char *capture_file;
+	char *from;
+	char *to;
+};
+
+int init(struct glb *g) {
+	g->debug = 0;
+	g->info = 0;
+	g->header = 1;
+	g->capture_file = NULL;
+	g->from = NULL;
+	g->to = NULL;
+
+	return 0;
+}
+
+void show_help(void) {
+	fprintf(stdout,"BSIDE ADM20 capture extractor\r\n"
+			"By Paul L Daniels / pldaniels@gmail.com\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			" -f <capture file> [-s <start>] [-e <end>] [-i] [-n]\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-f <capture file>: Capture written by bside-adm20 -c\r\n"
+			"\t-s <time>: Start of the window (default the start of the capture)\r\n"
+			"\t-e <time>: End of the window, exclusive (default the end of the capture)\r\n"
+			"\t-i: Show a summary of the capture instead of the readings\r\n"
+			"\t-n: No CSV header line\r\n"
+			"\t-d: debug enabled\r\n"
+			"\t-v: show version\r\n"
+			"\r\n"
+			"\tTimes are local, 'YYYY-MM-DD HH:MM[:SS[.mmm]]', or 'HH:MM[:SS[.mmm]]'\r\n"
+			"\ton the day the capture starts, or Unix time in milliseconds.\r\n"
+			"\r\n"
+			"\texample: adm20-extract -f meter.cap -s 14:32 -e 14:33 > 1432.csv\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			);
+}
+
+int parse_parameters(struct glb *g, int argc, char **argv) {
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			/* parameter */
+			switch (argv[i][1]) {
+				case 'h':
+					show_help();
+					exit(0);
+					break;
+
+				case 'd': g->debug = 1; break;
+
+				case 'i': g->info = 1; break;
+
+				case 'n': g->header = 0; break;
+
+				case 'v':
+					fprintf(stdout,"Build %d\r\n", BUILD_VER);
+					exit(0);
+					break;
+
+				case 'f':
+				case 's':
+				case 'e':
+					if (i +1 >= argc) {
+						fprintf(stderr,"Insufficient parameters; -%c requires a value\n", argv[i][1]);
+						exit(1);
+					}
+					switch (argv[i][1]) {
+						case 'f': g->capture_file = argv[i +1]; break;
+						case 's': g->from = argv[i +1]; break;
+						case 'e': g->to = argv[i +1]; break;
+					}
+					i++;
+					break;
+
+				default: break;
+			} // switch
+		}
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: parse_time
+  Returns Type	: int
+  ----Parameter List
+  1. const char *s,
+  2. int64_t day_start, CLOCK_REALTIME ns, used to fill in a bare time
+  3. int64_t *wall, result in CLOCK_REALTIME ns
+  ------------------
+  Exit Codes	: 0 on success, -1 if we can't make sense of it
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+static int parse_time(const char *s, int64_t day_start, int64_t *wall) {
+	static const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%H:%M:%S", "%H:%M" };
+	struct tm tm;
+	size_t i;
+	const char *p;
+	time_t t;
+	int ms = 0;
+
+	if (strspn(s, "0123456789") == strlen(s)) {
+		*wall = strtoll(s, NULL, 10) *1000000LL;
+		return 0;
+	}
+
+	/*
+	 * strptime() leaves whatever it managed to parse in tm when it
+	 * fails, so start each format from a clean copy of the day.
+	 *
+	 */
+	for (i = 0, p = NULL; !p && i < sizeof(formats) / sizeof(formats[0]); i++) {
+		t = day_start / 1000000000LL;
+		localtime_r(&t, &tm);
+		tm.tm_sec = 0;
+		p = strptime(s, formats[i], &tm);
+	}
+	if (!p) return -1;
+
+	if (*p == '.') {
+		int digits = 0;
+		for (p++; *p >= '0' && *p <= '9'; p++) {
+			if (digits++ < 3) ms = ms *10 + (*p - '0');
+		}
+		while (digits++ < 3) ms *= 10;
+	}
+	if (*p) return -1;
+
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	if (t == (time_t)-1) return -1;
+
+	*wall = (int64_t)t *1000000000LL + ms *1000000LL;
+
+	return 0;
+}
+
+static void show_info(const struct adm20_capture_map *m) {
+	uint64_t ok = 0, rejected = 0, i;
+
+	for (i = 0; i < m->count; i++) {
+		if (m->records[i].status & ADM20_CAPTURE_OK) ok++;
+		else rejected++;
+	}
+
+	fprintf(stdout,"records: %llu ( ok %llu, rejected %llu )\r\n", (unsigned long long)m->count, (unsigned long long)ok, (unsigned long long)rejected);
+	fprintf(stdout,"index: %llu entries every %u records\r\n", (unsigned long long)m->index_count, m->every);
+	if (m->count) {
+		fprintf(stdout,"first: %lld ms\r\n", (long long)(adm20_capture_wall(&m->records[0]) / 1000000LL));
+		fprintf(stdout,"last: %lld ms\r\n", (long long)(adm20_capture_wall(&m->records[m->count -1]) / 1000000LL));
+	}
+}
+
+int main(int argc, char **argv) {
+	struct adm20_capture_map m;
+	struct glb g;
+	int64_t from = INT64_MIN, to = INT64_MAX;
+	uint64_t rows = 0;
+	char line[SSIZE];
+	static char obuf[1 << 16];
+
+	init(&g);
+	parse_parameters(&g, argc, argv);
+
+	if (!g.capture_file) {
+		fprintf(stderr,"%s:%d: No capture file specified, use -f <capture file>\r\n", FL);
+		exit(1);
+	}
+
+	if (adm20_capture_map_open(&m, g.capture_file)) exit(1);
+
+	if (g.info) {
+		show_info(&m);
+		adm20_capture_map_close(&m);
+		return 0;
+	}
+
+	if (g.from || g.to) {
+		int64_t day_start = m.count ? adm20_capture_wall(&m.records[0]) : m.header->created_wall;
+
+		if (g.from && parse_time(g.from, day_start, &from)) {
+			fprintf(stderr,"%s:%d: Can't make sense of start time '%s'\r\n", FL, g.from);
+			exit(1);
+		}
+		if (g.to && parse_time(g.to, day_start, &to)) {
+			fprintf(stderr,"%s:%d: Can't make sense of end time '%s'\r\n", FL, g.to);
+			exit(1);
+		}
+	}
+
+	setvbuf(stdout, obuf, _IOFBF, sizeof(obuf));
+
+	if (g.header) fprintf(stdout,"time_ms,mono_ms,value,unit,mode,display\n");
+
+	for (auto &r : adm20_capture_window(&m, from, to)) {
+		const struct adm20_reading *rd = &r.reading;
+
+		adm20_reading_format(rd, line, sizeof(line), ADM20_FORMAT_LOG);
+
+		/*
+		 * OL, dashes, Err and patterns we have no glyph for have
+		 * no value, the column is left empty rather than written
+		 * as a 0 that would plot as a real reading.
+		 *
+		 */
+		if (rd->flags & (ADM20_READING_OVERLOAD | ADM20_READING_NAN)) {
+			fprintf(stdout,"%lld,%llu,,%s,%s,%s\n", (long long)(r.wall / 1000000LL), (unsigned long long)(rd->timestamp / 1000000ULL), adm20_unit_text[rd->unit], adm20_mode_text(rd->mode), line);
+		} else {
+			fprintf(stdout,"%lld,%llu,%.9g,%s,%s,%s\n", (long long)(r.wall / 1000000LL), (unsigned long long)(rd->timestamp / 1000000ULL), adm20_reading_value(rd), adm20_unit_text[rd->unit], adm20_mode_text(rd->mode), line);
+		}
+		rows++;
+	}
+
+	fflush(stdout);
+	if (g.debug) fprintf(stderr,"%s:%d: %llu readings from %llu records\r\n", FL, (unsigned long long)rows, (unsigned long long)m.count);
+
+	adm20_capture_map_close(&m);
+
+	return 0;
+}
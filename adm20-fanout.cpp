@@ -0,0 +1,207 @@
+/*
+ * BSIDE-ADM20 in-process reading fan-out
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "adm20-fanout.h"
+
+#define FL __FILE__,__LINE__
+
+void adm20_fanout_init(struct adm20_fanout *f) {
+	memset(f, 0, sizeof(*f));
+}
+
+static void wake(struct adm20_fanout_cursor *c) {
+	eventfd_write(c->efd, 1); // non-blocking, a full counter just means it's already awake
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_fanout_publish
+  Returns Type	: void
+  ----Parameter List
+  1. struct adm20_fanout *f,
+  2. const struct adm20_reading *r,
+  ------------------
+  Exit Codes	:
+  Side Effects	: may write() to the eventfd of a sleeping consumer
+  --------------------------------------------------------------------
+Comments:
+	Producer side only, and there is only ever one producer.  The
+	full fence pairs with the one in adm20_fanout_wait(), either
+	we see the consumer's waiting flag or it sees our new head.
+
+\------------------------------------------------------------------*/
+void adm20_fanout_publish(struct adm20_fanout *f, const struct adm20_reading *r) {
+	uint64_t n = f->head;
+	struct adm20_fanout_slot *s = &f->slot[n & ADM20_FANOUT_MASK];
+	int i;
+
+	__atomic_store_n(&s->seq, 2 *n +1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->reading = *r;
+	__atomic_store_n(&s->seq, 2 *n +2, __ATOMIC_RELEASE);
+	__atomic_store_n(&f->head, n +1, __ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < f->consumers; i++) {
+		if (__atomic_load_n(&f->cursor[i]->waiting, __ATOMIC_RELAXED)) wake(f->cursor[i]);
+	}
+}
+
+void adm20_fanout_close(struct adm20_fanout *f) {
+	int i;
+
+	__atomic_store_n(&f->closed, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < f->consumers; i++) wake(f->cursor[i]);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_fanout_subscribe
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_fanout *f,
+  2. struct adm20_fanout_cursor *c,
+  3. const char *name, for reporting
+  ------------------
+  Exit Codes	: 0 on success, -1 with the reason already reported
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Subscribe everyone before the producer starts, the consumer
+	list itself isn't protected.  A new cursor starts at the next
+	reading to be published.
+
+\------------------------------------------------------------------*/
+int adm20_fanout_subscribe(struct adm20_fanout *f, struct adm20_fanout_cursor *c, const char *name) {
+	if (f->consumers >= ADM20_FANOUT_CONSUMERS) {
+		fprintf(stderr,"%s:%d: Too many reading consumers, %s not added\r\n", FL, name);
+		return -1;
+	}
+
+	memset(c, 0, sizeof(*c));
+	c->f = f;
+	c->name = name;
+	c->next = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+	c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (c->efd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create eventfd for %s (%s)\r\n", FL, name, strerror(errno));
+		return -1;
+	}
+
+	f->cursor[f->consumers++] = c;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_fanout_next
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_fanout_cursor *c,
+  2. struct adm20_reading *out,
+  ------------------
+  Exit Codes	: 1 with the next reading in out, 0 if we're caught up
+  Side Effects	: counts any readings we were lapped on as overruns
+  --------------------------------------------------------------------
+Comments:
+	Never waits on the producer beyond a slot it's part way
+	through writing.
+
+\------------------------------------------------------------------*/
+int adm20_fanout_next(struct adm20_fanout_cursor *c, struct adm20_reading *out) {
+	struct adm20_fanout *f = c->f;
+
+	for (;;) {
+		uint64_t head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+		uint64_t want;
+		struct adm20_fanout_slot *s;
+
+		if (c->next >= head) return 0;
+
+		if (head - c->next > ADM20_FANOUT_SIZE) {
+			c->overruns += head - ADM20_FANOUT_SIZE - c->next;
+			c->next = head - ADM20_FANOUT_SIZE;
+		}
+
+		s = &f->slot[c->next & ADM20_FANOUT_MASK];
+		want = 2 *c->next +2;
+
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != want) continue; // being lapped right now
+		*out = s->reading;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != want) continue;
+
+		c->next++;
+		c->received++;
+		return 1;
+	}
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_fanout_wait
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_fanout_cursor *c,
+  2. int fd, another fd to wait on as well, -1 for none
+  3. int timeout_ms, -1 to wait as long as it takes
+  ------------------
+  Exit Codes	: ADM20_FANOUT_READY, _FD and/or _CLOSED, 0 on timeout
+  Side Effects	: blocks
+  --------------------------------------------------------------------
+Comments:
+	Returns straight away if there's already something to read.
+	Keep calling adm20_fanout_next() until it returns 0 even after
+	ADM20_FANOUT_CLOSED, the last readings are still in the ring.
+
+\------------------------------------------------------------------*/
+int adm20_fanout_wait(struct adm20_fanout_cursor *c, int fd, int timeout_ms) {
+	struct adm20_fanout *f = c->f;
+	struct pollfd pfd[2];
+	eventfd_t v;
+	int r = 0, ready;
+
+	__atomic_store_n(&c->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/*
+	 * With readings already waiting only the extra fd is worth
+	 * looking at, and without sleeping, so a consumer that never
+	 * catches up still hears about it.
+	 *
+	 */
+	ready = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE) != c->next || __atomic_load_n(&f->closed, __ATOMIC_ACQUIRE);
+
+	if (!ready || fd >= 0) {
+		pfd[0].fd = c->efd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		if (poll(pfd, fd >= 0 ? 2 : 1, ready ? 0 : timeout_ms) > 0) {
+			if (pfd[0].revents) eventfd_read(c->efd, &v);
+			if (pfd[1].revents) r |= ADM20_FANOUT_FD;
+		}
+	}
+
+	__atomic_store_n(&c->waiting, 0, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&f->head, __ATOMIC_ACQUIRE) != c->next) r |= ADM20_FANOUT_READY;
+	if (__atomic_load_n(&f->closed, __ATOMIC_ACQUIRE)) r |= ADM20_FANOUT_CLOSED;
+
+	return r;
+}
+
+void adm20_fanout_release(struct adm20_fanout_cursor *c) {
+	if (c->efd >= 0) close(c->efd);
+	c->efd = -1;
+}
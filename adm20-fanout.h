@@ -0,0 +1,77 @@
+/*
+ * BSIDE-ADM20 in-process reading fan-out
+ *
+ * Single producer, multiple consumer ring of decoded readings.  The
+ * acquisition loop publishes every reading and carries straight on,
+ * it never waits for a consumer; each consumer (console, FlexBV
+ * file, display, loggers) has its own cursor and works through the
+ * ring at its own pace on its own thread.  A consumer that falls
+ * more than ADM20_FANOUT_SIZE readings behind is lapped, it skips
+ * forward to the oldest reading still in the ring and the readings
+ * it missed are counted as overruns.
+ *
+ * Each slot carries a sequence number so a consumer can tell a
+ * reading that was overwritten while it was copying it.  Sleeping
+ * consumers are woken through their own eventfd, which the producer
+ * only touches when that consumer has said it's about to sleep.
+ *
+ */
+#ifndef ADM20_FANOUT_H
+#define ADM20_FANOUT_H
+
+#include <stdint.h>
+
+#include "adm20-decode.h"
+
+/*
+ * Must be a power of two, slots are picked by masking the
+ * reading number.
+ *
+ */
+#define ADM20_FANOUT_SIZE 256
+#define ADM20_FANOUT_MASK (ADM20_FANOUT_SIZE -1)
+#define ADM20_FANOUT_CONSUMERS 8
+
+/*
+ * adm20_fanout_wait() results
+ *
+ */
+#define ADM20_FANOUT_READY 0x01   // readings waiting for this cursor
+#define ADM20_FANOUT_FD 0x02      // the extra fd is readable
+#define ADM20_FANOUT_CLOSED 0x04  // the producer has finished
+
+struct adm20_fanout_slot {
+	uint64_t seq;                 // 2n+1 while reading n goes in, 2n+2 once it's there
+	struct adm20_reading reading;
+} __attribute__((aligned(64)));
+
+struct adm20_fanout;
+
+struct adm20_fanout_cursor {
+	struct adm20_fanout *f;
+	const char *name;
+	uint64_t next;                // next reading number wanted
+	uint64_t received;
+	uint64_t overruns;            // readings lapped before we got to them
+	int efd;                      // eventfd the producer pokes to wake us
+	uint32_t waiting;             // set while we're (about to be) asleep
+} __attribute__((aligned(64)));
+
+struct adm20_fanout {
+	uint64_t head __attribute__((aligned(64)));  // readings published
+	uint32_t closed;
+	int consumers;
+	struct adm20_fanout_cursor *cursor[ADM20_FANOUT_CONSUMERS];
+	struct adm20_fanout_slot slot[ADM20_FANOUT_SIZE];
+};
+
+void adm20_fanout_init(struct adm20_fanout *f);
+void adm20_fanout_publish(struct adm20_fanout *f, const struct adm20_reading *r);
+void adm20_fanout_close(struct adm20_fanout *f);
+
+int adm20_fanout_subscribe(struct adm20_fanout *f, struct adm20_fanout_cursor *c, const char *name);
+int adm20_fanout_next(struct adm20_fanout_cursor *c, struct adm20_reading *out);
+int adm20_fanout_wait(struct adm20_fanout_cursor *c, int fd, int timeout_ms);
+void adm20_fanout_release(struct adm20_fanout_cursor *c);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * BSIDE-ADM20 frame reader
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+
+uint64_t adm20_monotonic_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec *1000000000ULL + ts.tv_nsec;
+}
+
+void adm20_reader_init(struct adm20_reader *r, int fd) {
+	r->fd = fd;
+	r->head = 0;
+	r->tail = 0;
+	r->frame_len = 0;
+	r->synced = 0;
+	r->fill_time = 0;
+	r->frames_ok = 0;
+	r->frames_rejected = 0;
+	r->bytes_discarded = 0;
+	r->resyncs = 0;
+}
+
+/*
+ * Carry on from a reopened port, whatever was buffered from the old
+ * one is thrown away but the counters keep running
+ *
+ */
+void adm20_reader_attach(struct adm20_reader *r, int fd) {
+	r->fd = fd;
+	r->tail = r->head;
+	r->frame_len = 0;
+	r->synced = 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_reader_fill
+  Returns Type	: ssize_t
+  ----Parameter List
+  1. struct adm20_reader *r,
+  ------------------
+  Exit Codes	: bytes added to the ring, 0 on EOF, -1 on error
+  Side Effects	: blocks until the port has at least one byte
+  --------------------------------------------------------------------
+Comments:
+	One readv() for all the free space in the ring, both sides of
+	the wrap.  adm20_reader_next() never leaves more than a frame's
+	worth of unconsumed bytes behind, so there is always space.
+
+	Asking for less than a frame where the ring wraps would break
+	a port set up with VMIN to hand over whole frames; the read
+	returns short and the next one waits out VTIME for bytes that
+	have already been sent.
+
+\------------------------------------------------------------------*/
+ssize_t adm20_reader_fill(struct adm20_reader *r) {
+	uint32_t used = r->head - r->tail;
+	uint32_t start = r->head & ADM20_RING_MASK;
+	uint32_t space = ADM20_RING_SIZE - used;
+	struct iovec iov[2];
+	ssize_t bytes_read;
+	int n = 1;
+
+	if (space == 0) return 0;
+
+	iov[0].iov_base = r->ring + start;
+	iov[0].iov_len = space;
+	if (space > ADM20_RING_SIZE - start) {
+		iov[0].iov_len = ADM20_RING_SIZE - start;
+		iov[1].iov_base = r->ring;
+		iov[1].iov_len = space - iov[0].iov_len;
+		n = 2;
+	}
+
+	bytes_read = readv(r->fd, iov, n);
+	if (bytes_read > 0) {
+		r->head += bytes_read;
+		r->fill_time = adm20_monotonic_ns();
+	}
+
+	return bytes_read;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_reader_feed
+  Returns Type	: size_t
+  ----Parameter List
+  1. struct adm20_reader *r,
+  2. const uint8_t *data,
+  3. size_t len,
+  4. uint64_t timestamp, CLOCK_MONOTONIC ns to report as the fill time
+  ------------------
+  Exit Codes	: bytes added to the ring, short if it was full
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	adm20_reader_fill() for bytes that didn't come from r->fd, such
+	as a capture being replayed, so they go through exactly the
+	same parsing as live data.
+
+\------------------------------------------------------------------*/
+size_t adm20_reader_feed(struct adm20_reader *r, const uint8_t *data, size_t len, uint64_t timestamp) {
+	uint32_t space = ADM20_RING_SIZE - (r->head - r->tail);
+	size_t n, i;
+
+	n = len < space ? len : space;
+	for (i = 0; i < n; i++) r->ring[(r->head + i) & ADM20_RING_MASK] = data[i];
+	r->head += n;
+	if (n) r->fill_time = timestamp;
+
+	return n;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_frame_valid
+  Returns Type	: int
+  ----Parameter List
+  1. const uint8_t *f, ADM20_FRAME_SIZE bytes
+  ------------------
+  Exit Codes	: 1 if the frame looks like something the meter sent
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Structural checks only; there can only be one decimal point,
+	and the meter never lights more than one unit or one prefix
+	annunciator at a time.  The digits aren't checked, a segment
+	pattern we have no glyph for is still what the LCD shows, it
+	goes through as a non-numeric (NaN) reading and the segment
+	renderer draws it as is.
+
+\------------------------------------------------------------------*/
+int adm20_frame_valid(const uint8_t *f) {
+	int dps;
+
+	if (f[ADM20_FRAME_SIZE -1] != ADM20_FRAME_END) return 0;
+
+	dps = !!(f[4] & ADM20_SEGMENT_DP) + !!(f[5] & ADM20_SEGMENT_DP) + !!(f[6] & ADM20_SEGMENT_DP);
+	if (dps > 1) return 0;
+
+	// F, degF, degC, Hz, Ohm, V, A
+	if (__builtin_popcount((f[18] & 0x83) | ((f[19] & 0xCC) << 8)) > 1) return 0;
+
+	// n, u, k, M, m, u
+	if (__builtin_popcount((f[18] & 0x60) | ((f[19] & 0x33) << 8)) > 1) return 0;
+
+	return 1;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_reader_next
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_reader *r,
+  2. const uint8_t **frame, set to the frame on ADM20_FRAME_OK, and
+     on ADM20_FRAME_REJECTED to the failed candidate or NULL if it
+     was truncated
+  ------------------
+  Exit Codes	: ADM20_FRAME_MORE, ADM20_FRAME_OK or ADM20_FRAME_REJECTED
+  Side Effects	: updates the reader counters
+  --------------------------------------------------------------------
+Comments:
+	Every 0x55 closes a candidate frame.  Anything more than a
+	frame's length before the terminator is line noise and is
+	skipped, anything shorter is a truncated frame and is rejected
+	along with any candidate that fails adm20_frame_valid().
+
+	With no terminator buffered yet, only the last frame's worth
+	of bytes can still become part of a good frame, everything
+	older is discarded so that we're hunting from the right place
+	as soon as the next 0x55 shows up.
+
+	The frame pointer is only valid until the next adm20_reader_fill().
+
+\------------------------------------------------------------------*/
+int adm20_reader_next(struct adm20_reader *r, const uint8_t **frame) {
+	uint32_t avail = r->head - r->tail;
+	uint32_t n, start;
+	const uint8_t *p;
+
+	for (n = 0; n < avail; n++) {
+		if (r->ring[(r->tail + n) & ADM20_RING_MASK] == ADM20_FRAME_END) break;
+	}
+
+	if (n == avail) {
+		if (avail > ADM20_FRAME_SIZE -1) {
+			n = avail - (ADM20_FRAME_SIZE -1);
+			r->tail += n;
+			r->bytes_discarded += n;
+			r->synced = 0;
+		}
+		return ADM20_FRAME_MORE;
+	}
+
+	n++; // include the terminator
+	r->frame_len = n;
+
+	if (n < ADM20_FRAME_SIZE) {
+		r->tail += n;
+		r->frames_rejected++;
+		r->synced = 0;
+		*frame = NULL;
+		return ADM20_FRAME_REJECTED;
+	}
+
+	if (n > ADM20_FRAME_SIZE) {
+		r->tail += n - ADM20_FRAME_SIZE;
+		r->bytes_discarded += n - ADM20_FRAME_SIZE;
+		r->synced = 0;
+		r->frame_len = ADM20_FRAME_SIZE;
+	}
+
+	start = r->tail & ADM20_RING_MASK;
+	if (start + ADM20_FRAME_SIZE <= ADM20_RING_SIZE) {
+		p = r->ring + start;
+	} else {
+		uint32_t first = ADM20_RING_SIZE - start;
+		memcpy(r->frame, r->ring + start, first);
+		memcpy(r->frame + first, r->ring, ADM20_FRAME_SIZE - first);
+		p = r->frame;
+	}
+	r->tail += ADM20_FRAME_SIZE;
+	*frame = p;
+
+	if (!adm20_frame_valid(p)) {
+		r->frames_rejected++;
+		r->synced = 0;
+		return ADM20_FRAME_REJECTED;
+	}
+
+	if (!r->synced) {
+		if (r->frames_ok) r->resyncs++;
+		r->synced = 1;
+	}
+	r->frames_ok++;
+
+	return ADM20_FRAME_OK;
+}
@@ -0,0 +1,68 @@
+/*
+ * BSIDE-ADM20 frame reader
+ *
+ * Pulls whatever the serial port has waiting in to a ring buffer
+ * with a single read() and splits it in to the 22 byte frames the
+ * meter sends, each terminated by 0x55.  Partial frames are kept
+ * in the ring between calls.
+ *
+ * Every candidate frame is checked for a single decimal point and
+ * sane unit/prefix bits before it is handed out, so after line noise
+ * or a USB hiccup we lock back on to the first good frame rather
+ * than decoding rubbish.  Digit patterns aren't judged here, ones
+ * the decoder doesn't know just make a non-numeric reading.
+ *
+ */
+#ifndef ADM20_FRAME_H
+#define ADM20_FRAME_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ADM20_FRAME_SIZE 22
+#define ADM20_FRAME_END 0x55
+
+/*
+ * Must be a power of two, the ring indices are masked rather
+ * than wrapped with a modulo.
+ *
+ */
+#define ADM20_RING_SIZE 1024
+#define ADM20_RING_MASK (ADM20_RING_SIZE -1)
+
+/*
+ * adm20_reader_next() results
+ *
+ */
+#define ADM20_FRAME_MORE 0      // need more bytes from the port
+#define ADM20_FRAME_OK 1        // a validated frame is available
+#define ADM20_FRAME_REJECTED 2  // a candidate frame was thrown away
+
+struct adm20_reader {
+	int fd;
+	uint32_t head;       // next byte to be written by read()
+	uint32_t tail;       // oldest byte not yet consumed
+	uint32_t frame_len;  // length of the last candidate looked at
+	uint8_t synced;      // last candidate was a good frame
+	uint64_t fill_time;  // CLOCK_MONOTONIC ns of the last successful read()
+
+	uint64_t frames_ok;        // frames accepted
+	uint64_t frames_rejected;  // truncated or structurally bad frames
+	uint64_t bytes_discarded;  // bytes skipped while hunting for a frame
+	uint64_t resyncs;          // times we regained lock after losing it
+
+	uint8_t ring[ADM20_RING_SIZE];
+	uint8_t frame[ADM20_FRAME_SIZE]; // only used when a frame wraps the end of the ring
+};
+
+uint64_t adm20_monotonic_ns(void);
+
+void adm20_reader_init(struct adm20_reader *r, int fd);
+void adm20_reader_attach(struct adm20_reader *r, int fd);
+ssize_t adm20_reader_fill(struct adm20_reader *r);
+size_t adm20_reader_feed(struct adm20_reader *r, const uint8_t *data, size_t len, uint64_t timestamp);
+int adm20_reader_next(struct adm20_reader *r, const uint8_t **frame);
+
+int adm20_frame_valid(const uint8_t *f);
+
+#endif
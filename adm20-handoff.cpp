@@ -0,0 +1,214 @@
+/*
+ * BSIDE-ADM20 FlexBV output file handoff
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "adm20-frame.h"
+#include "adm20-handoff.h"
+
+#define FL __FILE__,__LINE__
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_handoff_open
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_handoff *h,
+  2. const char *path, the -o file, NULL if there isn't one
+  ------------------
+  Exit Codes	: 0 on success, -1 with the reason already reported
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	With no path the handoff is left inactive, adm20_handoff_wait()
+	then just reports the port as ready and everything else is a
+	no-op.
+
+\------------------------------------------------------------------*/
+int adm20_handoff_open(struct adm20_handoff *h, const char *path) {
+	struct stat st;
+	const char *slash;
+
+	memset(h, 0, sizeof(*h));
+	h->ifd = -1;
+	h->wd = -1;
+
+	if (!path) return 0;
+
+	h->path = path;
+	slash = strrchr(path, '/');
+	h->name = slash ? slash +1 : path;
+
+	/*
+	 * Watch the directory rather than the file, the file isn't
+	 * there half the time and a watch on it dies with it.
+	 *
+	 */
+	if (!slash) snprintf(h->tmp, sizeof(h->tmp), ".");
+	else if (slash == path) snprintf(h->tmp, sizeof(h->tmp), "/");
+	else snprintf(h->tmp, sizeof(h->tmp), "%.*s", (int)(slash - path), path);
+
+	h->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (h->ifd < 0) {
+		fprintf(stderr,"%s:%d: Unable to start inotify (%s)\r\n", FL, strerror(errno));
+		return -1;
+	}
+
+	h->wd = inotify_add_watch(h->ifd, h->tmp, IN_DELETE | IN_MOVED_FROM);
+	if (h->wd < 0) {
+		fprintf(stderr,"%s:%d: Unable to watch '%s' for %s (%s)\r\n", FL, h->tmp, h->name, strerror(errno));
+		close(h->ifd);
+		h->ifd = -1;
+		return -1;
+	}
+
+	snprintf(h->tmp, sizeof(h->tmp), "%s.tmp", path);
+
+	// Whatever is there from a previous run FlexBV hasn't taken yet
+	h->want = stat(path, &st) != 0;
+	h->published = h->reading_time = adm20_monotonic_ns();
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_handoff_check
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_handoff *h,
+  ------------------
+  Exit Codes	: 1 if FlexBV took the file since we last looked
+  Side Effects	: sets h->want and the pickup times
+  --------------------------------------------------------------------
+Comments:
+	Drains the inotify fd without blocking.  If the event queue
+	overflowed we can't know what happened, one stat() settles it.
+
+\------------------------------------------------------------------*/
+int adm20_handoff_check(struct adm20_handoff *h) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int consumed = 0, overflow = 0;
+	ssize_t n;
+
+	if (h->ifd < 0) return 0;
+
+	while ((n = read(h->ifd, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+
+		while (p < buf + n) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) overflow = 1;
+			else if (ev->len && !strcmp(ev->name, h->name)) consumed = 1;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	if (overflow && !consumed) {
+		struct stat st;
+		consumed = stat(h->path, &st) != 0;
+	}
+
+	if (!consumed || h->want) return 0;
+
+	{
+		uint64_t now = adm20_monotonic_ns();
+
+		h->want = 1;
+		h->pickups++;
+		h->wait_last = now - h->published;
+		h->age_last = now - h->reading_time;
+		h->wait_total += h->wait_last;
+		if (h->wait_last > h->wait_max) h->wait_max = h->wait_last;
+		if (h->age_last > h->age_max) h->age_max = h->age_last;
+	}
+
+	return 1;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_handoff_wait
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_handoff *h,
+  2. int fd, the serial port
+  ------------------
+  Exit Codes	: ADM20_HANDOFF_INPUT and/or ADM20_HANDOFF_CONSUMED
+  Side Effects	: blocks until one of them happens
+  --------------------------------------------------------------------
+Comments:
+	Used in place of blocking in read() on the port, so that when
+	FlexBV takes the file we can hand over the reading we already
+	have straight away rather than at the next frame.
+
+\------------------------------------------------------------------*/
+int adm20_handoff_wait(struct adm20_handoff *h, int fd) {
+	struct pollfd pfd[2];
+	int r = 0;
+
+	if (h->ifd < 0) return ADM20_HANDOFF_INPUT;
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = h->ifd;
+	pfd[1].events = POLLIN;
+
+	if (poll(pfd, 2, -1) < 0) return errno == EINTR ? 0 : ADM20_HANDOFF_INPUT;
+
+	if (pfd[0].revents) r |= ADM20_HANDOFF_INPUT; // POLLHUP/POLLERR too, let read() report them
+	if (pfd[1].revents && adm20_handoff_check(h)) r |= ADM20_HANDOFF_CONSUMED;
+
+	return r;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_handoff_publish
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_handoff *h,
+  2. const char *text, the line for FlexBV
+  3. uint64_t reading_time, CLOCK_MONOTONIC ns of the reading
+  ------------------
+  Exit Codes	: 1 if a file was written, 0 if FlexBV still has one, -1 on error
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Written to a .tmp and renamed in to place so FlexBV never sees
+	half a line.
+
+\------------------------------------------------------------------*/
+int adm20_handoff_publish(struct adm20_handoff *h, const char *text, uint64_t reading_time) {
+	ssize_t written;
+	size_t len = strlen(text);
+	int fd;
+
+	if (h->ifd < 0 || !h->want) return 0;
+
+	fd = open(h->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	written = write(fd, text, len);
+	close(fd);
+	if (written != (ssize_t)len || rename(h->tmp, h->path)) return -1;
+
+	h->want = 0;
+	h->published = adm20_monotonic_ns();
+	h->reading_time = reading_time;
+
+	return 1;
+}
+
+void adm20_handoff_close(struct adm20_handoff *h) {
+	if (h->ifd >= 0) close(h->ifd);
+	h->ifd = -1;
+}
@@ -0,0 +1,48 @@
+/*
+ * BSIDE-ADM20 FlexBV output file handoff
+ *
+ * FlexBV reads the -o file and deletes it when it wants the next
+ * reading.  Rather than checking for the file on every frame we
+ * watch its directory with inotify and only write a new one once
+ * the old one has gone, so while FlexBV is idle nothing touches
+ * the filesystem at all.
+ *
+ * The time each file sat waiting, and how old its reading was by
+ * the time FlexBV took it, are kept so stale handoffs show up.
+ *
+ */
+#ifndef ADM20_HANDOFF_H
+#define ADM20_HANDOFF_H
+
+#include <stdint.h>
+
+/*
+ * adm20_handoff_wait() results
+ *
+ */
+#define ADM20_HANDOFF_INPUT 0x01     // the port has data to read
+#define ADM20_HANDOFF_CONSUMED 0x02  // FlexBV took the file
+
+struct adm20_handoff {
+	int ifd;                // inotify fd, -1 when there's no -o file
+	int wd;
+	uint8_t want;           // no file out there, publish the next good reading
+	const char *path;
+	const char *name;       // final component of path, as inotify reports it
+	char tmp[4096];
+
+	uint64_t published;     // CLOCK_MONOTONIC ns the current file was written
+	uint64_t reading_time;  // CLOCK_MONOTONIC ns of the reading in it
+
+	uint64_t pickups;
+	uint64_t wait_last, wait_max, wait_total;  // ns a file sat before it was taken
+	uint64_t age_last, age_max;                // ns old its reading was by then
+};
+
+int adm20_handoff_open(struct adm20_handoff *h, const char *path);
+int adm20_handoff_wait(struct adm20_handoff *h, int fd);
+int adm20_handoff_check(struct adm20_handoff *h);
+int adm20_handoff_publish(struct adm20_handoff *h, const char *text, uint64_t reading_time);
+void adm20_handoff_close(struct adm20_handoff *h);
+
+#endif
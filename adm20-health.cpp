@@ -0,0 +1,200 @@
+/*
+ * BSIDE-ADM20 serial link health
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include "adm20-health.h"
+
+#define FL __FILE__,__LINE__
+
+void adm20_health_init(struct adm20_health *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+static int read_icount(int fd, uint32_t *v) {
+	struct serial_icounter_struct ic;
+
+	if (fd < 0 || ioctl(fd, TIOCGICOUNT, &ic) < 0) return -1;
+	v[0] = ic.frame;
+	v[1] = ic.overrun;
+	v[2] = ic.parity;
+	v[3] = ic.brk;
+	v[4] = ic.buf_overrun;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_health_port
+  Returns Type	: void
+  ----Parameter List
+  1. struct adm20_health *h,
+  2. int fd, the port just (re)opened
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	The kernel's counts belong to the device, not to us, so
+	whatever they are when we open it is the baseline.  Call
+	adm20_health_poll() before closing a port to keep its tail.
+
+\------------------------------------------------------------------*/
+void adm20_health_port(struct adm20_health *h, int fd) {
+	h->last_frame = 0;
+	h->icount = !read_icount(fd, h->last);
+	h->polled = adm20_monotonic_ns();
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_health_poll
+  Returns Type	: void
+  ----Parameter List
+  1. struct adm20_health *h,
+  2. int fd,
+  3. uint64_t now, CLOCK_MONOTONIC ns, 0 to read them regardless
+  ------------------
+  Exit Codes	:
+  Side Effects	: one ioctl() at most
+  --------------------------------------------------------------------
+Comments:
+	Folds what the kernel has counted since the last look in to
+	our totals, only once every ADM20_HEALTH_POLL_MS unless forced.
+
+\------------------------------------------------------------------*/
+void adm20_health_poll(struct adm20_health *h, int fd, uint64_t now) {
+	uint32_t v[5];
+
+	if (!h->icount || fd < 0) return;
+	if (now && now - h->polled < ADM20_HEALTH_POLL_MS *1000000ULL) return;
+	h->polled = now ? now : adm20_monotonic_ns();
+	if (read_icount(fd, v)) return;
+
+	h->frame += v[0] - h->last[0];
+	h->overrun += v[1] - h->last[1];
+	h->parity += v[2] - h->last[2];
+	h->brk += v[3] - h->last[3];
+	h->buf_overrun += v[4] - h->last[4];
+	memcpy(h->last, v, sizeof(v));
+}
+
+/*
+ * One line, short enough to sit under the reading.  The good frame
+ * count is left out on purpose, it'd change the line every frame.
+ *
+ */
+size_t adm20_health_format(const struct adm20_health *h, const struct adm20_reader *r, char *buf, size_t len) {
+	int n;
+
+	n = snprintf(buf, len, "rej %llu  resync %llu  skip %lluB  "
+			, (unsigned long long)r->frames_rejected
+			, (unsigned long long)r->resyncs
+			, (unsigned long long)r->bytes_discarded
+			);
+	if (n < 0 || (size_t)n >= len) return len ? len -1 : 0;
+
+	if (h->gap.count) n += snprintf(buf +n, len -n, "gap %.0f/%.0fms  ", adm20_hist_percentile(&h->gap, 50) / 1e6, h->gap.max / 1e6);
+	else n += snprintf(buf +n, len -n, "gap -  ");
+	if ((size_t)n >= len) return len -1;
+
+	if (h->icount) {
+		n += snprintf(buf +n, len -n, "fe %llu oe %llu pe %llu brk %llu"
+				, (unsigned long long)h->frame
+				, (unsigned long long)(h->overrun + h->buf_overrun)
+				, (unsigned long long)h->parity
+				, (unsigned long long)h->brk
+				);
+	} else {
+		n += snprintf(buf +n, len -n, "no line counts");
+	}
+
+	return (size_t)n < len ? (size_t)n : len -1;
+}
+
+void adm20_health_report(const struct adm20_health *h, const struct adm20_reader *r, const char *name, FILE *f) {
+	fprintf(f,"\r\nLink %s: %llu frames ok, %llu rejected, %llu resyncs, %llu bytes discarded\r\n"
+			, name
+			, (unsigned long long)r->frames_ok
+			, (unsigned long long)r->frames_rejected
+			, (unsigned long long)r->resyncs
+			, (unsigned long long)r->bytes_discarded
+			);
+	if (h->gap.count) {
+		fprintf(f,"  frame gaps (ms): min %.1f, p50 %.1f, p99 %.1f, max %.1f\r\n"
+				, h->gap.min / 1e6
+				, adm20_hist_percentile(&h->gap, 50) / 1e6
+				, adm20_hist_percentile(&h->gap, 99) / 1e6
+				, h->gap.max / 1e6
+				);
+	}
+	if (h->icount) {
+		fprintf(f,"  kernel: framing %llu, overrun %llu, parity %llu, break %llu, buffer overrun %llu\r\n"
+				, (unsigned long long)h->frame
+				, (unsigned long long)h->overrun
+				, (unsigned long long)h->parity
+				, (unsigned long long)h->brk
+				, (unsigned long long)h->buf_overrun
+				);
+	} else {
+		fprintf(f,"  kernel: no line error counts from this driver\r\n");
+	}
+}
+
+/*
+ * One JSON object per line, gaps in nanoseconds, "kernel" is null
+ * when the driver doesn't count.
+ *
+ */
+void adm20_health_json(const struct adm20_health *h, const struct adm20_reader *r, const char *name, FILE *f) {
+	fprintf(f,"{\"link\":\"%s\",\"frames_ok\":%llu,\"frames_rejected\":%llu,\"resyncs\":%llu,\"bytes_discarded\":%llu"
+			, name
+			, (unsigned long long)r->frames_ok
+			, (unsigned long long)r->frames_rejected
+			, (unsigned long long)r->resyncs
+			, (unsigned long long)r->bytes_discarded
+			);
+	fprintf(f,",\"gap\":{\"count\":%llu,\"min\":%llu,\"max\":%llu,\"p50\":%llu,\"p99\":%llu}"
+			, (unsigned long long)h->gap.count
+			, (unsigned long long)h->gap.min
+			, (unsigned long long)h->gap.max
+			, (unsigned long long)adm20_hist_percentile(&h->gap, 50)
+			, (unsigned long long)adm20_hist_percentile(&h->gap, 99)
+			);
+	if (h->icount) {
+		fprintf(f,",\"kernel\":{\"frame\":%llu,\"overrun\":%llu,\"parity\":%llu,\"brk\":%llu,\"buf_overrun\":%llu}}\n"
+				, (unsigned long long)h->frame
+				, (unsigned long long)h->overrun
+				, (unsigned long long)h->parity
+				, (unsigned long long)h->brk
+				, (unsigned long long)h->buf_overrun
+				);
+	} else {
+		fprintf(f,",\"kernel\":null}\n");
+	}
+}
+
+/*
+ * Same split as adm20_latency_dump(), the table to stderr and the
+ * JSON appended to path, or stderr without one
+ *
+ */
+void adm20_health_dump(const struct adm20_health *h, const struct adm20_reader *r, const char *name, const char *path) {
+	FILE *f = stderr;
+
+	adm20_health_report(h, r, name, stderr);
+
+	if (path && !(f = fopen(path, "a"))) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' for the link stats (%s)\r\n", FL, path, strerror(errno));
+		return;
+	}
+	adm20_health_json(h, r, name, f);
+	if (f != stderr) fclose(f);
+}
@@ -0,0 +1,53 @@
+/*
+ * BSIDE-ADM20 serial link health
+ *
+ * The reader already counts what the parser made of the byte stream,
+ * this adds the gaps between good frames and the line errors the
+ * kernel saw (framing, overrun, parity, break) from TIOCGICOUNT, so
+ * a flaky cable or adapter shows as numbers rather than as the
+ * display sitting on the last good reading.
+ *
+ * Roughly: kernel errors climbing means the adapter or the wiring,
+ * rejected frames with a clean kernel count means the meter end or
+ * the optical link, long gaps with neither means frames are being
+ * lost before they ever reach us.
+ *
+ * Drivers that don't keep the counters (ptys, some USB adapters)
+ * just leave the kernel side out.
+ *
+ */
+#ifndef ADM20_HEALTH_H
+#define ADM20_HEALTH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "adm20-frame.h"
+#include "adm20-latency.h"
+
+#define ADM20_HEALTH_POLL_MS 1000  // kernel counters are read no more often than this
+
+struct adm20_health {
+	uint64_t last_frame;      // fill time of the last good frame, 0 after a (re)connect
+	struct adm20_hist gap;    // between good frames, ns
+
+	int icount;               // the driver gives us TIOCGICOUNT
+	uint64_t polled;          // when the kernel counters were last read
+	uint32_t last[5];         // as of then, in the order below
+	uint64_t frame, overrun, parity, brk, buf_overrun;  // since we started, across reopens
+};
+
+static inline void adm20_health_frame(struct adm20_health *h, uint64_t fill_time) {
+	if (h->last_frame && fill_time >= h->last_frame) adm20_hist_record(&h->gap, fill_time - h->last_frame);
+	h->last_frame = fill_time;
+}
+
+void adm20_health_init(struct adm20_health *h);
+void adm20_health_port(struct adm20_health *h, int fd);
+void adm20_health_poll(struct adm20_health *h, int fd, uint64_t now);
+size_t adm20_health_format(const struct adm20_health *h, const struct adm20_reader *r, char *buf, size_t len);
+void adm20_health_report(const struct adm20_health *h, const struct adm20_reader *r, const char *name, FILE *f);
+void adm20_health_json(const struct adm20_health *h, const struct adm20_reader *r, const char *name, FILE *f);
+void adm20_health_dump(const struct adm20_health *h, const struct adm20_reader *r, const char *name, const char *path);
+
+#endif
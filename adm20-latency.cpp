@@ -0,0 +1,174 @@
+/*
+ * BSIDE-ADM20 per-stage latency histograms
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "adm20-frame.h"
+#include "adm20-latency.h"
+
+#define FL __FILE__,__LINE__
+
+const char *adm20_stage_name[ADM20_STAGE_COUNT] = {
+	"read_wait",
+	"assembly",
+	"decode",
+	"shm",
+	"fanout",
+	"console",
+	"flexbv",
+	"render",
+	"screen",
+};
+
+void adm20_latency_init(struct adm20_latency *l) {
+	memset(l, 0, sizeof(*l));
+	l->start = adm20_monotonic_ns();
+}
+
+/*
+ * Smallest value in a bucket, the inverse of adm20_hist_index()
+ *
+ */
+static uint64_t bucket_low(int i) {
+	int shift;
+
+	if (i < ADM20_HIST_SUB *2) return i;
+	shift = (i >> ADM20_HIST_SUB_BITS) -1;
+
+	return (uint64_t)(ADM20_HIST_SUB + (i & (ADM20_HIST_SUB -1))) << shift;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_hist_percentile
+  Returns Type	: uint64_t
+  ----Parameter List
+  1. const struct adm20_hist *h,
+  2. double pct, 0 to 100
+  ------------------
+  Exit Codes	: the value at that percentile, 0 if nothing's recorded
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Middle of the bucket the percentile falls in, clamped to the
+	exact min and max so p0 and p100 come out right.
+
+\------------------------------------------------------------------*/
+uint64_t adm20_hist_percentile(const struct adm20_hist *h, double pct) {
+	uint64_t want, seen = 0, v;
+	int i;
+
+	if (!h->count) return 0;
+	want = (uint64_t)(pct / 100.0 * h->count + 0.5);
+	if (want < 1) want = 1;
+	if (want > h->count) want = h->count;
+
+	for (i = 0; i < ADM20_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want) break;
+	}
+	if (i >= ADM20_HIST_BUCKETS) return h->max;
+
+	v = bucket_low(i) + (bucket_low(i +1) - bucket_low(i)) /2;
+	if (v < h->min) v = h->min;
+	if (v > h->max) v = h->max;
+
+	return v;
+}
+
+/*
+ * Human readable, in microseconds, stages nothing was recorded for
+ * are left out
+ *
+ */
+void adm20_latency_report(const struct adm20_latency *l, FILE *f) {
+	int i;
+
+	fprintf(f,"\r\nLatency (us)  %10s %10s %10s %10s %10s %10s %10s %10s\r\n", "count", "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < ADM20_STAGE_COUNT; i++) {
+		const struct adm20_hist *h = &l->stage[i];
+
+		if (!h->count) continue;
+		fprintf(f,"%-13s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\r\n"
+				, adm20_stage_name[i]
+				, (unsigned long long)h->count
+				, h->min / 1e3
+				, h->total / 1e3 / h->count
+				, adm20_hist_percentile(h, 50) / 1e3
+				, adm20_hist_percentile(h, 90) / 1e3
+				, adm20_hist_percentile(h, 99) / 1e3
+				, adm20_hist_percentile(h, 99.9) / 1e3
+				, h->max / 1e3
+				);
+	}
+}
+
+/*
+ * Machine readable, one JSON object per line, times in nanoseconds.
+ * The non-empty buckets go out too as [ lowest value, count ] pairs
+ * so the whole distribution can be rebuilt or merged elsewhere.
+ *
+ */
+void adm20_latency_json(const struct adm20_latency *l, FILE *f) {
+	int i, b, first = 1;
+
+	fprintf(f,"{\"uptime_ns\":%llu,\"stages\":{", (unsigned long long)(adm20_monotonic_ns() - l->start));
+	for (i = 0; i < ADM20_STAGE_COUNT; i++) {
+		const struct adm20_hist *h = &l->stage[i];
+		int first_bucket = 1;
+
+		if (!h->count) continue;
+		fprintf(f,"%s\"%s\":{\"count\":%llu,\"total\":%llu,\"min\":%llu,\"max\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"buckets\":["
+				, first ? "" : ","
+				, adm20_stage_name[i]
+				, (unsigned long long)h->count
+				, (unsigned long long)h->total
+				, (unsigned long long)h->min
+				, (unsigned long long)h->max
+				, (unsigned long long)adm20_hist_percentile(h, 50)
+				, (unsigned long long)adm20_hist_percentile(h, 90)
+				, (unsigned long long)adm20_hist_percentile(h, 99)
+				, (unsigned long long)adm20_hist_percentile(h, 99.9)
+				);
+		for (b = 0; b < ADM20_HIST_BUCKETS; b++) {
+			if (!h->bucket[b]) continue;
+			fprintf(f,"%s[%llu,%llu]", first_bucket ? "" : ",", (unsigned long long)bucket_low(b), (unsigned long long)h->bucket[b]);
+			first_bucket = 0;
+		}
+		fprintf(f,"]}");
+		first = 0;
+	}
+	fprintf(f,"}}\n");
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_latency_dump
+  Returns Type	: void
+  ----Parameter List
+  1. const struct adm20_latency *l,
+  2. const char *path, file to append the JSON to, NULL for stderr
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	The table always goes to stderr.
+
+\------------------------------------------------------------------*/
+void adm20_latency_dump(const struct adm20_latency *l, const char *path) {
+	FILE *f = stderr;
+
+	adm20_latency_report(l, stderr);
+
+	if (path && !(f = fopen(path, "a"))) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' for the latency stats (%s)\r\n", FL, path, strerror(errno));
+		return;
+	}
+	adm20_latency_json(l, f);
+	if (f != stderr) fclose(f);
+}
@@ -0,0 +1,86 @@
+/*
+ * BSIDE-ADM20 per-stage latency histograms
+ *
+ * Log-linear buckets in the style of HdrHistogram: every power of
+ * two is split in to ADM20_HIST_SUB linear steps, so any value from
+ * a nanosecond to hours lands in a bucket no more than 1/16th wide
+ * and recording one is a couple of shifts and an increment.  They're
+ * cheap enough to be left on all the time.
+ *
+ * Each stage is only ever recorded from one thread, whoever dumps
+ * them reads the counts as they stand and may see a sample or two
+ * half way in; that's fine for a report.
+ *
+ */
+#ifndef ADM20_LATENCY_H
+#define ADM20_LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define ADM20_HIST_SUB_BITS 4
+#define ADM20_HIST_SUB (1 << ADM20_HIST_SUB_BITS)
+#define ADM20_HIST_BUCKETS ((64 - ADM20_HIST_SUB_BITS +1) *ADM20_HIST_SUB)
+
+struct adm20_hist {
+	uint64_t count;
+	uint64_t total;
+	uint64_t min, max;
+	uint64_t bucket[ADM20_HIST_BUCKETS];
+};
+
+/*
+ * Where the time goes between the 0x55 arriving and the reading
+ * being somewhere useful.  The sinks are measured from the read()
+ * that brought the frame in, so they're end to end; the stages in
+ * between are how long each step took.
+ *
+ */
+enum {
+	ADM20_STAGE_READ_WAIT,  // blocked waiting for the port
+	ADM20_STAGE_ASSEMBLY,   // read() returning to the frame coming out of the reader
+	ADM20_STAGE_DECODE,     // adm20_decode()
+	ADM20_STAGE_SHM,        // shared memory publish
+	ADM20_STAGE_FANOUT,     // fan-out publish
+	ADM20_STAGE_CONSOLE,    // read to the line being written out
+	ADM20_STAGE_FLEXBV,     // read to the FlexBV file being in place
+	ADM20_STAGE_RENDER,     // drawing and presenting a reading
+	ADM20_STAGE_SCREEN,     // read to the reading being on screen
+	ADM20_STAGE_COUNT
+};
+
+struct adm20_latency {
+	uint64_t start;
+	struct adm20_hist stage[ADM20_STAGE_COUNT];
+};
+
+extern const char *adm20_stage_name[ADM20_STAGE_COUNT];
+
+static inline int adm20_hist_index(uint64_t v) {
+	int msb, shift;
+
+	if (v < ADM20_HIST_SUB) return (int)v;
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - ADM20_HIST_SUB_BITS;
+
+	return ((shift +1) << ADM20_HIST_SUB_BITS) + (int)((v >> shift) & (ADM20_HIST_SUB -1));
+}
+
+static inline void adm20_hist_record(struct adm20_hist *h, uint64_t ns) {
+	h->bucket[adm20_hist_index(ns)]++;
+	h->total += ns;
+	if (!h->count++ || ns < h->min) h->min = ns;
+	if (ns > h->max) h->max = ns;
+}
+
+static inline void adm20_latency_record(struct adm20_latency *l, int stage, uint64_t ns) {
+	adm20_hist_record(&l->stage[stage], ns);
+}
+
+void adm20_latency_init(struct adm20_latency *l);
+uint64_t adm20_hist_percentile(const struct adm20_hist *h, double pct);
+void adm20_latency_report(const struct adm20_latency *l, FILE *f);
+void adm20_latency_json(const struct adm20_latency *l, FILE *f);
+void adm20_latency_dump(const struct adm20_latency *l, const char *path);
+
+#endif
@@ -0,0 +1,684 @@
+/*
+ * BSIDE-ADM20 serial port handling
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <termios.h>
+#include <unistd.h>
+#include <linux/serial.h>
+
+#include "adm20-frame.h"
+#include "adm20-serial.h"
+
+#define FL __FILE__,__LINE__
+
+static const struct { int rate; speed_t speed; } baud_rates[] = {
+	{ 1200, B1200 },
+	{ 2400, B2400 },
+	{ 4800, B4800 },
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+};
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_serial_config
+  Returns Type	: int
+  ----Parameter List
+  1. const char *serial_config, eg "2400:8n1", NULL for the default
+  2. struct termios *tp, settings to adjust
+  ------------------
+  Exit Codes	: 0 on success, -1 if the config string makes no sense
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Sets the speed and framing on top of cfmakeraw(), CRTSCTS is
+	kept on as it always has been for the ADM20 cable.
+
+\------------------------------------------------------------------*/
+int adm20_serial_config(const char *serial_config, struct termios *tp) {
+	int rate = 0;
+	char bits = '8', parity = 'n', stop = '1';
+	speed_t speed = 0;
+	size_t i;
+
+	if (!serial_config) serial_config = ADM20_DEFAULT_SERIAL_CONFIG;
+
+	if (sscanf(serial_config, "%d:%c%c%c", &rate, &bits, &parity, &stop) < 1) return -1;
+
+	for (i = 0; i < sizeof(baud_rates) / sizeof(baud_rates[0]); i++) {
+		if (baud_rates[i].rate == rate) speed = baud_rates[i].speed;
+	}
+	if (!speed) return -1;
+
+	cfmakeraw(tp);
+	tp->c_cflag = CREAD | CRTSCTS;
+
+	switch (bits) {
+		case '7': tp->c_cflag |= CS7; break;
+		case '8': tp->c_cflag |= CS8; break;
+		default: return -1;
+	}
+
+	switch (parity) {
+		case 'n': case 'N': break;
+		case 'e': case 'E': tp->c_cflag |= PARENB; break;
+		case 'o': case 'O': tp->c_cflag |= PARENB | PARODD; break;
+		default: return -1;
+	}
+
+	switch (stop) {
+		case '1': break;
+		case '2': tp->c_cflag |= CSTOPB; break;
+		default: return -1;
+	}
+
+	cfsetispeed(tp, speed);
+	cfsetospeed(tp, speed);
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_open_port
+  Returns Type	: int
+  ----Parameter List
+  1. struct serial_params_s *s, s->device must be set
+  2. const char *serial_config, eg "2400:8n1", NULL for the default
+  ------------------
+  Exit Codes	: the open fd, or -1 with the reason already reported
+  Side Effects	: the original settings are kept in s->oldtp
+  --------------------------------------------------------------------
+Comments:
+	adm20_close_port() puts them back.
+
+\------------------------------------------------------------------*/
+int adm20_open_port(struct serial_params_s *s, const char *serial_config) {
+
+	if (!s->device) {
+		fprintf(stderr,"%s:%d: No com port specified, use -p <com port>\r\n", FL);
+		return -1;
+	}
+
+	s->fd = open( s->device, O_RDWR | O_NOCTTY |O_NDELAY );
+	if (s->fd <0) {
+		perror( s->device );
+		return -1;
+	}
+
+	fcntl(s->fd,F_SETFL,0);
+	s->latency_was = 0;
+	s->async_set = 0;
+	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings
+	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
+
+	if (adm20_serial_config(serial_config, &(s->newtp))) {
+		fprintf(stderr,"%s:%d: Invalid serial port config '%s', expected eg 2400:8n1\r\n", FL, serial_config ? serial_config : "");
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+
+	if (tcsetattr(s->fd, TCSANOW, &(s->newtp))) {
+		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+
+	return s->fd;
+}
+
+/*
+ * The adapter's USB latency timer in sysfs, ttyUSB0 and the like,
+ * by-id names are links to them
+ *
+ */
+static int latency_timer_path(const struct serial_params_s *s, char *path, size_t size) {
+	char real[PATH_MAX];
+	const char *name;
+
+	if (!realpath(s->device, real)) return -1;
+	name = strrchr(real, '/');
+	name = name ? name +1 : real;
+	snprintf(path, size, "/sys/bus/usb-serial/devices/%s/latency_timer", name);
+
+	return 0;
+}
+
+static int latency_timer_write(const char *path, int ms) {
+	FILE *f = fopen(path, "w");
+	int bad;
+
+	if (!f) return -1;
+	bad = fprintf(f, "%d\n", ms) < 0;
+	if (fclose(f)) bad = 1;
+
+	return bad ? -1 : 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_serial_low_latency
+  Returns Type	: int
+  ----Parameter List
+  1. struct serial_params_s *s, open port
+  2. int flags, ADM20_LATENCY_*
+  ------------------
+  Exit Codes	: the flags that took, what didn't and why is reported
+  Side Effects	: may write to the adapter's latency_timer in sysfs
+  --------------------------------------------------------------------
+Comments:
+	Everything here is best effort, a pty or a non-FTDI adapter
+	has no latency timer and plenty of drivers ignore the flag.
+	Whatever we change is noted in s and put back by
+	adm20_close_port(), the timer belongs to the adapter and
+	would otherwise stay at 1 ms for whoever uses it next.
+
+\------------------------------------------------------------------*/
+int adm20_serial_low_latency(struct serial_params_s *s, int flags) {
+	char path[PATH_MAX];
+	int done = 0, was = -1;
+	FILE *f;
+
+	s->low_latency = flags;
+
+	if (flags & ADM20_LATENCY_WHOLE_FRAMES) {
+		/*
+		 * A frame or, once bytes have started, a 100 ms gap
+		 * in them, whichever comes first.  The meter sends a
+		 * frame back to back and then goes quiet, so the gap
+		 * only ever ends a truncated frame.
+		 *
+		 */
+		s->newtp.c_cc[VMIN] = ADM20_FRAME_SIZE;
+		s->newtp.c_cc[VTIME] = 1;
+		if (tcsetattr(s->fd, TCSANOW, &s->newtp) == 0) done |= ADM20_LATENCY_WHOLE_FRAMES;
+		fprintf(stderr,"%s: VMIN %d VTIME %d %s\r\n", s->device, ADM20_FRAME_SIZE, 1, done & ADM20_LATENCY_WHOLE_FRAMES ? "set" : strerror(errno));
+	}
+
+	if (!(flags & ADM20_LATENCY_DRIVER)) return done;
+
+#ifdef ASYNC_LOW_LATENCY
+	{
+		struct serial_struct ss;
+
+		if (ioctl(s->fd, TIOCGSERIAL, &ss) == 0) {
+			if (ss.flags & ASYNC_LOW_LATENCY) done |= ADM20_LATENCY_DRIVER;
+			else {
+				ss.flags |= ASYNC_LOW_LATENCY;
+				if (ioctl(s->fd, TIOCSSERIAL, &ss) == 0) {
+					done |= ADM20_LATENCY_DRIVER;
+					s->async_set = 1;
+				}
+			}
+		}
+		fprintf(stderr,"%s: ASYNC_LOW_LATENCY %s\r\n", s->device, done & ADM20_LATENCY_DRIVER ? "set" : strerror(errno));
+	}
+#endif
+
+	if (latency_timer_path(s, path, sizeof(path))) return done;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr,"%s: no USB latency timer (%s)\r\n", s->device, strerror(errno));
+		return done;
+	}
+	if (fscanf(f, "%d", &was) != 1) was = -1;
+	fclose(f);
+
+	if (was < 1) {
+		fprintf(stderr,"%s: USB latency timer unreadable in %s, left alone\r\n", s->device, path);
+		return done;
+	}
+
+	if (was > 1) {
+		if (latency_timer_write(path, 1)) {
+			fprintf(stderr,"%s: USB latency timer left at %d ms, can't change %s (%s)\r\n", s->device, was, path, strerror(errno));
+			return done;
+		}
+		s->latency_was = was;
+	}
+	fprintf(stderr,"%s: USB latency timer %d ms -> 1 ms\r\n", s->device, was);
+	done |= ADM20_LATENCY_DRIVER;
+
+	return done;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_close_port
+  Returns Type	: void
+  ----Parameter List
+  1. struct serial_params_s *s,
+  ------------------
+  Exit Codes	:
+  Side Effects	: closes s->fd
+  --------------------------------------------------------------------
+Comments:
+	Undoes adm20_serial_low_latency() and puts back the termios
+	we found in adm20_open_port().  Nothing to do if the port is
+	already gone, a replugged adapter comes up with its defaults.
+
+\------------------------------------------------------------------*/
+void adm20_close_port(struct serial_params_s *s) {
+	char path[PATH_MAX];
+
+	if (s->fd < 0) return;
+
+#ifdef ASYNC_LOW_LATENCY
+	if (s->async_set) {
+		struct serial_struct ss;
+
+		if (ioctl(s->fd, TIOCGSERIAL, &ss) == 0) {
+			ss.flags &= ~ASYNC_LOW_LATENCY;
+			ioctl(s->fd, TIOCSSERIAL, &ss);
+		}
+		s->async_set = 0;
+	}
+#endif
+
+	if (s->latency_was > 1 && latency_timer_path(s, path, sizeof(path)) == 0) {
+		if (latency_timer_write(path, s->latency_was)) {
+			fprintf(stderr,"%s: Can't put the USB latency timer back to %d ms (%s)\r\n", s->device, s->latency_was, strerror(errno));
+		}
+		s->latency_was = 0;
+	}
+
+	tcsetattr(s->fd, TCSANOW, &s->oldtp);
+	close(s->fd);
+	s->fd = -1;
+}
+
+/*
+ * Auto-detection
+ *
+ * Every candidate port is opened at once and they all try the same
+ * rate together, so the time taken depends on how many rates we have
+ * to go through, not how many ports there are.
+ *
+ */
+struct candidate {
+	char device[PATH_MAX];
+	char real[PATH_MAX];
+	int fd;
+	struct termios oldtp;
+	struct adm20_reader reader;
+};
+
+static int candidate_add(struct candidate *c, int count, const char *path) {
+	char real[PATH_MAX];
+	int i;
+
+	if (count >= ADM20_DETECT_PORTS || !realpath(path, real)) return count;
+	for (i = 0; i < count; i++) {
+		if (!strcmp(c[i].real, real)) return count; // by-id link to a port we already have
+	}
+
+	snprintf(c[count].device, sizeof(c[count].device), "%s", path);
+	snprintf(c[count].real, sizeof(c[count].real), "%s", real);
+	c[count].fd = -1;
+
+	return count +1;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_detect_port
+  Returns Type	: int
+  ----Parameter List
+  1. struct serial_params_s *s, filled in as adm20_open_port() would
+  2. const char *serial_config, tried first, its framing is kept
+     for the other rates, NULL for the default
+  3. struct adm20_reader *r, initialised on the winning port
+  4. int debug,
+  ------------------
+  Exit Codes	: the open fd, or -1 with the reason already reported
+  Side Effects	: s->device is allocated
+  --------------------------------------------------------------------
+Comments:
+	The first port to give us two good frames in a row at a rate
+	wins.  Its reader comes back with the second of those frames
+	still waiting, so the front end has a reading straight away
+	rather than waiting for the meter to send another.
+
+	The /dev/serial/by-id names go in first so that's what gets
+	reported, they don't change from one plug in to the next.
+
+\------------------------------------------------------------------*/
+int adm20_detect_port(struct serial_params_s *s, const char *serial_config, struct adm20_reader *r, int debug) {
+	static const char *patterns[] = { "/dev/serial/by-id/*", "/dev/ttyUSB*", "/dev/ttyACM*" };
+	struct candidate *c;
+	struct epoll_event ev, events[ADM20_DETECT_PORTS];
+	struct termios tp;
+	char config[32];
+	char bits = '8', parity = 'n', stop = '1';
+	int rate = 0, rates[sizeof(baud_rates) / sizeof(baud_rates[0]) +1];
+	int count = 0, nrates = 0, efd, i, j, n, winner = -1;
+	uint64_t t0 = adm20_monotonic_ns(), deadline;
+	size_t k;
+	glob_t gl;
+
+	if (!serial_config) serial_config = ADM20_DEFAULT_SERIAL_CONFIG;
+	if (sscanf(serial_config, "%d:%c%c%c", &rate, &bits, &parity, &stop) < 1) rate = 0;
+
+	/*
+	 * The configured rate first, then everything else we support
+	 *
+	 */
+	if (rate) rates[nrates++] = rate;
+	for (k = 0; k < sizeof(baud_rates) / sizeof(baud_rates[0]); k++) {
+		if (baud_rates[k].rate != rate) rates[nrates++] = baud_rates[k].rate;
+	}
+
+	c = (struct candidate *)calloc(ADM20_DETECT_PORTS, sizeof(struct candidate));
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (!c || efd < 0) {
+		fprintf(stderr,"%s:%d: Unable to start port detection (%s)\r\n", FL, strerror(errno));
+		free(c);
+		return -1;
+	}
+
+	for (k = 0; k < sizeof(patterns) / sizeof(patterns[0]); k++) {
+		if (glob(patterns[k], 0, NULL, &gl)) continue;
+		for (j = 0; j < (int)gl.gl_pathc; j++) count = candidate_add(c, count, gl.gl_pathv[j]);
+		globfree(&gl);
+	}
+
+	for (i = 0; i < count; i++) {
+		c[i].fd = open(c[i].device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+		if (c[i].fd < 0 || tcgetattr(c[i].fd, &c[i].oldtp)) {
+			if (debug) fprintf(stderr,"%s:%d: Skipping %s (%s)\r\n", FL, c[i].device, strerror(errno));
+			if (c[i].fd >= 0) close(c[i].fd);
+			c[i].fd = -1;
+			continue;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(efd, EPOLL_CTL_ADD, c[i].fd, &ev);
+	}
+
+	for (j = 0; j < nrates && winner < 0; j++) {
+		snprintf(config, sizeof(config), "%d:%c%c%c", rates[j], bits, parity, stop);
+		if (debug) fprintf(stderr,"%s:%d: Trying %d ports at %s\r\n", FL, count, config);
+
+		for (i = 0; i < count; i++) {
+			if (c[i].fd < 0) continue;
+			tp = c[i].oldtp;
+			if (adm20_serial_config(config, &tp)) continue;
+			tcsetattr(c[i].fd, TCSANOW, &tp);
+			tcflush(c[i].fd, TCIFLUSH);
+			adm20_reader_init(&c[i].reader, c[i].fd);
+		}
+
+		deadline = adm20_monotonic_ns() + ADM20_DETECT_WINDOW_MS * 1000000ULL;
+		while (winner < 0) {
+			uint64_t now = adm20_monotonic_ns();
+
+			if (now >= deadline) break;
+			n = epoll_wait(efd, events, ADM20_DETECT_PORTS, (int)((deadline - now) / 1000000) +1);
+			for (k = 0; n > 0 && k < (size_t)n && winner < 0; k++) {
+				struct candidate *p = &c[events[k].data.u32];
+				const uint8_t *frame;
+				ssize_t got;
+				int res;
+
+				got = adm20_reader_fill(&p->reader);
+				if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+					epoll_ctl(efd, EPOLL_CTL_DEL, p->fd, NULL);
+					continue;
+				}
+
+				while ((res = adm20_reader_next(&p->reader, &frame)) != ADM20_FRAME_MORE) {
+					if (res == ADM20_FRAME_REJECTED) {
+						p->reader.frames_ok = 0;
+						continue;
+					}
+					if (p->reader.frames_ok >= 2) {
+						/*
+						 * Step back over the frame we just took
+						 * so it's handed out again
+						 *
+						 */
+						p->reader.tail -= ADM20_FRAME_SIZE;
+						p->reader.frames_ok = 0;
+						winner = p - c;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	close(efd);
+
+	for (i = 0; i < count; i++) {
+		if (c[i].fd < 0 || i == winner) continue;
+		tcsetattr(c[i].fd, TCSANOW, &c[i].oldtp);
+		close(c[i].fd);
+	}
+
+	if (winner < 0) {
+		fprintf(stderr,"%s:%d: No meter found on any of %d serial ports, use -p <com port>\r\n", FL, count);
+		free(c);
+		return -1;
+	}
+
+	s->device = strdup(c[winner].device);
+	s->fd = c[winner].fd;
+	s->oldtp = c[winner].oldtp;
+	s->latency_was = 0;
+	s->async_set = 0;
+	tcgetattr(s->fd, &s->newtp);
+	fcntl(s->fd, F_SETFL, 0);
+	*r = c[winner].reader;
+	r->frames_rejected = r->bytes_discarded = r->resyncs = 0;
+
+	fprintf(stderr,"Found meter on %s at %s in %.0f ms\r\n", s->device, config, (adm20_monotonic_ns() - t0) / 1e6);
+	free(c);
+
+	return s->fd;
+}
+
+/*
+ * Reconnection
+ *
+ * Once a port has gone we watch the directory its name lives in for
+ * that name coming back (udev creates the node, then fixes up its
+ * permissions, and by-id links come and go with it), and open it
+ * again with the settings we already worked out.  The odd blind
+ * retry covers a directory that went away along with the device,
+ * as /dev/serial/by-id does when the last adapter is pulled.
+ *
+ */
+void adm20_reconnect_init(struct adm20_reconnect *w) {
+	memset(w, 0, sizeof(*w));
+	w->ifd = -1;
+	w->wd = -1;
+}
+
+static void reconnect_watch(struct adm20_reconnect *w, const char *device) {
+	char dir[PATH_MAX];
+	char *slash;
+
+	if (w->ifd < 0) w->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->ifd < 0 || w->wd >= 0) return;
+
+	snprintf(dir, sizeof(dir), "%s", device);
+	slash = strrchr(dir, '/');
+	if (!slash) snprintf(dir, sizeof(dir), ".");
+	else if (slash == dir) dir[1] = '\0';
+	else *slash = '\0';
+
+	w->wd = inotify_add_watch(w->ifd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_reconnect_lost
+  Returns Type	: void
+  ----Parameter List
+  1. struct adm20_reconnect *w,
+  2. struct serial_params_s *s, port that's just returned EOF or an error
+  3. ssize_t got, what the read() returned, errno is still from it
+  ------------------
+  Exit Codes	:
+  Side Effects	: closes s->fd
+  --------------------------------------------------------------------
+Comments:
+	Poll w->ifd and call adm20_reconnect_try() when it's readable or
+	adm20_reconnect_timeout() runs out, or just adm20_reconnect_wait().
+
+\------------------------------------------------------------------*/
+void adm20_reconnect_lost(struct adm20_reconnect *w, struct serial_params_s *s, ssize_t got) {
+	fprintf(stderr,"%s:%d: Lost %s (%s), waiting for it to come back\r\n", FL, s->device, got ? strerror(errno) : "end of file");
+
+	if (s->fd >= 0) close(s->fd);
+	s->fd = -1;
+
+	w->lost = adm20_monotonic_ns();
+	w->retry = w->lost + ADM20_RECONNECT_RETRY_MS * 1000000ULL;
+	w->drops++;
+	reconnect_watch(w, s->device);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_reconnect_try
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_reconnect *w,
+  2. struct serial_params_s *s,
+  ------------------
+  Exit Codes	: the reopened fd, or -1 if it's still not back
+  Side Effects	: never blocks
+  --------------------------------------------------------------------
+Comments:
+	Only opens the port when something happened to its name or the
+	retry time is up, so it's cheap to call on every pass of a loop.
+	The termios worked out by adm20_open_port() are put straight
+	back, and the settings from before we first opened it are kept
+	for when we finally close it.
+
+\------------------------------------------------------------------*/
+int adm20_reconnect_try(struct adm20_reconnect *w, struct serial_params_s *s) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name = strrchr(s->device, '/');
+	uint64_t now = adm20_monotonic_ns(), down;
+	int attempt = 0;
+	ssize_t len;
+
+	if (!w->lost) return s->fd;
+	name = name ? name +1 : s->device;
+
+	while (w->ifd >= 0 && (len = read(w->ifd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *e;
+		char *p;
+
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + e->len) {
+			e = (const struct inotify_event *)p;
+			if ((e->mask & IN_IGNORED) && e->wd == w->wd) w->wd = -1;
+			if (e->len && !strcmp(e->name, name)) attempt = 1;
+		}
+	}
+
+	if (now >= w->retry) {
+		attempt = 1;
+		w->retry = now + ADM20_RECONNECT_RETRY_MS * 1000000ULL;
+		reconnect_watch(w, s->device);
+	}
+	if (!attempt) return -1;
+
+	s->fd = open(s->device, O_RDWR | O_NOCTTY | O_NDELAY | O_CLOEXEC);
+	if (s->fd < 0) return -1;
+	if (tcsetattr(s->fd, TCSANOW, &s->newtp)) {
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+	fcntl(s->fd, F_SETFL, 0);
+	tcflush(s->fd, TCIFLUSH);
+	if (s->low_latency) adm20_serial_low_latency(s, s->low_latency); // a new adapter has the driver defaults
+
+	down = adm20_monotonic_ns() - w->lost;
+	if (down > w->down_max) w->down_max = down;
+	w->down_total += down;
+	w->lost = 0;
+	if (w->wd >= 0) inotify_rm_watch(w->ifd, w->wd);
+	w->wd = -1;
+
+	fprintf(stderr,"%s:%d: %s is back after %.0f ms\r\n", FL, s->device, down / 1e6);
+
+	return s->fd;
+}
+
+/*
+ * How long until adm20_reconnect_try() wants calling again even if
+ * w->ifd stays quiet, -1 while we're connected
+ *
+ */
+int adm20_reconnect_timeout(const struct adm20_reconnect *w) {
+	uint64_t now;
+
+	if (!w->lost) return -1;
+	now = adm20_monotonic_ns();
+
+	return now >= w->retry ? 0 : (int)((w->retry - now + 999999) / 1000000);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_reconnect_wait
+  Returns Type	: int
+  ----Parameter List
+  1. struct adm20_reconnect *w,
+  2. struct serial_params_s *s,
+  3. int timeout_ms, -1 to wait until it's back
+  ------------------
+  Exit Codes	: the reopened fd, -1 on timeout or a signal
+  Side Effects	: blocks
+  --------------------------------------------------------------------
+Comments:
+	For loops that have nothing else to do while the port is away.
+
+\------------------------------------------------------------------*/
+int adm20_reconnect_wait(struct adm20_reconnect *w, struct serial_params_s *s, int timeout_ms) {
+	uint64_t deadline = timeout_ms >= 0 ? adm20_monotonic_ns() + timeout_ms * 1000000ULL : 0;
+	struct pollfd pfd;
+	int t;
+
+	for (;;) {
+		if (adm20_reconnect_try(w, s) >= 0) return s->fd;
+
+		t = adm20_reconnect_timeout(w);
+		if (deadline) {
+			uint64_t now = adm20_monotonic_ns();
+			int left = now >= deadline ? 0 : (int)((deadline - now + 999999) / 1000000);
+
+			if (!left) return -1;
+			if (t < 0 || left < t) t = left;
+		}
+
+		pfd.fd = w->ifd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, t) < 0 && errno == EINTR) return -1;
+	}
+}
+
+void adm20_reconnect_close(struct adm20_reconnect *w) {
+	if (w->ifd >= 0) close(w->ifd);
+	w->ifd = -1;
+	w->wd = -1;
+}
@@ -0,0 +1,87 @@
+/*
+ * BSIDE-ADM20 serial port handling
+ *
+ * Default parameters are 2400:8n1, given that the multimeter
+ * is shipped like this and cannot be changed then we shouldn't
+ * have to worry about needing to make changes.
+ *
+ * 20210804: Duratool D03122 is configured as 9600:8n1, so we now
+ * have to add the adjustable serial config facility
+ *
+ */
+#ifndef ADM20_SERIAL_H
+#define ADM20_SERIAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#define ADM20_DEFAULT_SERIAL_CONFIG "2400:8n1"
+
+/*
+ * Auto-detection listens at each rate for long enough to see a
+ * couple of frames from a meter that's there, and looks at no more
+ * than ADM20_DETECT_PORTS ports.
+ *
+ */
+#define ADM20_DETECT_WINDOW_MS 1000
+#define ADM20_DETECT_PORTS 64
+
+/*
+ * A port that's gone (USB adapter pulled) is reopened as soon as its
+ * name turns up again, and tried blind every ADM20_RECONNECT_RETRY_MS
+ * in case we can't see it being created.
+ *
+ */
+#define ADM20_RECONNECT_RETRY_MS 250
+
+struct adm20_reader;
+
+/*
+ * adm20_serial_low_latency() flags
+ *
+ * DRIVER asks the UART driver not to sit on received bytes, by
+ * ASYNC_LOW_LATENCY and, on FTDI style adapters, a 1 ms USB latency
+ * timer.  WHOLE_FRAMES sets VMIN/VTIME so a blocking read() comes
+ * back with a whole frame rather than a byte at a time; only worth
+ * having where the read() is on a thread of its own, a poll() loop
+ * still wakes for every byte and would then block for the rest.
+ *
+ */
+#define ADM20_LATENCY_DRIVER 0x01
+#define ADM20_LATENCY_WHOLE_FRAMES 0x02
+
+struct serial_params_s {
+	char *device;
+	int fd, n;
+	int cnt, size, s_cnt;
+	struct termios oldtp, newtp;
+	int low_latency;      // ADM20_LATENCY_* put back each time the port is reopened
+	int latency_was;      // USB latency timer ms before we set it to 1, 0 if we left it alone
+	int async_set;        // we turned ASYNC_LOW_LATENCY on, so it comes off again on close
+};
+
+struct adm20_reconnect {
+	int ifd;              // inotify fd to poll while the port is away, -1 until first needed
+	int wd;               // watch on the port's directory, -1 if it's not there
+	uint64_t lost;        // CLOCK_MONOTONIC ns the port went, 0 while it's connected
+	uint64_t retry;       // when to try opening it anyway
+	uint32_t drops;       // times the port has gone
+	uint64_t down_total;  // ns spent waiting for it to come back
+	uint64_t down_max;
+};
+
+int adm20_serial_config(const char *serial_config, struct termios *tp);
+int adm20_open_port(struct serial_params_s *s, const char *serial_config);
+int adm20_serial_low_latency(struct serial_params_s *s, int flags);
+void adm20_close_port(struct serial_params_s *s);
+int adm20_detect_port(struct serial_params_s *s, const char *serial_config, struct adm20_reader *r, int debug);
+
+void adm20_reconnect_init(struct adm20_reconnect *w);
+void adm20_reconnect_lost(struct adm20_reconnect *w, struct serial_params_s *s, ssize_t got);
+int adm20_reconnect_try(struct adm20_reconnect *w, struct serial_params_s *s);
+int adm20_reconnect_timeout(const struct adm20_reconnect *w);
+int adm20_reconnect_wait(struct adm20_reconnect *w, struct serial_params_s *s, int timeout_ms);
+void adm20_reconnect_close(struct adm20_reconnect *w);
+
+#endif
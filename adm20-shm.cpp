@@ -0,0 +1,293 @@
+/*
+ * BSIDE-ADM20 shared memory publication
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adm20-frame.h"
+#include "adm20-shm.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * The writer pid of an existing segment if that process is still
+ * running, 0 if it's gone or the segment isn't one of ours.  Read
+ * with pread() so a short or foreign segment can't SIGBUS us.
+ *
+ */
+static pid_t shm_writer_alive(int fd) {
+	uint32_t magic;
+	pid_t writer;
+
+	if (pread(fd, &magic, sizeof(magic), offsetof(struct adm20_shm, magic)) != sizeof(magic)) return 0;
+	if (magic != ADM20_SHM_MAGIC) return 0;
+	if (pread(fd, &writer, sizeof(writer), offsetof(struct adm20_shm, writer)) != sizeof(writer)) return 0;
+	if (writer <= 0 || writer == getpid()) return 0;
+
+	if (kill(writer, 0) == 0 || errno == EPERM) return writer;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_shm_create
+  Returns Type	: struct adm20_shm *
+  ----Parameter List
+  1. const char *name, eg "/bside-adm20"
+  ------------------
+  Exit Codes	: the mapped segment, NULL with the reason already reported
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	An existing segment of the same name is only taken over, and
+	reset, if the writer that made it has gone; a second front end
+	pointed at the same name is refused rather than have two
+	writers trample each other's seqlocks.  Readers still attached
+	to a taken over segment see count go back to zero.
+
+\------------------------------------------------------------------*/
+struct adm20_shm *adm20_shm_create(const char *name) {
+	struct adm20_shm *s;
+	pid_t writer;
+	void *p;
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		fd = shm_open(name, O_RDWR | O_CLOEXEC, 0644);
+		if (fd >= 0 && (writer = shm_writer_alive(fd))) {
+			fprintf(stderr,"%s:%d: Shared memory '%s' is already being written by pid %d\r\n", FL, name, (int)writer);
+			close(fd);
+			return NULL;
+		}
+	}
+	if (fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create shared memory '%s' (%s)\r\n", FL, name, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, sizeof(struct adm20_shm))) {
+		fprintf(stderr,"%s:%d: Unable to size shared memory '%s' (%s)\r\n", FL, name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, sizeof(struct adm20_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr,"%s:%d: Unable to map shared memory '%s' (%s)\r\n", FL, name, strerror(errno));
+		return NULL;
+	}
+
+	s = (struct adm20_shm *)p;
+	__atomic_store_n(&s->magic, 0, __ATOMIC_RELEASE);
+	memset(p, 0, sizeof(struct adm20_shm));
+	s->version = ADM20_SHM_VERSION;
+	s->size = sizeof(struct adm20_shm);
+	s->history = ADM20_SHM_HISTORY;
+	s->writer = getpid();
+	__atomic_store_n(&s->magic, ADM20_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return s;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_shm_attach
+  Returns Type	: struct adm20_shm *
+  ----Parameter List
+  1. const char *name,
+  ------------------
+  Exit Codes	: the segment mapped read-only, NULL with the reason already reported
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+struct adm20_shm *adm20_shm_attach(const char *name) {
+	struct adm20_shm *s;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to open shared memory '%s' (%s)\r\n", FL, name, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct adm20_shm)) {
+		fprintf(stderr,"%s:%d: '%s' is not an ADM20 segment\r\n", FL, name);
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, sizeof(struct adm20_shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr,"%s:%d: Unable to map shared memory '%s' (%s)\r\n", FL, name, strerror(errno));
+		return NULL;
+	}
+
+	s = (struct adm20_shm *)p;
+	if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != ADM20_SHM_MAGIC
+			|| s->version != ADM20_SHM_VERSION
+			|| s->size != sizeof(struct adm20_shm)
+			|| s->history != ADM20_SHM_HISTORY) {
+		fprintf(stderr,"%s:%d: '%s' is not an ADM20 segment, or is from a different version\r\n", FL, name);
+		munmap(p, sizeof(struct adm20_shm));
+		return NULL;
+	}
+
+	return s;
+}
+
+void adm20_shm_detach(struct adm20_shm *s) {
+	if (s) munmap((void *)s, sizeof(struct adm20_shm));
+}
+
+int adm20_shm_unlink(const char *name) {
+	return shm_unlink(name);
+}
+
+static void slot_write(struct adm20_shm_slot *slot, const struct adm20_shm_reading *v) {
+	uint32_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq +1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->value = *v;
+	__atomic_store_n(&slot->seq, seq +2, __ATOMIC_RELEASE);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/*
+ * A write is a copy of about a cache line's worth of fields, so a
+ * clash normally clears within a few pauses.  If it doesn't, the
+ * writer has most likely been preempted inside slot_write() (a busy
+ * or single CPU box), so we stop spinning and sleep to let it run.
+ * Only once ADM20_SHM_READ_SLEEPS naps have gone by is the writer
+ * checked on; while it's still alive we keep waiting, it's only
+ * given up on when it died with seq left odd.
+ *
+ */
+static int slot_read(const struct adm20_shm *s, const struct adm20_shm_slot *slot, struct adm20_shm_reading *v) {
+	struct timespec nap = { 0, ADM20_SHM_READ_NAP_US *1000 };
+	uint32_t seq;
+	int tries = 0;
+
+	for (;;) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1)) {
+			*v = slot->value;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) return 0;
+		}
+
+		if (++tries <= ADM20_SHM_READ_SPINS) {
+			cpu_relax();
+		} else if (tries <= ADM20_SHM_READ_SPINS + ADM20_SHM_READ_SLEEPS) {
+			nanosleep(&nap, NULL);
+		} else {
+			if (s->writer > 0 && kill(s->writer, 0) && errno == ESRCH) return -1;
+			tries = ADM20_SHM_READ_SPINS;
+		}
+	}
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_shm_publish
+  Returns Type	: void
+  ----Parameter List
+  1. struct adm20_shm *s,
+  2. const struct adm20_reading *r,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	History slot first, then latest, then the count, so a reader
+	that sees the new count will find the reading in both places.
+
+\------------------------------------------------------------------*/
+void adm20_shm_publish(struct adm20_shm *s, const struct adm20_reading *r) {
+	struct adm20_shm_reading v;
+
+	v.n = s->count;
+	v.published = adm20_monotonic_ns();
+	v.reading = *r;
+
+	slot_write(&s->ring[v.n & ADM20_SHM_HISTORY_MASK], &v);
+	slot_write(&s->latest, &v);
+	__atomic_store_n(&s->count, v.n +1, __ATOMIC_RELEASE);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_shm_latest
+  Returns Type	: int
+  ----Parameter List
+  1. const struct adm20_shm *s,
+  2. struct adm20_shm_reading *out,
+  ------------------
+  Exit Codes	: 1 with the newest reading in out, 0 if nothing's been
+  		  published, -1 if the writer died mid-write
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Check out->n to see whether it's changed since last time.
+
+\------------------------------------------------------------------*/
+int adm20_shm_latest(const struct adm20_shm *s, struct adm20_shm_reading *out) {
+	if (!__atomic_load_n(&s->count, __ATOMIC_ACQUIRE)) return 0;
+
+	if (slot_read(s, &s->latest, out)) return -1;
+
+	return 1;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: adm20_shm_history
+  Returns Type	: ssize_t
+  ----Parameter List
+  1. const struct adm20_shm *s,
+  2. struct adm20_shm_reading *out,
+  3. size_t max, no more than ADM20_SHM_HISTORY are kept
+  ------------------
+  Exit Codes	: readings copied, oldest first, -1 if the writer died mid-write
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	A slot the writer has already lapped while we were copying is
+	left out rather than handed back out of order.
+
+\------------------------------------------------------------------*/
+ssize_t adm20_shm_history(const struct adm20_shm *s, struct adm20_shm_reading *out, size_t max) {
+	uint64_t count = __atomic_load_n(&s->count, __ATOMIC_ACQUIRE);
+	uint64_t n;
+	size_t got = 0;
+
+	if (max > ADM20_SHM_HISTORY) max = ADM20_SHM_HISTORY;
+	n = count > max ? count - max : 0;
+
+	for (; n < count; n++) {
+		if (slot_read(s, &s->ring[n & ADM20_SHM_HISTORY_MASK], &out[got])) return -1;
+		if (out[got].n == n) got++;
+	}
+
+	return got;
+}
@@ -0,0 +1,78 @@
+/*
+ * BSIDE-ADM20 shared memory publication
+ *
+ * The front end writes every reading in to a POSIX shared memory
+ * segment (-m <name>), the latest one plus a ring of the last
+ * ADM20_SHM_HISTORY, each slot guarded by a seqlock.  Any number of
+ * local readers can map it read-only and pick readings up with no
+ * syscalls and without ever blocking the writer; a reader only
+ * retries if it raced a write to the very slot it was copying, and
+ * gives up with an error only if the writer died half way through.
+ *
+ * There is exactly one writer per segment.
+ *
+ */
+#ifndef ADM20_SHM_H
+#define ADM20_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "adm20-decode.h"
+
+#define ADM20_SHM_NAME_DEFAULT "/bside-adm20"
+#define ADM20_SHM_MAGIC 0x32304d41  // "AM02" little-endian, set last by the writer
+#define ADM20_SHM_VERSION 1
+
+/*
+ * Must be a power of two, slots are picked by masking the
+ * publication number.
+ *
+ */
+#define ADM20_SHM_HISTORY 64
+#define ADM20_SHM_HISTORY_MASK (ADM20_SHM_HISTORY -1)
+
+/*
+ * A reader that keeps finding a slot mid-write spins briefly, then
+ * naps, and only gives up if the writer turns out to be dead.
+ *
+ */
+#define ADM20_SHM_READ_SPINS 1000    // pause()s before napping
+#define ADM20_SHM_READ_NAP_US 100    // each nap
+#define ADM20_SHM_READ_SLEEPS 1000   // naps between checks that the writer is alive
+
+struct adm20_shm_reading {
+	uint64_t n;                   // publication number, from 0
+	uint64_t published;           // CLOCK_MONOTONIC ns it was published
+	struct adm20_reading reading;
+};
+
+struct adm20_shm_slot {
+	uint32_t seq;                 // odd while the writer is in the slot
+	uint32_t reserved;
+	struct adm20_shm_reading value;
+} __attribute__((aligned(64)));
+
+struct adm20_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;                // sizeof(struct adm20_shm)
+	uint32_t history;             // ADM20_SHM_HISTORY
+	pid_t writer;
+	uint64_t count __attribute__((aligned(64)));  // readings published so far
+	struct adm20_shm_slot latest;
+	struct adm20_shm_slot ring[ADM20_SHM_HISTORY];
+};
+
+struct adm20_shm *adm20_shm_create(const char *name);
+struct adm20_shm *adm20_shm_attach(const char *name);
+void adm20_shm_detach(struct adm20_shm *s);
+int adm20_shm_unlink(const char *name);
+
+void adm20_shm_publish(struct adm20_shm *s, const struct adm20_reading *r);
+
+int adm20_shm_latest(const struct adm20_shm *s, struct adm20_shm_reading *out);
+ssize_t adm20_shm_history(const struct adm20_shm *s, struct adm20_shm_reading *out, size_t max);
+
+#endif
@@ -0,0 +1,625 @@
+/*
+ * BSIDE-ADM20 meter simulator
+ *
+ * Opens a pseudo-terminal pair and writes ADM20 frames to the
+ * master side, so any of the front ends can be pointed at the
+ * slave with -p and run without a meter attached.  Frame rate and
+ * baud pacing are adjustable (well beyond what the meter can do),
+ * and noise, truncated frames, unit/range changes and segment
+ * patterns we have no glyph for can be injected to exercise the
+ * frame parser and decoder.
+ *
+ * -L measures how long it takes from the last byte of a frame going
+ * out to that frame being decoded, first with the port as the front
+ * ends normally open it and then with the low latency settings, over
+ * the pty or a serial port with TX looped back to RX.
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+#include "adm20-serial.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * Should be defined in the Makefile to pass to the compiler from
+ * the github build revision
+ *
+ */
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+static const uint8_t segment_codes[10] = { 0x5F, 0x06, 0x6B, 0x2F, 0x36, 0x3D, 0x7D, 0x07, 0x7F, 0x3F };
+
+static_assert(adm20_segments.s[0x5F].value == 0 && adm20_segments.s[0x06].value == 1 && adm20_segments.s[0x3F].value == 9, "simulator segment codes");
+
+#define SEG_BLANK 0x00
+#define SEG_L 0x58
+
+/*
+ * Ranges we cycle through with -u, the flag bytes are the same
+ * bits adm20_decode() looks for.
+ *
+ */
+struct sim_range {
+	const char *name;
+	uint8_t d18, d19;
+	int8_t exponent;   // 0 to -3
+	int32_t centre;    // starting mantissa
+	int32_t swing;     // max change per frame
+	uint8_t overload;  // show OL instead of a value
+};
+
+static const struct sim_range ranges[] = {
+	{ "V",   0x00, 0x08,        -3, 3300, 3,  0 },
+	{ "mV",  0x00, 0x08 | 0x02, -1, 1234, 5,  0 },
+	{ "kOhm",0x00, 0x40 | 0x20, -2, 4700, 2,  0 },
+	{ "OL",  0x00, 0x40 | 0x10, -2, 0,    0,  1 },
+	{ "mA",  0x00, 0x04 | 0x02, -2, 1500, 10, 0 },
+	{ "kHz", 0x00, 0x80 | 0x20, -3, 1000, 1,  0 },
+	{ "nF",  0x80 | 0x40, 0x00, -1, 1000, 2,  0 },
+	{ "degC",0x01, 0x00,        -1, 253,  1,  0 },
+};
+
+#define RANGE_COUNT (int)(sizeof(ranges) / sizeof(ranges[0]))
+
+struct glb {
+	uint8_t debug;
+	uint8_t quiet;
+	char *link_path;
+	double rate;          // frames per second, 0 = as fast as the baud allows
+	int baud;             // byte pacing, 0 = write whole frames unpaced
+	int noise_pct;        // chance of a burst of noise before a frame
+	int truncate_pct;     // chance of a frame being cut short
+	int glyph_pct;        // chance of a digit showing a pattern the decoder doesn't know
+	int unit_change;      // change range every n frames, 0 = never
+	int wander_pct;       // chance the reading moves each frame, 0 = hold it steady
+	uint64_t count;       // stop after this many frames, 0 = forever
+	unsigned int seed;
+	uint64_t latency;     // frames to send in the latency test, 0 = no test
+	char *loopback;       // serial port with TX and RX joined, for the latency test
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int sig) {
+	(void)sig;
+	quit = 1;
+}
+
+int init(struct glb *g) {
+	g->debug = 0;
+	g->quiet = 0;
+	g->link_path = NULL;
+	g->rate = 3.0;
+	g->baud = 2400;
+	g->noise_pct = 0;
+	g->truncate_pct = 0;
+	g->glyph_pct = 0;
+	g->unit_change = 0;
+	g->wander_pct = 100;
+	g->count = 0;
+	g->seed = getpid();
+	g->latency = 0;
+	g->loopback = NULL;
+
+	return 0;
+}
+
+void show_help(void) {
+	fprintf(stdout,"BSIDE ADM20 meter simulator\r\n"
+			"By Paul L Daniels / pldaniels@gmail.com\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			" [-l <link>] [-r <rate>] [-b <baud>] [-n <%%>] [-t <%%>] [-g <%%>] [-u <frames>] [-w <%%>] [-c <count>] [-L <frames> [-p <port>]] [-d] [-q]\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-l <link>: Also make a symlink to the pty slave, eg: -l /tmp/adm20\r\n"
+			"\t-r <frames per second>: Frame rate, 0 for as fast as possible (default 3)\r\n"
+			"\t-b <baud>: Pace bytes as if sent at this baud rate, 0 for unpaced (default 2400)\r\n"
+			"\t-n <percent>: Chance of a burst of line noise before each frame\r\n"
+			"\t-t <percent>: Chance of each frame being truncated\r\n"
+			"\t-g <percent>: Chance of a digit showing a segment pattern with no known glyph\r\n"
+			"\t-u <frames>: Change unit/range every <frames> frames\r\n"
+			"\t-w <percent>: Chance the reading moves each frame, 0 holds it steady (default 100)\r\n"
+			"\t-c <count>: Stop after <count> frames\r\n"
+			"\t-S <seed>: Random seed, for repeatable runs\r\n"
+			"\t-L <frames>: Measure last byte to decode latency, normal then low latency port settings\r\n"
+			"\t-p <port>: With -L, use this serial port with TX looped back to RX rather than a pty\r\n"
+			"\t-d: debug enabled\r\n"
+			"\t-q: quiet output\r\n"
+			"\t-v: show version\r\n"
+			"\r\n"
+			"\texample: adm20-sim -l /tmp/adm20 -n 5 -t 5 -u 20 & bside-adm20 -p /tmp/adm20\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			);
+}
+
+int parse_parameters(struct glb *g, int argc, char **argv) {
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			/* parameter */
+			switch (argv[i][1]) {
+				case 'h':
+					show_help();
+					exit(0);
+					break;
+
+				case 'd': g->debug = 1; break;
+
+				case 'q': g->quiet = 1; break;
+
+				case 'v':
+					fprintf(stdout,"Build %d\r\n", BUILD_VER);
+					exit(0);
+					break;
+
+				case 'l':
+				case 'r':
+				case 'b':
+				case 'n':
+				case 't':
+				case 'g':
+				case 'u':
+				case 'w':
+				case 'c':
+				case 'S':
+				case 'L':
+				case 'p':
+					if (i +1 >= argc) {
+						fprintf(stderr,"Insufficient parameters; -%c requires a value\n", argv[i][1]);
+						exit(1);
+					}
+					switch (argv[i][1]) {
+						case 'l': g->link_path = argv[i +1]; break;
+						case 'r': g->rate = atof(argv[i +1]); break;
+						case 'b': g->baud = atoi(argv[i +1]); break;
+						case 'n': g->noise_pct = atoi(argv[i +1]); break;
+						case 't': g->truncate_pct = atoi(argv[i +1]); break;
+						case 'g': g->glyph_pct = atoi(argv[i +1]); break;
+						case 'u': g->unit_change = atoi(argv[i +1]); break;
+						case 'w': g->wander_pct = atoi(argv[i +1]); break;
+						case 'c': g->count = strtoull(argv[i +1], NULL, 10); break;
+						case 'S': g->seed = strtoul(argv[i +1], NULL, 10); break;
+						case 'L': g->latency = strtoull(argv[i +1], NULL, 10); break;
+						case 'p': g->loopback = argv[i +1]; break;
+					}
+					i++;
+					break;
+
+				default: break;
+			} // switch
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Build a frame from a mantissa and range, d[7] is the most
+ * significant digit.
+ *
+ */
+static void encode_frame(uint8_t *f, const struct sim_range *r, int32_t mantissa) {
+	int32_t m = mantissa < 0 ? -mantissa : mantissa;
+	int i;
+
+	memset(f, 0, ADM20_FRAME_SIZE);
+
+	if (r->overload) {
+		f[7] = SEG_BLANK;
+		f[6] = segment_codes[0];
+		f[5] = SEG_L;
+		f[4] = SEG_BLANK;
+	} else {
+		for (i = 4; i < 8; i++) {
+			f[i] = segment_codes[m % 10];
+			m /= 10;
+		}
+		if (mantissa < 0) f[8] |= 0x08;
+	}
+
+	switch (r->exponent) {
+		case -3: f[6] |= ADM20_SEGMENT_DP; break;
+		case -2: f[5] |= ADM20_SEGMENT_DP; break;
+		case -1: f[4] |= ADM20_SEGMENT_DP; break;
+	}
+
+	f[16] = 0x20; // AUTO
+	f[18] = r->d18;
+	f[19] = r->d19;
+	f[ADM20_FRAME_SIZE -1] = ADM20_FRAME_END;
+}
+
+/*
+ * Light up some pattern in one digit that the segment table has no
+ * glyph for, the way a meter message we've never seen would.  The
+ * frame should still be accepted and decode as a NaN reading.
+ * 0x55 is skipped, it'd end the frame early.
+ *
+ */
+static void unknown_glyph(uint8_t *f) {
+	int digit = 4 + random() % 4;
+	uint8_t s;
+
+	do {
+		s = random() & ADM20_SEGMENT_MASK;
+	} while (adm20_segment_valid(s) || s == ADM20_FRAME_END);
+
+	f[digit] = (f[digit] & ADM20_SEGMENT_DP) | s;
+}
+
+static void sleep_until(uint64_t t) {
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !quit);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: send_bytes
+  Returns Type	: int
+  ----Parameter List
+  1. struct glb *g,
+  2. int fd, pty master
+  3. const uint8_t *b,
+  4. int len,
+  5. uint64_t *t, CLOCK_MONOTONIC ns the next byte is due, advanced
+  ------------------
+  Exit Codes	: 0, or -1 if the pty went away
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	With a baud rate set each byte takes 10 bit times (8n1 plus
+	start bit), written in chunks of at least a millisecond so that
+	very high rates aren't limited by the sleep granularity.
+
+\------------------------------------------------------------------*/
+static int send_bytes(struct glb *g, int fd, const uint8_t *b, int len, uint64_t *t) {
+	int chunk = len;
+	uint64_t byte_time = 0;
+
+	if (g->baud > 0) {
+		byte_time = 10000000000ULL / g->baud;
+		chunk = 1 + 1000000ULL / byte_time;
+	}
+
+	while (len > 0 && !quit) {
+		int n = chunk < len ? chunk : len;
+		ssize_t w = write(fd, b, n);
+
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		b += w;
+		len -= w;
+		if (byte_time) {
+			*t += w *byte_time;
+			sleep_until(*t);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Latency test
+ *
+ * The reader side is a thread of its own doing exactly what the
+ * Linux front end does, blocking read()s in to an adm20_reader, and
+ * notes when each frame comes out decoded.  The sender notes when it
+ * wrote each frame's last byte.  Nothing is lost on a pty or a short
+ * loopback, so the nth frame decoded is the nth frame sent.
+ *
+ */
+struct latency_test {
+	int fd;
+	uint64_t count;
+	uint64_t *sent, *decoded;
+	uint64_t got;               // frames decoded so far
+	uint64_t reads;
+};
+
+static void *latency_reader(void *arg) {
+	struct latency_test *l = (struct latency_test *)arg;
+	struct adm20_reader reader;
+	struct adm20_reading reading;
+	const uint8_t *frame;
+
+	adm20_reader_init(&reader, l->fd);
+	while (__atomic_load_n(&l->got, __ATOMIC_RELAXED) < l->count) {
+		switch (adm20_reader_next(&reader, &frame)) {
+			case ADM20_FRAME_MORE:
+				l->reads++;
+				if (adm20_reader_fill(&reader) <= 0 && errno != EINTR) return NULL;
+				break;
+
+			case ADM20_FRAME_OK:
+				adm20_decode(frame, reader.fill_time, &reading);
+				l->decoded[l->got] = adm20_monotonic_ns();
+				__atomic_store_n(&l->got, l->got +1, __ATOMIC_RELEASE);
+				break;
+
+			default: break;
+		}
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: latency_run
+  Returns Type	: int
+  ----Parameter List
+  1. struct glb *g,
+  2. int low_latency, ADM20_LATENCY_* to apply to the reading side
+  ------------------
+  Exit Codes	: 0, -1 with the reason already reported
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+
+\------------------------------------------------------------------*/
+static int latency_run(struct glb *g, int low_latency) {
+	struct serial_params_s rx, tx;
+	struct latency_test l;
+	const struct sim_range *range = &ranges[0];
+	uint8_t f[ADM20_FRAME_SIZE];
+	uint64_t t, period, byte_time, deadline, i;
+	pthread_t reader;
+	int master = -1;
+
+	memset(&rx, 0, sizeof(rx));
+	memset(&tx, 0, sizeof(tx));
+	tx.fd = -1;
+
+	if (g->loopback) {
+		tx.device = rx.device = g->loopback;
+		if (adm20_open_port(&tx, NULL) < 0 || adm20_open_port(&rx, NULL) < 0) return -1;
+		tcflush(rx.fd, TCIOFLUSH);
+	} else {
+		master = posix_openpt(O_RDWR | O_NOCTTY);
+		if (master < 0 || grantpt(master) || unlockpt(master) || !(rx.device = ptsname(master))) {
+			fprintf(stderr,"%s:%d: Unable to create pseudo-terminal (%s)\r\n", FL, strerror(errno));
+			return -1;
+		}
+		if (adm20_open_port(&rx, NULL) < 0) return -1;
+	}
+	if (low_latency) adm20_serial_low_latency(&rx, low_latency);
+
+	memset(&l, 0, sizeof(l));
+	l.fd = rx.fd;
+	l.count = g->latency;
+	l.sent = (uint64_t *)calloc(l.count, sizeof(uint64_t));
+	l.decoded = (uint64_t *)calloc(l.count, sizeof(uint64_t));
+	if (!l.sent || !l.decoded) return -1;
+	pthread_create(&reader, NULL, latency_reader, &l);
+
+	period = g->rate > 0 ? (uint64_t)(1000000000.0 / g->rate) : 0;
+	byte_time = g->baud > 0 ? 10000000000ULL / g->baud : 0;
+	t = adm20_monotonic_ns() + 100000000ULL; // let the reader get in to its first read()
+	sleep_until(t);
+
+	for (i = 0; i < l.count && !quit; i++) {
+		uint64_t frame_start = t;
+		int k;
+
+		encode_frame(f, range, range->centre);
+		for (k = 0; k < ADM20_FRAME_SIZE; k++) {
+			if (k == ADM20_FRAME_SIZE -1) l.sent[i] = adm20_monotonic_ns();
+			if (write(master >= 0 ? master : tx.fd, &f[k], 1) != 1) break;
+			if (byte_time) {
+				t += byte_time;
+				sleep_until(t);
+			}
+		}
+
+		if (period) {
+			if (t < frame_start + period) t = frame_start + period;
+			sleep_until(t);
+		} else {
+			/*
+			 * Wait for it to come out the other end, so every
+			 * sample is a frame on its own rather than a queue
+			 *
+			 */
+			while (__atomic_load_n(&l.got, __ATOMIC_ACQUIRE) <= i && !quit) sched_yield();
+			t = adm20_monotonic_ns();
+		}
+	}
+
+	deadline = adm20_monotonic_ns() + 1000000000ULL;
+	while (__atomic_load_n(&l.got, __ATOMIC_ACQUIRE) < i && adm20_monotonic_ns() < deadline) sleep_until(adm20_monotonic_ns() + 1000000);
+	if (__atomic_load_n(&l.got, __ATOMIC_ACQUIRE) < l.count) pthread_cancel(reader);
+	pthread_join(reader, NULL);
+
+	if (l.got) {
+		for (i = 0; i < l.got; i++) l.sent[i] = l.decoded[i] - l.sent[i];
+		qsort(l.sent, l.got, sizeof(uint64_t), cmp_u64);
+		fprintf(stdout,"%-12s %llu frames, last byte to decode: min %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms, %.1f reads per frame\r\n"
+				, low_latency ? "low latency" : "normal"
+				, (unsigned long long)l.got
+				, l.sent[0] / 1e6
+				, l.sent[l.got /2] / 1e6
+				, l.sent[l.got *99 /100] / 1e6
+				, l.sent[l.got -1] / 1e6
+				, (double)l.reads / l.got
+				);
+	}
+	if (l.got < l.count) fprintf(stderr,"%s:%d: Only %llu of %llu frames came back\r\n", FL, (unsigned long long)l.got, (unsigned long long)l.count);
+
+	free(l.sent);
+	free(l.decoded);
+	adm20_close_port(&rx);
+	adm20_close_port(&tx); // last, on a loopback it has the settings from before rx
+	if (master >= 0) close(master);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct glb g;
+	struct termios tp;
+	const struct sim_range *range;
+	uint8_t f[ADM20_FRAME_SIZE];
+	uint64_t frames = 0, noise_bursts = 0, truncated = 0, glyphs = 0;
+	uint64_t t, period;
+	int32_t mantissa;
+	int range_index = 0;
+	int master, slave;
+	char *slave_name;
+
+	init(&g);
+	parse_parameters(&g, argc, argv);
+	srandom(g.seed);
+
+	if (g.latency) {
+		signal(SIGINT, handle_signal);
+		signal(SIGTERM, handle_signal);
+		if (latency_run(&g, 0)) exit(1);
+		if (!quit && latency_run(&g, ADM20_LATENCY_DRIVER | ADM20_LATENCY_WHOLE_FRAMES)) exit(1);
+		return 0;
+	}
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master) || !(slave_name = ptsname(master))) {
+		fprintf(stderr,"%s:%d: Unable to create pseudo-terminal (%s)\r\n", FL, strerror(errno));
+		exit(1);
+	}
+
+	/*
+	 * Hold the slave open ourselves so the pty survives front ends
+	 * coming and going, and put it in raw mode straight away so no
+	 * line discipline processing mangles frames sent before the
+	 * front end gets to configure it.
+	 *
+	 */
+	slave = open(slave_name, O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &tp)) {
+		fprintf(stderr,"%s:%d: Unable to open '%s' (%s)\r\n", FL, slave_name, strerror(errno));
+		exit(1);
+	}
+	cfmakeraw(&tp);
+	tcsetattr(slave, TCSANOW, &tp);
+
+	if (g.link_path) {
+		unlink(g.link_path);
+		if (symlink(slave_name, g.link_path)) {
+			fprintf(stderr,"%s:%d: Unable to link '%s' to '%s' (%s)\r\n", FL, g.link_path, slave_name, strerror(errno));
+			exit(1);
+		}
+	}
+
+	fprintf(stdout,"%s\n", g.link_path ? g.link_path : slave_name);
+	fflush(stdout);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	range = &ranges[range_index];
+	mantissa = range->centre;
+	period = g.rate > 0 ? (uint64_t)(1000000000.0 / g.rate) : 0;
+	t = adm20_monotonic_ns();
+
+	while (!quit && (!g.count || frames < g.count)) {
+		uint64_t frame_start = t;
+		int len = ADM20_FRAME_SIZE;
+
+		if (g.unit_change && frames && (frames % g.unit_change) == 0) {
+			range_index = (range_index +1) % RANGE_COUNT;
+			range = &ranges[range_index];
+			mantissa = range->centre;
+			if (g.debug) fprintf(stderr,"Range now %s\r\n", range->name);
+		}
+
+		if (range->swing && (g.wander_pct >= 100 || (random() % 100) < g.wander_pct)) {
+			mantissa += (random() % (2 *range->swing +1)) - range->swing;
+			if (mantissa > 9999) mantissa = 9999;
+			if (mantissa < -9999) mantissa = -9999;
+		}
+		encode_frame(f, range, mantissa);
+
+		if (g.glyph_pct && (random() % 100) < g.glyph_pct) {
+			unknown_glyph(f);
+			glyphs++;
+		}
+
+		if (g.noise_pct && (random() % 100) < g.noise_pct) {
+			uint8_t noise[ADM20_FRAME_SIZE *2];
+			int n = 1 + random() % sizeof(noise);
+
+			for (int i = 0; i < n; i++) noise[i] = random();
+			if (send_bytes(&g, master, noise, n, &t)) break;
+			noise_bursts++;
+		}
+
+		if (g.truncate_pct && (random() % 100) < g.truncate_pct) {
+			len = 1 + random() % (ADM20_FRAME_SIZE -1);
+			f[len -1] = ADM20_FRAME_END;
+			truncated++;
+		}
+
+		if (send_bytes(&g, master, f, len, &t)) break;
+		frames++;
+
+		if (g.debug) {
+			fprintf(stderr,"%llu: ", (unsigned long long)frames);
+			for (int i = 0; i < len; i++) fprintf(stderr,"%02x ", f[i]);
+			fprintf(stderr,"\r\n");
+		}
+
+		if (period) {
+			if (t < frame_start + period) t = frame_start + period;
+			sleep_until(t);
+		} else if (!g.baud) {
+			t = adm20_monotonic_ns();
+		}
+	}
+
+	if (!g.quiet) {
+		fprintf(stderr,"%llu frames sent, %llu noise bursts, %llu truncated, %llu unknown glyphs\r\n"
+				, (unsigned long long)frames
+				, (unsigned long long)noise_bursts
+				, (unsigned long long)truncated
+				, (unsigned long long)glyphs
+				);
+	}
+
+	if (g.link_path) unlink(g.link_path);
+	close(slave);
+	close(master);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * BSIDE-ADM20 steady state allocation test
+ *
+ * libadm20 promises no heap allocation once a front end is up and
+ * running.  This replaces malloc(), calloc() and realloc() with
+ * counting wrappers around glibc's own, replays a million frames
+ * through adm20_reader_feed()/adm20_reader_next(), adm20_decode()
+ * and adm20_reading_format() the way the front ends do, recording
+ * every candidate to a capture file as -c would, and fails if
+ * anything allocated after the warm-up frames.
+ *
+ * The replay mixes in line noise and truncated frames so the
+ * reject and resync paths are covered as well as the happy one,
+ * and feeds the bytes in uneven chunks so frames wrap the ring.
+ *
+ * Nothing is printed until the replay is done, stdio allocates
+ * its buffers on first use.
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+#include "adm20-capture.h"
+
+#define FL __FILE__,__LINE__
+
+#define SSIZE 1024
+
+#define DEFAULT_FRAMES 1000000
+#define WARMUP_FRAMES 1000
+#define STREAM_FRAMES 4096   // distinct frames, replayed round and round
+
+extern "C" {
+	extern void *__libc_malloc(size_t size);
+	extern void *__libc_calloc(size_t nmemb, size_t size);
+	extern void *__libc_realloc(void *ptr, size_t size);
+
+	static volatile uint64_t allocations;
+
+	void *malloc(size_t size) {
+		allocations++;
+		return __libc_malloc(size);
+	}
+
+	void *calloc(size_t nmemb, size_t size) {
+		allocations++;
+		return __libc_calloc(nmemb, size);
+	}
+
+	void *realloc(void *ptr, size_t size) {
+		allocations++;
+		return __libc_realloc(ptr, size);
+	}
+}
+
+static uint8_t stream[STREAM_FRAMES *(ADM20_FRAME_SIZE +8)];
+
+/*
+ * Real digits and annunciators, with every 50th frame followed by
+ * a few bytes of noise and every 97th cut short.  No byte but the
+ * terminator is ever 0x55, or it'd split the frame.
+ *
+ */
+static size_t make_stream(void) {
+	static const uint8_t codes[] = { 0x5F, 0x06, 0x6B, 0x2F, 0x36, 0x3D, 0x7D, 0x07, 0x7F, 0x3F, 0x00, 0x79, 0x58, 0x20 };
+	uint8_t d[ADM20_FRAME_SIZE];
+	size_t len = 0;
+	int i, j;
+
+	for (i = 0; i < STREAM_FRAMES; i++) {
+		memset(d, 0, sizeof(d));
+		for (j = 4; j < 8; j++) d[j] = codes[rand() % sizeof(codes)];
+		if (rand() & 1) d[4 + rand() % 3] |= ADM20_SEGMENT_DP;
+		if (rand() & 1) d[8] |= 0x08;
+		d[16] = rand() & 0xA0;
+		d[17] = rand() & 0x68;
+		if (rand() & 1) d[18] = 1 << (rand() % 8);
+		else d[19] = 1 << (rand() % 8);
+		d[ADM20_FRAME_SIZE -1] = ADM20_FRAME_END;
+
+		if (i % 97 == 0) {
+			memcpy(stream + len, d + 10, ADM20_FRAME_SIZE -10);
+			len += ADM20_FRAME_SIZE -10;
+			continue;
+		}
+		memcpy(stream + len, d, ADM20_FRAME_SIZE);
+		len += ADM20_FRAME_SIZE;
+
+		if (i % 50 == 0) {
+			for (j = 0; j < 5; j++) stream[len++] = 0xAA ^ j;
+		}
+	}
+
+	return len;
+}
+
+int main(int argc, char **argv) {
+	static struct adm20_capture capture;
+	char capture_path[] = "/tmp/adm20-test-alloc-XXXXXX";
+	struct adm20_reader reader;
+	struct adm20_reading r;
+	const uint8_t *frame;
+	char line[SSIZE];
+	uint64_t target = DEFAULT_FRAMES, seen = 0, checksum = 0, warm = 0, ts = 0;
+	size_t len, at = 0, chunk, n;
+	int warmed = 0, fd;
+
+	if (argc > 1) target = strtoull(argv[1], NULL, 10);
+	if (target <= WARMUP_FRAMES) target = WARMUP_FRAMES +1;
+
+	srand(1);
+	len = make_stream();
+	adm20_reader_init(&reader, -1);
+
+	fd = mkstemp(capture_path);
+	if (fd < 0 || adm20_capture_open(&capture, capture_path, ADM20_CAPTURE_SYNC_DEFAULT)) {
+		fprintf(stderr,"%s:%d: Unable to set up the capture file\r\n", FL);
+		return 1;
+	}
+	close(fd);
+
+	while (seen < target) {
+		/*
+		 * 1 to 64 bytes at a time, about what a read() off a
+		 * 2400 baud port hands back
+		 *
+		 */
+		chunk = 1 + (at *7 + seen) % 64;
+		if (chunk > len - at) chunk = len - at;
+		n = adm20_reader_feed(&reader, stream + at, chunk, ts += 1000);
+		at += n;
+		if (at == len) at = 0;
+
+		for (;;) {
+			int rc = adm20_reader_next(&reader, &frame);
+
+			if (rc == ADM20_FRAME_MORE) break;
+			seen++;
+			if (rc != ADM20_FRAME_OK) {
+				adm20_capture_write(&capture, ts, ADM20_CAPTURE_REJECTED, frame, frame ? ADM20_FRAME_SIZE : 0);
+				continue;
+			}
+			adm20_capture_write(&capture, ts, ADM20_CAPTURE_OK, frame, ADM20_FRAME_SIZE);
+
+			adm20_decode(frame, ts, &r);
+			checksum += adm20_reading_format(&r, line, sizeof(line), (seen & 1) ? ADM20_FORMAT_DISPLAY : ADM20_FORMAT_LOG);
+			checksum += r.mantissa + line[0];
+
+			if (!warmed && seen >= WARMUP_FRAMES) {
+				warm = allocations;
+				warmed = 1;
+			}
+		}
+	}
+	warm = allocations - warm;
+
+	adm20_capture_close(&capture);
+	unlink(capture_path);
+
+	fprintf(stdout,"%llu frames ( %llu ok, %llu rejected, %llu resyncs, %llu bytes discarded ), checksum %llu\r\n"
+			, (unsigned long long)seen
+			, (unsigned long long)reader.frames_ok
+			, (unsigned long long)reader.frames_rejected
+			, (unsigned long long)reader.resyncs
+			, (unsigned long long)reader.bytes_discarded
+			, (unsigned long long)checksum
+			);
+
+	if (!reader.frames_rejected || !reader.bytes_discarded) {
+		fprintf(stderr,"%s:%d: The replay never hit the reject or noise paths\r\n", FL);
+		return 1;
+	}
+
+	if (warm) {
+		fprintf(stderr,"%s:%d: %llu allocations after the first %d frames\r\n", FL, (unsigned long long)warm, WARMUP_FRAMES);
+		return 1;
+	}
+
+	fprintf(stdout,"No allocations after the first %d frames\r\n", WARMUP_FRAMES);
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * BSIDE-ADM20 capture extractor test
+ *
+ * Writes a small capture holding a plain reading, an OL, a row of
+ * dashes and a digit with a segment pattern we have no glyph for,
+ * runs adm20-extract over it and checks the value column: the
+ * number for the first, empty for the rest.  A non-numeric reading
+ * written as 0 would plot as real data.
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+#include "adm20-capture.h"
+
+#define FL __FILE__,__LINE__
+
+#define SSIZE 1024
+
+#define SEG_BLANK 0x00
+#define SEG_DASH 0x20
+#define SEG_L 0x58
+#define SEG_UNKNOWN 0x01  // a lone segment, no glyph in the table
+
+static_assert(!adm20_segments.s[SEG_UNKNOWN].glyph, "test pattern must be unknown");
+
+static const struct {
+	const char *name;
+	uint8_t d[4];         // d[7], d[6], d[5], d[4]
+	const char *value;    // expected value column, "" for none
+} cases[] = {
+	{ "3.300 V", { 0x2F, 0x2F | ADM20_SEGMENT_DP, 0x5F, 0x5F }, "3.3" },
+	{ "OL",      { SEG_BLANK, 0x5F, SEG_L, SEG_BLANK }, "" },
+	{ "dashes",  { SEG_DASH, SEG_DASH, SEG_DASH, SEG_DASH }, "" },
+	{ "unknown", { 0x2F, 0x3D | ADM20_SEGMENT_DP, SEG_UNKNOWN, 0x5F }, "" },
+};
+
+#define CASE_COUNT (int)(sizeof(cases) / sizeof(cases[0]))
+
+int main(int argc, char **argv) {
+	static struct adm20_capture capture;
+	char path[] = "/tmp/adm20-test-extract-XXXXXX";
+	char cmd[SSIZE], line[SSIZE];
+	const char *extract = argc > 1 ? argv[1] : "./adm20-extract";
+	uint8_t f[ADM20_FRAME_SIZE];
+	int fd, i, row = -1, failed = 0;
+	FILE *p;
+
+	fd = mkstemp(path);
+	if (fd < 0 || adm20_capture_open(&capture, path, 0)) {
+		fprintf(stderr,"%s:%d: Unable to set up the capture file\r\n", FL);
+		return 1;
+	}
+	close(fd);
+
+	for (i = 0; i < CASE_COUNT; i++) {
+		memset(f, 0, sizeof(f));
+		f[7] = cases[i].d[0];
+		f[6] = cases[i].d[1];
+		f[5] = cases[i].d[2];
+		f[4] = cases[i].d[3];
+		f[16] = 0x20;  // AUTO
+		f[19] = 0x08;  // V
+		f[ADM20_FRAME_SIZE -1] = ADM20_FRAME_END;
+		if (!adm20_frame_valid(f)) {
+			fprintf(stderr,"%s:%d: '%s' frame doesn't pass adm20_frame_valid()\r\n", FL, cases[i].name);
+			failed++;
+		}
+		adm20_capture_write(&capture, adm20_monotonic_ns() + i *1000000ULL, ADM20_CAPTURE_OK, f, ADM20_FRAME_SIZE);
+	}
+	adm20_capture_close(&capture);
+
+	snprintf(cmd, sizeof(cmd), "%s -f %s", extract, path);
+	p = popen(cmd, "r");
+	if (!p) {
+		fprintf(stderr,"%s:%d: Unable to run '%s'\r\n", FL, cmd);
+		unlink(path);
+		return 1;
+	}
+
+	/*
+	 * time_ms,mono_ms,value,unit,mode,display
+	 *
+	 */
+	while (fgets(line, sizeof(line), p)) {
+		char *value, *end;
+
+		if (row++ < 0) continue; // header
+		if (row > CASE_COUNT) break;
+
+		value = strchr(line, ',');
+		value = value ? strchr(value +1, ',') : NULL;
+		end = value ? strchr(value +1, ',') : NULL;
+		if (!end) {
+			fprintf(stderr,"%s:%d: Bad CSV row '%s'\r\n", FL, line);
+			failed++;
+			continue;
+		}
+		*end = '\0';
+		value++;
+
+		if (strcmp(value, cases[row -1].value)) {
+			fprintf(stderr,"%s:%d: '%s' value column is '%s', expected '%s'\r\n", FL, cases[row -1].name, value, cases[row -1].value);
+			failed++;
+		}
+	}
+	if (pclose(p) != 0) {
+		fprintf(stderr,"%s:%d: '%s' failed\r\n", FL, cmd);
+		failed++;
+	}
+	unlink(path);
+
+	if (row != CASE_COUNT) {
+		fprintf(stderr,"%s:%d: %d rows extracted, expected %d\r\n", FL, row < 0 ? 0 : row, CASE_COUNT);
+		failed++;
+	}
+
+	if (failed) return 1;
+
+	fprintf(stdout,"%d extracted rows, value column as expected\r\n", CASE_COUNT);
+
+	return 0;
+}
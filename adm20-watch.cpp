@@ -0,0 +1,312 @@
+/*
+ * BSIDE-ADM20 shared memory reader
+ *
+ * Shows the readings a front end started with -m is publishing,
+ * the latest one, the recent history, or follows along as they
+ * arrive.  -b runs a publish to pickup latency benchmark of the
+ * seqlock on a private segment.
+ *
+ * Written by Paul L Daniels (pldaniels@gmail.com)
+ *
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+#include "adm20-shm.h"
+
+#define FL __FILE__,__LINE__
+
+/*
+ * Should be defined in the Makefile to pass to the compiler from
+ * the github build revision
+ *
+ */
+#ifndef BUILD_VER
+#define BUILD_VER 000
+#endif
+
+#ifndef BUILD_DATE
+#define BUILD_DATE " "
+#endif
+
+#define SSIZE 1024
+
+struct glb {
+	uint8_t debug;
+	uint8_t follow;
+	char *shm_name;
+	int history;
+	uint64_t bench;       // readings to publish in the benchmark, 0 = no benchmark
+};
+
+int init(struct glb *g) {
+	g->debug = 0;
+	g->follow = 0;
+	g->shm_name = (char *)ADM20_SHM_NAME_DEFAULT;
+	g->history = 0;
+	g->bench = 0;
+
+	return 0;
+}
+
+void show_help(void) {
+	fprintf(stdout,"BSIDE ADM20 shared memory reader\r\n"
+			"By Paul L Daniels / pldaniels@gmail.com\r\n"
+			"Build %d / %s\r\n"
+			"\r\n"
+			" [-m <name>] [-n <count>] [-f] [-b <count>]\r\n"
+			"\r\n"
+			"\t-h: This help\r\n"
+			"\t-m <name>: Shared memory name given to the front end's -m (default %s)\r\n"
+			"\t-n <count>: Show the last <count> readings, up to %d\r\n"
+			"\t-f: Follow, show each reading as it's published\r\n"
+			"\t-b <count>: Benchmark publish to pickup latency over <count> readings\r\n"
+			"\t-d: debug enabled\r\n"
+			"\t-v: show version\r\n"
+			"\r\n"
+			"\texample: bside-adm20 -p /dev/ttyUSB0 -m /bside-adm20 & adm20-watch -f\r\n"
+			, BUILD_VER
+			, BUILD_DATE
+			, ADM20_SHM_NAME_DEFAULT
+			, ADM20_SHM_HISTORY
+			);
+}
+
+int parse_parameters(struct glb *g, int argc, char **argv) {
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			/* parameter */
+			switch (argv[i][1]) {
+				case 'h':
+					show_help();
+					exit(0);
+					break;
+
+				case 'd': g->debug = 1; break;
+
+				case 'f': g->follow = 1; break;
+
+				case 'v':
+					fprintf(stdout,"Build %d\r\n", BUILD_VER);
+					exit(0);
+					break;
+
+				case 'm':
+				case 'n':
+				case 'b':
+					if (i +1 >= argc) {
+						fprintf(stderr,"Insufficient parameters; -%c requires a value\n", argv[i][1]);
+						exit(1);
+					}
+					switch (argv[i][1]) {
+						case 'm': g->shm_name = argv[i +1]; break;
+						case 'n': g->history = atoi(argv[i +1]); break;
+						case 'b': g->bench = strtoull(argv[i +1], NULL, 10); break;
+					}
+					i++;
+					break;
+
+				default: break;
+			} // switch
+		}
+	}
+
+	return 0;
+}
+
+static void show_reading(const struct adm20_shm_reading *v) {
+	char line[SSIZE];
+
+	adm20_reading_format(&v->reading, line, sizeof(line), ADM20_FORMAT_LOG);
+	fprintf(stdout,"%llu %.3f ms ago: %s%s\r\n"
+			, (unsigned long long)v->n
+			, (adm20_monotonic_ns() - v->published) / 1e6
+			, line
+			, v->reading.flags & ADM20_READING_STALE ? " (stale)" : ""
+			);
+}
+
+/*
+ * Benchmark
+ *
+ * One writer thread publishing as fast as the reader can keep up
+ * with, one reader spinning on the count.  Each publication waits
+ * for the reader to have seen the previous one so that every
+ * latency sample is a clean publish to pickup time rather than a
+ * queue of them.  Both sides yield while spinning so this still
+ * makes progress on a single CPU, where it then measures a
+ * context switch as much as the seqlock.
+ *
+ */
+struct bench {
+	struct adm20_shm *shm;
+	uint64_t count;
+	volatile uint64_t seen;
+};
+
+static void *bench_writer(void *arg) {
+	struct bench *b = (struct bench *)arg;
+	struct adm20_reading r;
+	uint64_t i;
+
+	memset(&r, 0, sizeof(r));
+	r.mantissa = 3300;
+	r.exponent = -3;
+	r.unit = ADM20_UNIT_VOLT;
+
+	for (i = 0; i < b->count; i++) {
+		while (__atomic_load_n(&b->seen, __ATOMIC_ACQUIRE) < i) sched_yield();
+		r.timestamp = adm20_monotonic_ns();
+		adm20_shm_publish(b->shm, &r);
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int benchmark(struct glb *g) {
+	char name[64];
+	struct bench b;
+	struct adm20_shm *reader;
+	struct adm20_shm_reading v;
+	pthread_t writer;
+	uint64_t *lat, i, t0, calls;
+
+	snprintf(name, sizeof(name), "/bside-adm20-bench-%d", (int)getpid());
+	b.shm = adm20_shm_create(name);
+	if (!b.shm) return 1;
+	reader = adm20_shm_attach(name);
+	adm20_shm_unlink(name);
+	if (!reader) return 1;
+
+	b.count = g->bench;
+	b.seen = 0;
+	lat = (uint64_t *)malloc(b.count *sizeof(uint64_t));
+	if (!lat) return 1;
+
+	pthread_create(&writer, NULL, bench_writer, &b);
+
+	for (i = 0; i < b.count; ) {
+		if (__atomic_load_n(&reader->count, __ATOMIC_ACQUIRE) <= i) {
+			sched_yield();
+			continue;
+		}
+		if (adm20_shm_latest(reader, &v) <= 0) {
+			fprintf(stderr,"%s:%d: Unable to read the latest reading, the writer thread stopped mid-write\r\n", FL);
+			return 1;
+		}
+		lat[i] = adm20_monotonic_ns() - v.published;
+		i++;
+		__atomic_store_n(&b.seen, i, __ATOMIC_RELEASE);
+	}
+	pthread_join(writer, NULL);
+
+	/*
+	 * Cost of a read with nothing changing, what a polling reader
+	 * pays each time it looks.
+	 *
+	 */
+	calls = 10000000;
+	t0 = adm20_monotonic_ns();
+	for (i = 0; i < calls; i++) {
+		if (adm20_shm_latest(reader, &v) <= 0) {
+			fprintf(stderr,"%s:%d: Unable to read the latest reading on call %llu\r\n", FL, (unsigned long long)i);
+			return 1;
+		}
+	}
+	t0 = adm20_monotonic_ns() - t0;
+
+	qsort(lat, b.count, sizeof(uint64_t), cmp_u64);
+	fprintf(stdout,"%llu readings, publish to pickup: min %llu ns, p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\r\n"
+			, (unsigned long long)b.count
+			, (unsigned long long)lat[0]
+			, (unsigned long long)lat[b.count /2]
+			, (unsigned long long)lat[b.count *99 /100]
+			, (unsigned long long)lat[b.count *999 /1000]
+			, (unsigned long long)lat[b.count -1]
+			);
+	fprintf(stdout,"adm20_shm_latest(): %.1f ns per call\r\n", (double)t0 / calls);
+
+	free(lat);
+	adm20_shm_detach(reader);
+	adm20_shm_detach(b.shm);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct glb g;
+	struct adm20_shm *shm;
+	struct adm20_shm_reading v[ADM20_SHM_HISTORY];
+	ssize_t n, i;
+
+	init(&g);
+	parse_parameters(&g, argc, argv);
+
+	if (g.bench) return benchmark(&g);
+
+	shm = adm20_shm_attach(g.shm_name);
+	if (!shm) exit(1);
+
+	if (g.debug) fprintf(stderr,"%s:%d: writer pid %d, %llu readings published\r\n", FL, (int)shm->writer, (unsigned long long)shm->count);
+
+	if (g.history > 0) {
+		n = adm20_shm_history(shm, v, g.history);
+		if (n < 0) {
+			fprintf(stderr,"%s:%d: Unable to read the history, writer pid %d stopped mid-write\r\n", FL, (int)shm->writer);
+			exit(1);
+		}
+		for (i = 0; i < n; i++) show_reading(&v[i]);
+	} else if (!g.follow) {
+		int rc = adm20_shm_latest(shm, &v[0]);
+
+		if (rc < 0) {
+			fprintf(stderr,"%s:%d: Unable to read the latest reading, writer pid %d stopped mid-write\r\n", FL, (int)shm->writer);
+			exit(1);
+		}
+		if (rc) show_reading(&v[0]);
+	}
+
+	if (g.follow) {
+		struct timespec ts = { 0, 1000000 };
+		uint64_t last = __atomic_load_n(&shm->count, __ATOMIC_ACQUIRE);
+
+		while (1) {
+			uint64_t count = __atomic_load_n(&shm->count, __ATOMIC_ACQUIRE);
+
+			if (count < last) last = 0; // writer restarted
+			if (count > last) {
+				/*
+				 * Pick up everything since last time from the
+				 * history, not just the latest.
+				 *
+				 */
+				n = adm20_shm_history(shm, v, count - last);
+				if (n < 0) fprintf(stderr,"%s:%d: Unable to read the history, writer pid %d stopped mid-write\r\n", FL, (int)shm->writer);
+				for (i = 0; i < n; i++) show_reading(&v[i]);
+				fflush(stdout);
+				last = count;
+			}
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	adm20_shm_detach(shm);
+
+	return 0;
+}
@@ -8,6 +8,7 @@
  *
  */
 
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,6 +22,16 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+#include "adm20-serial.h"
+#include "adm20-capture.h"
+#include "adm20-handoff.h"
+#include "adm20-shm.h"
+#include "adm20-fanout.h"
+#include "adm20-latency.h"
+#include "adm20-health.h"
+
 #define FL __FILE__,__LINE__
 
 /*
@@ -39,22 +50,6 @@
 #define SSIZE 1024
 
 #define DATA_FRAME_SIZE 22
-#define ee ""
-#define uu "\u00B5"
-#define kk "k"
-#define MM "M"
-#define mm "m"
-#define nn "n"
-#define pp "p"
-#define dd "\u00B0"
-#define oo "\u03A9"
-
-struct serial_params_s {
-	char *device;
-	int fd, n;
-	int cnt, size, s_cnt;
-	struct termios oldtp, newtp;
-};
 
 struct meter_param {
 	char mode[20];
@@ -70,8 +65,16 @@ struct glb {
 	uint16_t flags;
 	char *com_address;
 	char *output_file;
-
+	char *capture_file;
+	int capture_sync;
+	char *replay_file;
+	double replay_speed;
+	char *shm_name;
+	char *stats_file;
+
+	char *serial_config;
 	struct serial_params_s serial_params;
+	uint8_t low_latency;
 
 };
 
@@ -85,37 +88,154 @@ struct glb {
  */
 struct glb *glbs;
 
-bool fileExists(const char *filename) {
-	struct stat buf;
-	return (stat(filename, &buf) == 0);
+/*
+ * Set from SIGINT/SIGTERM so the main loop can drop out and
+ * flush the capture file rather than losing the tail of it.
+ *
+ */
+static volatile sig_atomic_t quit = 0;
+
+static void quit_handler(int sig) {
+	(void)sig;
+	quit = 1;
+}
+
+/*
+ * SIGUSR1 asks for the latency histograms, written out from the
+ * main loop rather than the handler.
+ *
+ */
+static volatile sig_atomic_t dump_stats = 0;
+
+static void dump_handler(int sig) {
+	(void)sig;
+	dump_stats = 1;
+}
+
+/*
+ * Reading consumers
+ *
+ * The acquisition loop in main() only parses, decodes and publishes
+ * in to the fan-out ring; the console line and the FlexBV file are
+ * each written from their own thread, so a slow terminal or disk
+ * can never hold up the next read() from the port.  A consumer that
+ * falls a whole ring behind loses the oldest readings, counted as
+ * overruns and reported at exit.
+ *
+ */
+struct consumer {
+	struct adm20_fanout_cursor cursor;
+	struct glb *g;
+	struct adm20_handoff *handoff;
+	pthread_t thread;
+	int started;
+};
+
+static struct adm20_fanout fanout;
+static struct adm20_latency stages;
+
+static void *console_consumer(void *arg) {
+	struct consumer *c = (struct consumer *)arg;
+	struct adm20_reading r;
+	char linetmp[SSIZE];
+	int w;
+
+	do {
+		w = adm20_fanout_wait(&c->cursor, -1, -1);
+		while (adm20_fanout_next(&c->cursor, &r)) {
+			adm20_reading_format(&r, linetmp, sizeof(linetmp), ADM20_FORMAT_DISPLAY);
+			fprintf(stdout,"%-40s\r", linetmp);
+			if (!(r.flags & ADM20_READING_STALE) && !c->g->replay_file) adm20_latency_record(&stages, ADM20_STAGE_CONSOLE, adm20_monotonic_ns() - r.timestamp);
+		}
+		fflush(stdout);
+	} while (!(w & ADM20_FANOUT_CLOSED));
+
+	return NULL;
+}
+
+/*
+ * FlexBV only ever wants the newest reading, so everything queued
+ * up behind it is skipped and only the last one is considered.
+ *
+ */
+static void *handoff_consumer(void *arg) {
+	struct consumer *c = (struct consumer *)arg;
+	struct adm20_handoff *h = c->handoff;
+	struct adm20_reading r, latest;
+	char linetmp[SSIZE];
+	int w, have = 0;
+
+	do {
+		w = adm20_fanout_wait(&c->cursor, h->ifd, -1);
+		while (adm20_fanout_next(&c->cursor, &r)) {
+			/*
+			 * Never hand FlexBV a stale reading
+			 *
+			 */
+			if (!(r.flags & ADM20_READING_STALE)) { latest = r; have = 1; }
+		}
+
+		if ((w & ADM20_FANOUT_FD) && adm20_handoff_check(h) && c->g->debug) {
+			fprintf(stdout,"FlexBV took its reading after %.1f ms, %.1f ms old\r\n", h->wait_last / 1e6, h->age_last / 1e6);
+		}
+
+		if (have && h->want) {
+			adm20_reading_format(&latest, linetmp, sizeof(linetmp), ADM20_FORMAT_DISPLAY);
+			if (adm20_handoff_publish(h, linetmp, latest.timestamp) > 0) {
+				if (!c->g->replay_file) adm20_latency_record(&stages, ADM20_STAGE_FLEXBV, adm20_monotonic_ns() - latest.timestamp);
+				if (c->g->debug) fprintf(stderr,"%s:%d: %s => %s\r\n", FL, linetmp, c->g->output_file);
+			}
+		}
+	} while (!(w & ADM20_FANOUT_CLOSED));
+
+	return NULL;
 }
 
+static int consumer_start(struct consumer *c, struct glb *g, const char *name, void *(*fn)(void *)) {
+	sigset_t block, old;
+	int r;
+
+	c->g = g;
+	c->started = 0;
+	if (adm20_fanout_subscribe(&fanout, &c->cursor, name)) return -1;
+
+	/*
+	 * SIGINT/SIGTERM/SIGUSR1 must land on the acquisition thread to
+	 * break its read(), so the consumers start with them blocked.
+	 *
+	 */
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	r = pthread_create(&c->thread, NULL, fn, c);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-char digit( unsigned char dg ) {
-
-	int d;
-	char g;
-
-	switch ((dg) & 0x7F) {
-		case 0x5F: g = '0'; d = 0; break;
-		case 0x06: g = '1'; d = 1; break;
-		case 0x6B: g = '2'; d = 2; break;
-		case 0x2F: g = '3'; d = 3; break;
-		case 0x36: g = '4'; d = 4; break;
-		case 0x3D: g = '5'; d = 5; break;
-		case 0x7D: g = '6'; d = 6; break;
-		case 0x07: g = '7'; d = 7; break;
-		case 0x7F: g = '8'; d = 8; break;
-		case 0x3F: g = '9'; d = 9; break;
-		case 0x79: g = 'E'; d = 0; break;
-		case 0x58: g = 'L'; d = 0; break;
-		default: g = ' ';
-					//		default: fprintf(stderr,"Unknown 7-segment data '%d / %02x'\r\n", dg, dg);
+	if (r) {
+		fprintf(stderr,"%s:%d: Unable to start the %s consumer (%s)\r\n", FL, name, strerror(r));
+		return -1;
+	}
+	c->started = 1;
+
+	return 0;
+}
+
+static void consumer_stop(struct consumer *c) {
+	if (!c->started) return;
+	pthread_join(c->thread, NULL);
+	if (c->cursor.overruns || glbs->debug) {
+		fprintf(stderr,"\r\n%s consumer: %llu readings, %llu overrun\r\n"
+				, c->cursor.name
+				, (unsigned long long)c->cursor.received
+				, (unsigned long long)c->cursor.overruns
+				);
 	}
-	//	fprintf(stderr,"%d / %c", d, dg);
-	return g;
+	adm20_fanout_release(&c->cursor);
+	c->started = 0;
 }
 
+
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220248
   Function Name	: init
@@ -138,6 +258,17 @@ int init(struct glb *g) {
 	g->flags = 0;
 	g->com_address = NULL;
 	g->output_file = NULL;
+	g->capture_file = NULL;
+	g->capture_sync = ADM20_CAPTURE_SYNC_DEFAULT;
+	g->replay_file = NULL;
+	g->replay_speed = 1.0;
+	g->shm_name = NULL;
+	g->stats_file = NULL;
+	g->serial_config = (char *)ADM20_DEFAULT_SERIAL_CONFIG;
+	g->serial_params.device = NULL;
+	g->serial_params.fd = -1;
+	g->serial_params.low_latency = 0;
+	g->low_latency = 0;
 
 	return 0;
 }
@@ -151,8 +282,16 @@ void show_help(void) {
 			"\r\n"
 			"\t-h: This help\r\n"
 			"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
+			"\t\t(default: look for it on every /dev/ttyUSB*, /dev/ttyACM* and /dev/serial/by-id port)\r\n"
 			"\t-s <[9600|4800|2400|1200]:[7|8][o|e|n][1|2]>, eg: -s 2400:8n1\r\n"
 			"\t-o <output file> ( used by FlexBV to read the data )\r\n"
+			"\t-c <capture file> ( append the raw frames, for replay later )\r\n"
+			"\t-cs <seconds between capture file syncs, 0 = only on exit>, eg: -cs 5\r\n"
+			"\t--replay <capture file>: Play a capture back instead of reading the meter\r\n"
+			"\t--speed <Nx|max>: Replay speed, eg: --speed 10x (default 1x)\r\n"
+			"\t--low-latency: Have the serial driver pass bytes on straight away, reading whole frames\r\n"
+			"\t-m <shared memory name>: Publish readings for local readers, eg: -m /bside-adm20\r\n"
+			"\t--stats <file>: Append the latency and link stats as JSON here on SIGUSR1 and at exit (default stderr)\r\n"
 			"\t-d: debug enabled\r\n"
 			"\t-q: quiet output\r\n"
 			"\t-v: show version\r\n"
@@ -219,6 +358,67 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					}
 					break;
 
+				case 'c':
+					/*
+					 * -c <file> capture every frame we receive
+					 * -cs <seconds> how often to fsync() it
+					 *
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; -c <capture file> or -cs <seconds>\n");
+						exit(1);
+					}
+					if (argv[i-1][2] == 's') g->capture_sync = atoi(argv[i]);
+					else g->capture_file = argv[i];
+					break;
+
+				case '-':
+					/*
+					 * --replay <capture file> [--speed <Nx|max>]
+					 * --low-latency
+					 * --stats <file>
+					 *
+					 */
+					if (!strcmp(argv[i], "--low-latency")) {
+						g->low_latency = 1;
+					} else if (!strcmp(argv[i], "--stats")) {
+						i++;
+						if (i >= argc) {
+							fprintf(stdout,"Insufficient parameters; --stats <file>\n");
+							exit(1);
+						}
+						g->stats_file = argv[i];
+					} else if (!strcmp(argv[i], "--replay") || !strcmp(argv[i], "--speed")) {
+						i++;
+						if (i >= argc) {
+							fprintf(stdout,"Insufficient parameters; %s requires a value\n", argv[i-1]);
+							exit(1);
+						}
+						if (argv[i-1][2] == 'r') {
+							g->replay_file = argv[i];
+						} else if (adm20_replay_speed(argv[i], &g->replay_speed)) {
+							fprintf(stdout,"Invalid replay speed '%s', expected eg 10x or max\n", argv[i]);
+							exit(1);
+						}
+					}
+					break;
+
+				case 'm':
+					/*
+					 * POSIX shared memory segment to publish every
+					 * reading in to, see adm20-shm.h
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->shm_name = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -m <shared memory name>\n");
+						exit(1);
+					}
+					break;
+
 				case 'd': g->debug = 1; break;
 
 				case 'q': g->quiet = 1; break;
@@ -229,6 +429,13 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 							 break;
 
 				case 's':
+							 i++;
+							 if (i < argc) {
+								 g->serial_config = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -s <serial port config>\n");
+								 exit(1);
+							 }
 							 break;
 
 				default: break;
@@ -241,40 +448,6 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 
 
 
-/*
- * Default parameters are 2400:8n1, given that the multimeter
- * is shipped like this and cannot be changed then we shouldn't
- * have to worry about needing to make changes, but we'll probably
- * add that for future changes.
- *
- */
-void open_port(struct serial_params_s *s) {
-	int r; 
-
-	s->fd = open( s->device, O_RDWR | O_NOCTTY |O_NDELAY );
-	if (s->fd <0) {
-		perror( s->device );
-	}
-
-	fcntl(s->fd,F_SETFL,0);
-	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings 
-	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
-	cfmakeraw(&(s->newtp));
-	s->newtp.c_cflag = B2400 | CS8 |  CREAD | CRTSCTS ; // Adjust the settings to suit our BSIDE-ADM20 / 2400-8n1
-
-	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
-	if (r) {
-		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
-		exit(1);
-	}
-}
-
-uint8_t a2h( uint8_t a ) {
-	a -= 0x30;
-	if (a < 10) return a;
-	a -= 7;
-	return a;
-}
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220307
   Function Name	: main
@@ -293,23 +466,23 @@ Changes:
 
 \------------------------------------------------------------------*/
 int main ( int argc, char **argv ) {
-	char linetmp[SSIZE]; // temporary string for building main line of text
-	char prefix[SSIZE]; // Units prefix u, m, k, M etc
-	char units[SSIZE];  // Measurement units F, V, A, R
-	char mmmode[SSIZE]; // Multimeter mode, Resistance/diode/cap etc
-
 	//uint8_t dfake[] = { 0xf0, 0x11, 0x02, 0x00, 0x44, 0x33, 0x44, 0x36, 0x00, 0x05 }; // 2.7965V [ DC Volts ]
 	//uint8_t dfake[] = { 0xf0, 0x11, 0x04, 0x02, 0x44, 0x33, 0x44, 0x36, 0x00, 0x05 }; // 27.965kOhms [ Resistance ]
 	//uint8_t dfake[] = { 0xf0, 0x11, 0x04, 0x02, 0x44, 0x33, 0x44, 0x36, 0x10, 0x05 }; // -27.965kOhms [ Resistance ]
 
-	uint8_t d[SSIZE];
-	uint8_t dt[SSIZE];      // Serial data packet
+	struct adm20_reading reading; // Last decoded reading
 	int dt_loaded = 0;	// set when we have our first valid data
-	uint8_t dps = 0;     // Number of decimal places
+	struct adm20_reader reader; // Buffered frame reader for the serial port
+	struct adm20_capture capture; // Raw frame capture file, if -c was given
+	struct adm20_replay replay; // Capture being played back, if --replay was given
+	struct adm20_handoff handoff; // FlexBV output file, if -o was given
+	struct consumer console, flexbv; // Threads taking readings off the fan-out
+	struct adm20_shm *shm = NULL; // Shared memory publication, if -m was given
+	struct adm20_reconnect reconnect; // Watching for the port to come back after it's gone
+	struct adm20_health health; // Frame gaps and the kernel's line error counts
 	struct glb g;        // Global structure for passing variables around
 	int i = 0;           // Generic counter
 	char temp_char;        // Temporary character
-	char tfn[4096];
 	glbs = &g;
 
 	/*
@@ -322,193 +495,216 @@ int main ( int argc, char **argv ) {
 	 */
 	parse_parameters(&g, argc, argv);
 
-	if (g.output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g.output_file);
+	if (adm20_handoff_open(&handoff, g.output_file)) exit(1);
+	if (g.shm_name && !(shm = adm20_shm_create(g.shm_name))) exit(1);
 
 	/*
-	 * Handle the COM Port
+	 * Handle the COM Port, or the capture standing in for it
 	 */
-	open_port(&g.serial_params);
+	if (g.replay_file) {
+		if (adm20_replay_open(&replay, g.replay_file, g.replay_speed)) exit(1);
+		adm20_reader_init(&reader, -1);
+	} else if (!g.serial_params.device) {
+		if (adm20_detect_port(&g.serial_params, g.serial_config, &reader, g.debug) < 0) exit(1);
+	} else {
+		if (adm20_open_port(&g.serial_params, g.serial_config) < 0) exit(1);
+		adm20_reader_init(&reader, g.serial_params.fd);
+	}
+	if (g.low_latency && g.serial_params.fd >= 0) adm20_serial_low_latency(&g.serial_params, ADM20_LATENCY_DRIVER | ADM20_LATENCY_WHOLE_FRAMES);
+
+	adm20_reconnect_init(&reconnect);
+	adm20_health_init(&health);
+	adm20_health_port(&health, g.serial_params.fd);
+
+	capture.fd = -1;
+	if (g.capture_file && adm20_capture_open(&capture, g.capture_file, g.capture_sync)) exit(1);
 
 	/*
 	 *
 	 * Parent will terminate us... else we'll become a zombie
 	 * and hope that the almighty PID 1 will reap us
 	 *
+	 * The handlers are installed without SA_RESTART so a
+	 * blocked read() on the port returns and we see the flag.
+	 *
 	 */
-	while (1) {
-		char line1[1024];
-		char *p, *q;
-		double v = 0.0;
-		int end_of_frame_received = 0;
-		ssize_t bytes_read = 0;
+	{
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = quit_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		sa.sa_handler = dump_handler;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
 
-		linetmp[0] = '\0';
+	adm20_latency_init(&stages);
+	adm20_fanout_init(&fanout);
+	console.started = flexbv.started = 0;
+	if (!g.quiet && consumer_start(&console, &g, "console", console_consumer)) exit(1);
+	flexbv.handoff = &handoff;
+	if (handoff.ifd >= 0 && consumer_start(&flexbv, &g, "FlexBV", handoff_consumer)) exit(1);
+
+	while (!quit) {
+		const uint8_t *frame;
+		ssize_t got;
+		uint64_t t;
+
+		if (dump_stats) {
+			dump_stats = 0;
+			adm20_latency_dump(&stages, g.stats_file);
+			adm20_health_poll(&health, reader.fd, 0);
+			adm20_health_dump(&health, &reader, g.replay_file ? g.replay_file : g.serial_params.device, g.stats_file);
+		}
+
+		if (reconnect.lost) {
+			if (adm20_reconnect_wait(&reconnect, &g.serial_params, -1) >= 0) {
+				adm20_reader_attach(&reader, g.serial_params.fd);
+				adm20_health_port(&health, g.serial_params.fd);
+			}
+			continue;
+		}
 
 		/*
 		 * Time to start receiving the serial block data
 		 *
-		 * We initially "stage" here waiting for there to
-		 * be something happening on the com port.  Soon as
-		 * something happens, then we move forward to trying
-		 * to read the data.
+		 * Hand out any frame already sitting in the reader's
+		 * ring, otherwise block on the com port and pull in
+		 * everything it has with one read().  Partial frames
+		 * stay in the ring until the rest turns up.
 		 *
 		 */
 
-		if (g.debug) { fprintf(stdout,"DATA START: "); }
-		end_of_frame_received = 0;
-		i = 0;
-		do {
-			char temp_char;
-			bytes_read = read(g.serial_params.fd, &temp_char, 1);
-			if (bytes_read) {
-				d[i] = temp_char;
-				if (g.debug) { fprintf(stdout,"%02x ", d[i]); }
-
-				i++;
+		switch (adm20_reader_next(&reader, &frame)) {
+			case ADM20_FRAME_MORE:
+				if (g.replay_file) {
+					if (!adm20_replay_feed(&replay, &reader)) quit = 1;
+					continue;
+				}
 
-				if (temp_char == 0x55) {
-					end_of_frame_received = 1;
+				t = adm20_monotonic_ns();
+				got = adm20_reader_fill(&reader);
+				if (got > 0) adm20_latency_record(&stages, ADM20_STAGE_READ_WAIT, reader.fill_time - t);
+				if (got == 0 || (got < 0 && errno != EINTR && errno != EAGAIN)) {
+					/*
+					 * Adapter pulled, tell everyone it's gone
+					 * and wait for it to come back
+					 *
+					 */
+					adm20_health_poll(&health, reader.fd, 0);
+					adm20_reconnect_lost(&reconnect, &g.serial_params, got);
+					reader.fd = -1;
+					adm20_reading_disconnected(&reading, reconnect.lost);
+					dt_loaded = 0;
 					break;
 				}
-			}
-		} while ((bytes_read > 0) && (i < sizeof(d)) && (!end_of_frame_received));
-
-		if (g.debug) { fprintf(stdout,":END [%d bytes]\r\n", i); }
+				continue;
+
+			case ADM20_FRAME_REJECTED:
+				if (capture.fd >= 0) adm20_capture_write(&capture, reader.fill_time, ADM20_CAPTURE_REJECTED, frame, frame ? ADM20_FRAME_SIZE : 0);
+
+				/*
+				 * Noise, a truncated frame or one no meter could
+				 * send (two decimal points, two units lit).  Show
+				 * the previous frame again but flag it as stale so
+				 * nobody mistakes it for a fresh reading.
+				 *
+				 */
+				if (g.debug) { fprintf(stdout,"Rejected %u byte frame [ ok %llu, rejected %llu, discarded %llu bytes ], loading previous frame\r\n", reader.frame_len, (unsigned long long)reader.frames_ok, (unsigned long long)reader.frames_rejected, (unsigned long long)reader.bytes_discarded); }
+				if (!dt_loaded) continue;
+				reading.flags |= ADM20_READING_STALE;
+				break;
+
+			case ADM20_FRAME_OK:
+				if (capture.fd >= 0) adm20_capture_write(&capture, reader.fill_time, ADM20_CAPTURE_OK, frame, ADM20_FRAME_SIZE);
+				if (g.debug) {
+					fprintf(stdout,"DATA START: ");
+					for (i = 0; i < DATA_FRAME_SIZE; i++) fprintf(stdout,"%02x ", frame[i]);
+					fprintf(stdout,":END [%d bytes]\r\n", DATA_FRAME_SIZE);
+				}
+				/*
+				 * Replayed frames carry the time they were captured,
+				 * only the stages from here on mean anything then.
+				 *
+				 */
+				t = adm20_monotonic_ns();
+				if (!g.replay_file) adm20_latency_record(&stages, ADM20_STAGE_ASSEMBLY, t - reader.fill_time);
+				adm20_decode(frame, reader.fill_time, &reading);
+				adm20_latency_record(&stages, ADM20_STAGE_DECODE, adm20_monotonic_ns() - t);
+				adm20_health_frame(&health, reader.fill_time);
+				adm20_health_poll(&health, reader.fd, t);
+				dt_loaded = 1;
+				break;
+		}
 
 		/*
-		 * Validate the received data
+		 * Hand the reading on and get straight back to the port,
+		 * the consumers format and write it in their own time.
 		 *
 		 */
-		if (i != DATA_FRAME_SIZE) {
-			if (g.debug) { fprintf(stdout,"Invalid number of bytes, expected %d, received %d, loading previous frame\r\n", DATA_FRAME_SIZE, i); }
-			if (dt_loaded) memcpy(d, dt, sizeof(d));
-		} else {
-			memcpy(dt, d, sizeof(d)); // make a copy.
-			dt_loaded = 1;
+		t = adm20_monotonic_ns();
+		if (shm) {
+			adm20_shm_publish(shm, &reading);
+			adm20_latency_record(&stages, ADM20_STAGE_SHM, adm20_monotonic_ns() - t);
+			t = adm20_monotonic_ns();
 		}
+		adm20_fanout_publish(&fanout, &reading);
+		adm20_latency_record(&stages, ADM20_STAGE_FANOUT, adm20_monotonic_ns() - t);
 
-		/*
-		 * Initialise the strings used for units, prefix and mode
-		 * so we don't end up with uncleared prefixes etc
-		 * ( see https://www.youtube.com/watch?v=5HUyEykicEQ )
-		 *
-		 * Prefix string initialised to single space, prevents 
-		 * annoying string width jump (on monospace, can't stop
-		 * it with variable width strings unless we draw the 
-		 * prefix+units separately in a fixed location
-		 *
-		 */
-		snprintf(prefix, sizeof(prefix), " ");
-		units[0] = '\0';
-		mmmode[0] = '\0';
+	} // while(1)
 
-		/*
-		 * Decode our data.
-		 *
-		 * While the data sheet gives a very nice matrix for the RANGE and FUNCTION values
-		 * it's probably more human-readable to break it down in to longer code on a per
-		 * function selection.
-		 *
-		 * linetmp : contains the value we want show
-		 * mmode   : contains the meter mode (resistance, volts, amps etc)
-		 *  L"\u00B0C" = 'C
-		 *  L"\u00B0F" = 'F
-		 *  L"\u2126"  = ohms char
-		 *  L"\u00B5"  = mu char (micro)
-		 *
-		 */
+	adm20_fanout_close(&fanout);
+	consumer_stop(&console);
+	consumer_stop(&flexbv);
 
+	adm20_capture_close(&capture);
+	adm20_health_poll(&health, reader.fd, 0);
 
-		if (d[16] & 0x80) snprintf(mmmode,sizeof(mmmode),"REL");
-		if (d[16] & 0x20) snprintf(mmmode,sizeof(mmmode),"AUTO");
-
-		if (d[17] & 0x40) snprintf(mmmode,sizeof(mmmode),"hFE");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"%%");
-		if (d[17] & 0x08) snprintf(mmmode,sizeof(mmmode),"MIN");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"min-max");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"MAX");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"USB");
-
-		if (d[18] & 0x80) snprintf(units,sizeof(units),"F");
-		if (d[18] & 0x40) snprintf(prefix,sizeof(prefix),"n");
-		if (d[18] & 0x20) snprintf(prefix,sizeof(prefix),"%s",uu);
-		if (d[18] & 0x02) snprintf(units,sizeof(units),"%sF",dd);
-		if (d[18] & 0x01) snprintf(units,sizeof(units),"%sC",dd);
-
-		if (d[19] & 0x80) snprintf(units,sizeof(units),"Hz");
-		if (d[19] & 0x40) snprintf(units,sizeof(units),"%s",oo);
-		if (d[19] & 0x20) snprintf(prefix,sizeof(prefix),"k");
-		if (d[19] & 0x10) snprintf(prefix,sizeof(prefix),"M");
-		if (d[19] & 0x08) snprintf(units,sizeof(units),"V");
-		if (d[19] & 0x04) snprintf(units,sizeof(units),"A");
-		if (d[19] & 0x02) snprintf(prefix,sizeof(prefix),"m");
-		if (d[19] & 0x01) snprintf(prefix,sizeof(prefix),"%s",uu);
-
-		{
-			char value[128];
-			int dp = 0;
-			/*
-				value = digit(&d[7]) *1000;
-				value += digit(&d[6]) *100;
-				value += digit(&d[5]) *10;
-				value += digit(&d[4]) *1;
-				*/
-			/*
-				switch (dp) {
-				case 1: value /= 10; break;
-				case 2: value /= 100; break;
-				case 3: value /= 1000; break;
-				case 4: value /= 10000; break;
-				}
-				*/
-			snprintf(linetmp,sizeof(linetmp), "%s%c%s%c%s%c%s%c%s%s"
-					, d[8]&0x08?"-":" "
-					, digit(d[7])
-					, d[6]&0x80?".":""
-					, digit(d[6])
-					, d[5]&0x80?".":""
-					, digit(d[5])
-					, d[4]&0x80?".":""
-					, digit(d[4])
-					, prefix
-					, units
-					);
-		}
+	if (g.output_file) {
+		fprintf(stderr,"\r\nFlexBV took %llu readings, waiting avg %.1f ms max %.1f ms, up to %.1f ms old\r\n"
+				, (unsigned long long)handoff.pickups
+				, handoff.pickups ? handoff.wait_total / 1e6 / handoff.pickups : 0.0
+				, handoff.wait_max / 1e6
+				, handoff.age_max / 1e6
+				);
+	}
+	adm20_handoff_close(&handoff);
 
+	if (shm) {
+		adm20_shm_detach(shm);
+		adm20_shm_unlink(g.shm_name);
+	}
+	adm20_close_port(&g.serial_params);
+	adm20_reconnect_close(&reconnect);
+	if (reconnect.drops) {
+		fprintf(stderr,"\r\nLost the port %u times, down %.0f ms in all, longest %.0f ms\r\n"
+				, reconnect.drops
+				, reconnect.down_total / 1e6
+				, reconnect.down_max / 1e6
+				);
+	}
+
+	if (g.replay_file) {
 		/*
+		 * End to end throughput, parser through to every sink
 		 *
-		 * END OF DECODING
 		 */
+		double secs = (adm20_monotonic_ns() - replay.start) / 1e9;
+		uint64_t frames = reader.frames_ok + reader.frames_rejected;
+
+		fprintf(stderr,"\r\nReplayed %llu frames ( ok %llu, rejected %llu ) in %.3f s, %.0f frames/s\r\n"
+				, (unsigned long long)frames
+				, (unsigned long long)reader.frames_ok
+				, (unsigned long long)reader.frames_rejected
+				, secs
+				, secs > 0 ? frames / secs : 0.0
+				);
+		adm20_replay_close(&replay);
+	}
 
-
-		snprintf(line1, sizeof(line1), "%-40s", linetmp);
-//		snprintf(line2, sizeof(line2), "%-40s", mmmode);
-//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
-
-		if (!g.quiet) fprintf(stdout,"%s\r",line1); fflush(stdout);
-
-		if (g.output_file) {
-			/*
-			 * Only write the file out if it doesn't
-			 * exist. 
-			 *
-			 */
-			if (!fileExists(g.output_file)) {
-				FILE *f;
-				fprintf(stderr,"%s:%d: output filename = %s\r\n", FL, g.output_file);
-				f = fopen(tfn,"w");
-				if (f) {
-					fprintf(f,"%s", linetmp);
-					fprintf(stderr,"%s:%d: %s => %s\r\n", FL, linetmp, tfn);
-					fclose(f);
-					rename(tfn, g.output_file);
-				}
-			}
-		}
-
-	} // while(1)
-
-	if (g.serial_params.fd) close(g.serial_params.fd);
+	adm20_latency_dump(&stages, g.stats_file);
+	adm20_health_dump(&health, &reader, g.replay_file ? g.replay_file : g.serial_params.device, g.stats_file);
 
 	return 0;
 
@@ -11,11 +11,14 @@
 #include <SDL.h>
 #include <SDL_ttf.h>
 
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,6 +28,17 @@
 #include <errno.h>
 #include <X11/Xlib.h>
 
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+#include "adm20-serial.h"
+#include "adm20-capture.h"
+#include "adm20-handoff.h"
+#include "adm20-shm.h"
+#include "adm20-fanout.h"
+#include "adm20-display.h"
+#include "adm20-latency.h"
+#include "adm20-health.h"
+
 #define FL __FILE__,__LINE__
 
 /*
@@ -43,24 +57,6 @@
 #define SSIZE 1024
 
 #define DATA_FRAME_SIZE 22
-#define ee ""
-#define uu "\u00B5"
-#define kk "k"
-#define MM "M"
-#define mm "m"
-#define nn "n"
-#define pp "p"
-#define dd "\u00B0"
-#define oo "\u03A9"
-
-char default_serial_config[] = "2400:8n1";
-
-struct serial_params_s {
-	char *device;
-	int fd, n;
-	int cnt, size, s_cnt;
-	struct termios oldtp, newtp;
-};
 
 struct meter_param {
 	char mode[20];
@@ -73,12 +69,22 @@ struct glb {
 	uint8_t debug;
 	uint8_t quiet;
 	uint8_t show_mode;
+	uint8_t no_atlas;
+	uint8_t segments;
 	uint16_t flags;
 	char *com_address;
 	char *output_file;
+	char *capture_file;
+	int capture_sync;
+	char *replay_file;
+	double replay_speed;
+	char *shm_name;
+	char *stats_file;
+	uint8_t status;
 
 	char *serial_config;
 	struct serial_params_s serial_params;
+	uint8_t low_latency;
 
 	int font_size;
 	int window_width, window_height;
@@ -97,40 +103,6 @@ struct glb {
  */
 struct glb *glbs;
 
-bool fileExists(const char *filename) {
-	FILE *f;
-	if (f=fopen(filename,"r")) {
-		fclose(f);
-		return true;
-	}
-	return false;
-}
-
-
-char digit( unsigned char dg ) {
-
-	int d;
-	char g;
-
-	switch ((dg) & 0x7F) {
-		case 0x5F: g = '0'; d = 0; break;
-		case 0x06: g = '1'; d = 1; break;
-		case 0x6B: g = '2'; d = 2; break;
-		case 0x2F: g = '3'; d = 3; break;
-		case 0x36: g = '4'; d = 4; break;
-		case 0x3D: g = '5'; d = 5; break;
-		case 0x7D: g = '6'; d = 6; break;
-		case 0x07: g = '7'; d = 7; break;
-		case 0x7F: g = '8'; d = 8; break;
-		case 0x3F: g = '9'; d = 9; break;
-		case 0x79: g = 'E'; d = 0; break;
-		case 0x58: g = 'L'; d = 0; break;
-		default: g = ' ';
-					//		default: fprintf(stderr,"Unknown 7-segment data '%d / %02x'\r\n", dg, dg);
-	}
-	//	fprintf(stderr,"%d / %c", d, dg);
-	return g;
-}
 
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220248
@@ -151,9 +123,23 @@ Changes:
 int init(struct glb *g) {
 	g->debug = 0;
 	g->quiet = 0;
+	g->no_atlas = 0;
+	g->segments = 0;
 	g->flags = 0;
 	g->com_address = NULL;
 	g->output_file = NULL;
+	g->capture_file = NULL;
+	g->capture_sync = ADM20_CAPTURE_SYNC_DEFAULT;
+	g->replay_file = NULL;
+	g->replay_speed = 1.0;
+	g->shm_name = NULL;
+	g->stats_file = NULL;
+	g->status = 0;
+	g->serial_config = (char *)ADM20_DEFAULT_SERIAL_CONFIG;
+	g->serial_params.device = NULL;
+	g->serial_params.fd = -1;
+	g->serial_params.low_latency = 0;
+	g->low_latency = 0;
 
 	g->font_size = 60;
 	g->window_width = 400;
@@ -176,8 +162,19 @@ void show_help(void) {
 			"\r\n"
 			"\t-h: This help\r\n"
 			"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
+			"\t\t(default: look for it on every /dev/ttyUSB*, /dev/ttyACM* and /dev/serial/by-id port)\r\n"
 			"\t-s <[9600|4800|2400|1200]:[7|8][o|e|n][1|2]>, eg: -s 2400:8n1\r\n"
 			"\t-o <output file> ( used by FlexBV to read the data )\r\n"
+			"\t-c <capture file> ( append the raw frames, for replay later )\r\n"
+			"\t-cs <seconds between capture file syncs, 0 = only on exit>, eg: -cs 5\r\n"
+			"\t--replay <capture file>: Play a capture back instead of reading the meter\r\n"
+			"\t--speed <Nx|max>: Replay speed, eg: --speed 10x (default 1x)\r\n"
+			"\t--low-latency: Have the serial driver pass bytes on straight away, reading whole frames\r\n"
+			"\t--no-atlas: Render each reading through TTF rather than the glyph atlas\r\n"
+			"\t--segments: Draw the LCD segments directly, no font needed\r\n"
+			"\t-m <shared memory name>: Publish readings for local readers, eg: -m /bside-adm20\r\n"
+			"\t--stats <file>: Append the latency and link stats as JSON here on SIGUSR1 and at exit (default stderr)\r\n"
+			"\t--status: Show the link health counters under the reading\r\n"
 			"\t-d: debug enabled\r\n"
 			"\t-q: quiet output\r\n"
 			"\t-v: show version\r\n"
@@ -268,6 +265,76 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					}
 					break;
 
+				case 'c':
+					/*
+					 * -c <file> capture every frame we receive
+					 * -cs <seconds> how often to fsync() it
+					 *
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stderr,"Insufficient parameters; -c <capture file> or -cs <seconds>\n");
+						exit(1);
+					}
+					if (argv[i-1][2] == 's') g->capture_sync = atoi(argv[i]);
+					else g->capture_file = argv[i];
+					break;
+
+				case '-':
+					/*
+					 * --replay <capture file> [--speed <Nx|max>]
+					 * --no-atlas
+					 * --segments
+					 * --low-latency
+					 * --stats <file>
+					 * --status
+					 *
+					 */
+					if (!strcmp(argv[i], "--low-latency")) {
+						g->low_latency = 1;
+					} else if (!strcmp(argv[i], "--status")) {
+						g->status = 1;
+					} else if (!strcmp(argv[i], "--stats")) {
+						i++;
+						if (i >= argc) {
+							fprintf(stderr,"Insufficient parameters; --stats <file>\n");
+							exit(1);
+						}
+						g->stats_file = argv[i];
+					} else if (!strcmp(argv[i], "--no-atlas")) {
+						g->no_atlas = 1;
+					} else if (!strcmp(argv[i], "--segments")) {
+						g->segments = 1;
+					} else if (!strcmp(argv[i], "--replay") || !strcmp(argv[i], "--speed")) {
+						i++;
+						if (i >= argc) {
+							fprintf(stderr,"Insufficient parameters; %s requires a value\n", argv[i-1]);
+							exit(1);
+						}
+						if (argv[i-1][2] == 'r') {
+							g->replay_file = argv[i];
+						} else if (adm20_replay_speed(argv[i], &g->replay_speed)) {
+							fprintf(stderr,"Invalid replay speed '%s', expected eg 10x or max\n", argv[i]);
+							exit(1);
+						}
+					}
+					break;
+
+				case 'm':
+					/*
+					 * POSIX shared memory segment to publish every
+					 * reading in to, see adm20-shm.h
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->shm_name = argv[i];
+					} else {
+						fprintf(stderr,"Insufficient parameters; -m <shared memory name>\n");
+						exit(1);
+					}
+					break;
+
 				case 'd': g->debug = 1; break;
 
 				case 'q': g->quiet = 1; break;
@@ -312,7 +379,12 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 
 				case 's':
 							 i++;
-							 g->serial_config = argv[i];
+							 if (i < argc) {
+								 g->serial_config = argv[i];
+							 } else {
+								 fprintf(stderr,"Insufficient parameters; -s <serial port config>\n");
+								 exit(1);
+							 }
 							 break;
 
 				default: break;
@@ -326,46 +398,737 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 
 
 /*
- * Default parameters are 2400:8n1, given that the multimeter
- * is shipped like this and cannot be changed then we shouldn't
- * have to worry about needing to make changes, but we'll probably
- * add that for future changes.
+ * Acquisition
  *
- * 20210804: Duratool D03122 is configured as 9600:8n1, so we now
- * have to add the adjustable serial config facility
+ * The port (or the capture being replayed) is read on a thread of
+ * its own so the window keeps answering while the meter is silent
+ * or unplugged.  Each reading goes in to the fan-out ring and the
+ * render loop is nudged with one SDL user event; while an event is
+ * still waiting to be handled no more are pushed, the render loop
+ * picks up everything that arrived in the meantime when it gets to
+ * it.  The FlexBV file is written from its own thread off the same
+ * ring.
  *
  */
-void open_port(struct serial_params_s *s, char *serial_config ) {
-	int r; 
-
-	s->fd = open( s->device, O_RDWR | O_NOCTTY |O_NDELAY );
-	if (s->fd <0) {
-		perror( s->device );
-	}
-
-	fcntl(s->fd,F_SETFL,0);
-	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings 
-	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
-	cfmakeraw(&(s->newtp));
-	s->newtp.c_cflag = CS8 |  CREAD | CRTSCTS ; // Adjust the settings to suit our BSIDE-ADM20 / 2400-8n1
-	if (strstr(serial_config,"1200")) s->newtp.c_cflag |= B2400;
-	else if (strstr(serial_config,"2400")) s->newtp.c_cflag |= B2400;
-	else if (strstr(serial_config,"4800")) s->newtp.c_cflag |= B4800;
-	else if (strstr(serial_config,"9600")) s->newtp.c_cflag |= B9600;
-
-	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
-	if (r) {
-		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
-		exit(1);
+static struct adm20_fanout fanout;
+static Uint32 reading_event;      // from SDL_RegisterEvents()
+static int reading_pending;       // a reading_event is in the queue
+static struct adm20_latency stages;
+
+/*
+ * SIGUSR1 asks for the latency histograms.  It's blocked everywhere
+ * but the acquisition thread, so it breaks that thread's wait and
+ * gets written out from there.
+ *
+ */
+static volatile sig_atomic_t dump_stats = 0;
+
+static void dump_handler(int sig) {
+	(void)sig;
+	dump_stats = 1;
+}
+
+struct acquisition {
+	struct glb *g;
+	struct adm20_reader reader;
+	struct adm20_capture capture;
+	struct adm20_replay replay;
+	struct adm20_shm *shm;
+	struct adm20_reconnect reconnect; // watching for the port to come back after it's gone
+	struct adm20_health health;   // frame gaps and the kernel's line error counts
+	int stop_fd;                  // eventfd, poked to break the wait on the port
+	int stop;
+};
+
+/*
+ * Wait for the port, or to be told to stop
+ *
+ * Returns 1 when the port has something for adm20_reader_fill()
+ *
+ * While the port's gone this waits for it to come back instead and
+ * always returns 0, the reader is already switched over to the
+ * reopened port by then.
+ *
+ */
+static int acquisition_wait(struct acquisition *a) {
+	struct pollfd pfd[2];
+	int lost = a->reconnect.lost != 0;
+
+	pfd[0].fd = lost ? a->reconnect.ifd : a->reader.fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = a->stop_fd;
+	pfd[1].events = POLLIN;
+
+	if (poll(pfd, 2, lost ? adm20_reconnect_timeout(&a->reconnect) : -1) < 0) return 0;
+	if (pfd[1].revents) return 0;
+
+	if (lost) {
+		if (adm20_reconnect_try(&a->reconnect, &a->g->serial_params) >= 0) {
+			adm20_reader_attach(&a->reader, a->g->serial_params.fd);
+			adm20_health_port(&a->health, a->g->serial_params.fd);
+		}
+		return 0;
+	}
+
+	return pfd[0].revents != 0;
+}
+
+/*
+ * Wait for the next replay record to be due, or to be told to stop
+ *
+ * Returns 1 when it's time for adm20_replay_feed(), which would do
+ * the waiting itself but can't be woken by stop_fd.
+ *
+ */
+static int replay_wait(struct acquisition *a) {
+	struct pollfd pfd;
+	uint64_t due, now;
+
+	pfd.fd = a->stop_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		due = adm20_replay_due(&a->replay);
+		now = adm20_monotonic_ns();
+		if (due <= now) return 1;
+
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (int)((due - now + 999999) / 1000000)) > 0) return 0;
 	}
 }
 
-uint8_t a2h( uint8_t a ) {
-	a -= 0x30;
-	if (a < 10) return a;
-	a -= 7;
-	return a;
+static int acquisition_thread(void *arg) {
+	struct acquisition *a = (struct acquisition *)arg;
+	struct glb *g = a->g;
+	struct adm20_reading reading; // Last decoded reading
+	int dt_loaded = 0;	// set when we have our first valid data
+	const uint8_t *frame;
+	uint64_t t;
+	sigset_t usr1;
+	int i;
+
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+
+	while (!__atomic_load_n(&a->stop, __ATOMIC_ACQUIRE)) {
+
+		if (dump_stats) {
+			dump_stats = 0;
+			adm20_latency_dump(&stages, g->stats_file);
+			adm20_health_poll(&a->health, a->reader.fd, 0);
+			adm20_health_dump(&a->health, &a->reader, g->replay_file ? g->replay_file : g->serial_params.device, g->stats_file);
+		}
+
+		/*
+		 * Time to start receiving the serial block data
+		 *
+		 * Hand out any frame already sitting in the reader's
+		 * ring, otherwise wait on the com port and pull in
+		 * everything it has with one read().  Partial frames
+		 * stay in the ring until the rest turns up.
+		 *
+		 */
+		switch (adm20_reader_next(&a->reader, &frame)) {
+			case ADM20_FRAME_MORE:
+				if (g->replay_file) {
+					if (!replay_wait(a)) continue;
+					if (!adm20_replay_feed(&a->replay, &a->reader)) {
+						SDL_Event e;
+
+						memset(&e, 0, sizeof(e));
+						e.type = SDL_QUIT;
+						SDL_PushEvent(&e);
+						return 0;
+					}
+					continue;
+				}
+
+				t = adm20_monotonic_ns();
+				if (acquisition_wait(a)) {
+					ssize_t got = adm20_reader_fill(&a->reader);
+
+					if (got > 0) adm20_latency_record(&stages, ADM20_STAGE_READ_WAIT, a->reader.fill_time - t);
+					if (got == 0 || (got < 0 && errno != EINTR && errno != EAGAIN)) {
+						/*
+						 * Adapter pulled, tell everyone it's gone
+						 * and wait for it to come back
+						 *
+						 */
+						adm20_health_poll(&a->health, a->reader.fd, 0);
+						adm20_reconnect_lost(&a->reconnect, &g->serial_params, got);
+						a->reader.fd = -1;
+						adm20_reading_disconnected(&reading, a->reconnect.lost);
+						dt_loaded = 0;
+						break;
+					}
+				}
+				continue;
+
+			case ADM20_FRAME_REJECTED:
+				if (a->capture.fd >= 0) adm20_capture_write(&a->capture, a->reader.fill_time, ADM20_CAPTURE_REJECTED, frame, frame ? ADM20_FRAME_SIZE : 0);
+
+				/*
+				 * Noise, a truncated frame or one no meter could
+				 * send (two decimal points, two units lit).  Show
+				 * the previous frame again but flag it as stale so
+				 * nobody mistakes it for a fresh reading.
+				 *
+				 */
+				if (g->debug) { fprintf(stderr,"Rejected %u byte frame [ ok %llu, rejected %llu, discarded %llu bytes ], loading previous frame\r\n", a->reader.frame_len, (unsigned long long)a->reader.frames_ok, (unsigned long long)a->reader.frames_rejected, (unsigned long long)a->reader.bytes_discarded); }
+				if (!dt_loaded) continue;
+				reading.flags |= ADM20_READING_STALE;
+				break;
+
+			case ADM20_FRAME_OK:
+				if (a->capture.fd >= 0) adm20_capture_write(&a->capture, a->reader.fill_time, ADM20_CAPTURE_OK, frame, ADM20_FRAME_SIZE);
+				if (g->debug) {
+					fprintf(stderr,"DATA START: ");
+					for (i = 0; i < DATA_FRAME_SIZE; i++) fprintf(stderr,"%02x ", frame[i]);
+					fprintf(stderr,":END [%d bytes]\r\n", DATA_FRAME_SIZE);
+				}
+				/*
+				 * Replayed frames carry the time they were captured,
+				 * only the stages from here on mean anything then.
+				 *
+				 */
+				t = adm20_monotonic_ns();
+				if (!g->replay_file) adm20_latency_record(&stages, ADM20_STAGE_ASSEMBLY, t - a->reader.fill_time);
+				adm20_decode(frame, a->reader.fill_time, &reading);
+				adm20_latency_record(&stages, ADM20_STAGE_DECODE, adm20_monotonic_ns() - t);
+				adm20_health_frame(&a->health, a->reader.fill_time);
+				adm20_health_poll(&a->health, a->reader.fd, t);
+				dt_loaded = 1;
+				break;
+		}
+
+		t = adm20_monotonic_ns();
+		if (a->shm) {
+			adm20_shm_publish(a->shm, &reading);
+			adm20_latency_record(&stages, ADM20_STAGE_SHM, adm20_monotonic_ns() - t);
+			t = adm20_monotonic_ns();
+		}
+		adm20_fanout_publish(&fanout, &reading);
+		adm20_latency_record(&stages, ADM20_STAGE_FANOUT, adm20_monotonic_ns() - t);
+
+		if (!__atomic_exchange_n(&reading_pending, 1, __ATOMIC_ACQ_REL)) {
+			SDL_Event e;
+
+			memset(&e, 0, sizeof(e));
+			e.type = reading_event;
+			SDL_PushEvent(&e);
+		}
+	}
+
+	return 0;
 }
+
+/*
+ * FlexBV only ever wants the newest reading, so everything queued
+ * up behind it is skipped and only the last one is considered.
+ *
+ */
+struct flexbv_consumer {
+	struct adm20_fanout_cursor cursor;
+	struct glb *g;
+	struct adm20_handoff *handoff;
+};
+
+static int flexbv_thread(void *arg) {
+	struct flexbv_consumer *c = (struct flexbv_consumer *)arg;
+	struct adm20_handoff *h = c->handoff;
+	struct adm20_reading r, latest;
+	char logline[SSIZE];
+	int w, have = 0;
+
+	do {
+		w = adm20_fanout_wait(&c->cursor, h->ifd, -1);
+		while (adm20_fanout_next(&c->cursor, &r)) {
+			/*
+			 * Never hand FlexBV a stale reading
+			 *
+			 */
+			if (!(r.flags & ADM20_READING_STALE)) { latest = r; have = 1; }
+		}
+
+		if ((w & ADM20_FANOUT_FD) && adm20_handoff_check(h) && c->g->debug) {
+			fprintf(stderr,"FlexBV took its reading after %.1f ms, %.1f ms old\r\n", h->wait_last / 1e6, h->age_last / 1e6);
+		}
+
+		if (have && h->want) {
+			adm20_reading_format(&latest, logline, sizeof(logline), ADM20_FORMAT_LOG);
+			if (adm20_handoff_publish(h, logline, latest.timestamp) > 0 && !c->g->replay_file) {
+				adm20_latency_record(&stages, ADM20_STAGE_FLEXBV, adm20_monotonic_ns() - latest.timestamp);
+			}
+		}
+	} while (!(w & ADM20_FANOUT_CLOSED));
+
+	return 0;
+}
+
+/*
+ * Reading to pixel latency, from read() returning the frame to
+ * SDL_RenderPresent() returning with it on screen
+ *
+ */
+struct latency {
+	uint64_t count;
+	uint64_t total, max;
+	uint64_t draws, draw_total;  // time spent in render_line() itself
+};
+
+/*
+ * Link health line, --status only
+ *
+ * A strip along the bottom of the window under the reading.  It's
+ * rendered through TTF in to a texture of its own only when the
+ * text changes, which is only when something's going wrong on the
+ * link, and copied back in on every present since the back buffer
+ * doesn't keep it.
+ *
+ */
+struct status_line {
+	TTF_Font *font;
+	SDL_Texture *texture;
+	SDL_Rect strip;      // the part of the window it owns
+	int w, h;            // of the text in the texture
+	char text[SSIZE];    // as it's showing
+};
+
+static struct status_line status;
+
+static void present(SDL_Renderer *renderer) {
+	if (status.font) {
+		Uint8 r, g, b, a;
+
+		SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
+		SDL_SetRenderDrawColor(renderer, glbs->background_color.r, glbs->background_color.g, glbs->background_color.b, 255);
+		SDL_RenderFillRect(renderer, &status.strip);
+		SDL_SetRenderDrawColor(renderer, r, g, b, a);
+		if (status.texture) {
+			SDL_Rect dst = { status.strip.x +4, status.strip.y, status.w, status.h };
+			SDL_RenderCopy(renderer, status.texture, NULL, &dst);
+		}
+	}
+	SDL_RenderPresent(renderer);
+}
+
+/*
+ * Returns 1 if the text changed and the window wants a full redraw
+ * to show it
+ *
+ */
+static int status_update(SDL_Renderer *renderer, const char *text, SDL_Color fg, SDL_Color bg) {
+	SDL_Surface *surface;
+
+	if (!status.font || !strcmp(text, status.text)) return 0;
+	snprintf(status.text, sizeof(status.text), "%s", text);
+
+	if (status.texture) SDL_DestroyTexture(status.texture);
+	status.texture = NULL;
+	surface = TTF_RenderUTF8_Shaded(status.font, text, fg, bg);
+	if (!surface) return 1;
+	status.texture = SDL_CreateTextureFromSurface(renderer, surface);
+	status.w = surface->w;
+	status.h = surface->h;
+	SDL_FreeSurface(surface);
+
+	return 1;
+}
+
+/*
+ * Glyph atlas
+ *
+ * Every character the display line can contain is rasterised once
+ * at startup in to a single texture, after which drawing a reading
+ * is one SDL_RenderCopy() per character rather than a TTF render,
+ * a texture upload and two frees.  The set is everything the
+ * segment table, the SI prefixes and the units can produce, plus
+ * the decimal point and the stale marker.
+ *
+ */
+#define ATLAS_GLYPHS 64
+#define ATLAS_CODEPOINTS 0x400   // covers the Latin-1 and Greek we use
+
+struct glyph_atlas {
+	SDL_Texture *texture;
+	int count;
+	int height;
+	int cell;                       // width of the widest glyph, every cell is this wide
+	SDL_Rect glyph[ATLAS_GLYPHS];   // where each one sits in the texture
+	int8_t index[ATLAS_CODEPOINTS]; // codepoint to glyph, -1 if we don't have it
+};
+
+/*-----------------------------------------------------------------\
+  Function Name	: atlas_build
+  Returns Type	: int
+  ----Parameter List
+  1. SDL_Renderer *renderer,
+  2. TTF_Font *font,
+  3. SDL_Color color,
+  4. struct glyph_atlas *a,
+  ------------------
+  Exit Codes	: 0 on success, -1 if the caller should fall back to TTF per frame
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Glyphs are laid out in a single row, the whole set is only a
+	few dozen characters wide.
+
+\------------------------------------------------------------------*/
+static int atlas_build(SDL_Renderer *renderer, TTF_Font *font, SDL_Color color, struct glyph_atlas *a) {
+	char chars[SSIZE];
+	const char *p;
+	SDL_Surface *glyph[ATLAS_GLYPHS];
+	SDL_Surface *sheet;
+	int i, x, width = 0;
+	size_t n;
+
+	memset(a, 0, sizeof(*a));
+	memset(a->index, -1, sizeof(a->index));
+
+	/*
+	 * Gather the character set, duplicates are dropped below
+	 *
+	 */
+	n = 0;
+	for (i = 0; i < 128; i++) {
+		if (adm20_segments.s[i].glyph && n < sizeof(chars) -1) chars[n++] = adm20_segments.s[i].glyph;
+	}
+	chars[n] = '\0';
+	strncat(chars, ".?", sizeof(chars) - strlen(chars) -1);
+	for (i = 0; i <= ADM20_PREFIX_MEGA; i++) strncat(chars, adm20_prefix_text[i], sizeof(chars) - strlen(chars) -1);
+	for (i = 0; i <= ADM20_UNIT_DEGF; i++) strncat(chars, adm20_unit_text[i], sizeof(chars) - strlen(chars) -1);
+
+	for (p = chars; *p; ) {
+		char one[5];
+		const char *start = p;
+		uint32_t c = adm20_utf8_next(&p);
+
+		if (c >= ATLAS_CODEPOINTS || a->index[c] >= 0 || a->count >= ATLAS_GLYPHS) continue;
+
+		snprintf(one, sizeof(one), "%.*s", (int)(p - start), start);
+		glyph[a->count] = TTF_RenderUTF8_Solid(font, one, color);
+		if (!glyph[a->count]) {
+			fprintf(stderr,"%s:%d: Unable to render '%s' for the glyph atlas (%s)\r\n", FL, one, SDL_GetError());
+			for (i = 0; i < a->count; i++) SDL_FreeSurface(glyph[i]);
+			return -1;
+		}
+		a->index[c] = a->count;
+		width += glyph[a->count]->w;
+		if (glyph[a->count]->h > a->height) a->height = glyph[a->count]->h;
+		a->count++;
+	}
+
+	sheet = SDL_CreateRGBSurfaceWithFormat(0, width, a->height, 32, SDL_PIXELFORMAT_RGBA32);
+	if (sheet) {
+		for (i = 0, x = 0; i < a->count; i++) {
+			SDL_Rect r = { x, 0, glyph[i]->w, glyph[i]->h };
+
+			SDL_BlitSurface(glyph[i], NULL, sheet, &r);
+			a->glyph[i] = r;
+			x += glyph[i]->w;
+		}
+		a->texture = SDL_CreateTextureFromSurface(renderer, sheet);
+		SDL_FreeSurface(sheet);
+	}
+	for (i = 0; i < a->count; i++) SDL_FreeSurface(glyph[i]);
+
+	if (!a->texture) {
+		fprintf(stderr,"%s:%d: Unable to create the glyph atlas (%s)\r\n", FL, SDL_GetError());
+		return -1;
+	}
+	SDL_SetTextureBlendMode(a->texture, SDL_BLENDMODE_BLEND);
+
+	for (i = 0; i < a->count; i++) if (a->glyph[i].w > a->cell) a->cell = a->glyph[i].w;
+
+	return 0;
+}
+
+/*
+ * One cell, background first so whatever was there goes
+ *
+ */
+static void atlas_draw_cell(SDL_Renderer *renderer, struct glyph_atlas *a, int x, int y, uint32_t c) {
+	int i = c < ATLAS_CODEPOINTS ? a->index[c] : -1;
+	SDL_Rect cell = { x, y, a->cell, a->height };
+
+	SDL_RenderFillRect(renderer, &cell);
+	if (i < 0 || c == ' ') return;
+
+	SDL_Rect dst = { x, y, a->glyph[i].w, a->glyph[i].h };
+	SDL_RenderCopy(renderer, a->texture, &a->glyph[i], &dst);
+}
+
+static void atlas_free(struct glyph_atlas *a) {
+	if (a->texture) SDL_DestroyTexture(a->texture);
+	a->texture = NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: render_line
+  Returns Type	: int
+  ----Parameter List
+  1. SDL_Renderer *renderer,
+  2. TTF_Font *font, for when there's no atlas
+  3. struct glyph_atlas *atlas, NULL to render through TTF
+  4. SDL_Texture *canvas, what's on screen, kept between frames
+  5. struct glb *g,
+  6. struct adm20_display *screen, cells last drawn
+  7. const char *line,
+  ------------------
+  Exit Codes	: 1 if something was presented, 0 if the screen was already right
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	The back buffer isn't kept across SDL_RenderPresent(), so the
+	changed cells are drawn in to the canvas texture and the whole
+	canvas copied out.  Without an atlas and canvas a changed line
+	is drawn in full the old way.
+
+\------------------------------------------------------------------*/
+static int render_line(SDL_Renderer *renderer, TTF_Font *font, struct glyph_atlas *atlas, SDL_Texture *canvas, struct glb *g, struct adm20_display *screen, const char *line) {
+	uint64_t dirty = adm20_display_update(screen, line);
+	int i;
+
+	if (!dirty) return 0;
+
+	if (atlas && canvas) {
+		SDL_SetRenderTarget(renderer, canvas);
+		for (i = 0; i < screen->count; i++) {
+			if (dirty & (1ULL << i)) atlas_draw_cell(renderer, atlas, i *atlas->cell, 0, screen->cell[i]);
+		}
+		SDL_SetRenderTarget(renderer, NULL);
+		SDL_Rect dst = { 0, 0, g->window_width, g->window_height };
+		SDL_RenderCopy(renderer, canvas, NULL, &dst);
+	} else {
+		SDL_Surface *surface;
+		SDL_Texture *texture;
+		int texW = 0;
+		int texH = 0;
+
+		SDL_RenderClear(renderer);
+		surface = TTF_RenderUTF8_Solid(font, line, g->font_color);
+		texture = SDL_CreateTextureFromSurface(renderer, surface);
+
+		SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
+		SDL_Rect dstrect = { 0, 0, texW, texH };
+		SDL_RenderCopy(renderer, texture, NULL, &dstrect);
+		SDL_DestroyTexture(texture);
+		SDL_FreeSurface(surface);
+	}
+
+	present(renderer);
+
+	return 1;
+}
+
+
+/*
+ * Seven segment renderer
+ *
+ * Draws the LCD straight from the segment bits in the frame, so any
+ * pattern the meter shows (dashes, "OL", "Err", letters the decode
+ * table doesn't know) comes out exactly as it is on the meter.  The
+ * digits are filled rectangles, the prefix and unit a few strokes
+ * each, so there's no font to load and it scales with the window.
+ *
+ * Segment bits, from the decode table: a 0x01, b 0x02, c 0x04,
+ * d 0x08, f 0x10, g 0x20, e 0x40, and the decimal point in 0x80
+ * sits in front of its digit.
+ *
+ */
+#define SEG_A 0x01
+#define SEG_B 0x02
+#define SEG_C 0x04
+#define SEG_D 0x08
+#define SEG_F 0x10
+#define SEG_G 0x20
+#define SEG_E 0x40
+
+struct seg_layout {
+	int x, y;       // top left of the first digit
+	int dh, dw;     // digit height and width
+	int t;          // segment thickness
+	int pitch;      // digit to digit, with room for the point
+	int signw;      // space in front for the minus
+	int u;          // stroke font grid unit, characters are 4 x 8 of them
+};
+
+/*
+ * Everything is in proportion to the digit height, which is the
+ * largest that fits both ways.
+ *
+ */
+static void seg_layout_calc(int w, int h, struct seg_layout *l) {
+	int margin = h /10;
+	int dh = h - 2 *margin;
+	int fit = (w - 2 *margin) *100 /440; // whole line is about 4.4 digit heights wide
+
+	if (fit < dh) dh = fit;
+	if (dh < 16) dh = 16;
+
+	l->dh = dh;
+	l->dw = dh /2;
+	l->t = dh /10 > 1 ? dh /10 : 1;
+	l->pitch = l->dw *13 /10;
+	l->signw = l->dw *7 /10;
+	l->u = dh *45 /100 /8 > 1 ? dh *45 /100 /8 : 1;
+	l->x = margin + l->signw;
+	l->y = (h - dh) /2;
+}
+
+static void seg_draw_digit(SDL_Renderer *renderer, const struct seg_layout *l, int x, uint8_t bits, SDL_Color on, SDL_Color off) {
+	int t = l->t, w = l->dw, h = l->dh, y = l->y;
+	int half = h /2;
+	const SDL_Rect seg[7] = {
+		{ x + t, y, w - 2 *t, t },                       // a
+		{ x + w - t, y + t, t, half - t - t /2 },        // b
+		{ x + w - t, y + half + t /2, t, half - t - t /2 }, // c
+		{ x + t, y + h - t, w - 2 *t, t },               // d
+		{ x, y + t, t, half - t - t /2 },                // f
+		{ x + t, y + half - t /2, w - 2 *t, t },         // g
+		{ x, y + half + t /2, t, half - t - t /2 },      // e
+	};
+	SDL_Rect lit[7], unlit[7];
+	int i, n_lit = 0, n_unlit = 0;
+
+	for (i = 0; i < 7; i++) {
+		if (bits & (1 << i)) lit[n_lit++] = seg[i];
+		else unlit[n_unlit++] = seg[i];
+	}
+
+	SDL_SetRenderDrawColor(renderer, off.r, off.g, off.b, 255);
+	SDL_RenderFillRects(renderer, unlit, n_unlit);
+	SDL_SetRenderDrawColor(renderer, on.r, on.g, on.b, 255);
+	SDL_RenderFillRects(renderer, lit, n_lit);
+}
+
+/*
+ * Stroke font for the prefixes, units and the stale marker, on a
+ * 4 wide by 8 high grid with the baseline at 8.
+ *
+ */
+struct stroke_glyph {
+	uint32_t c;
+	int n;
+	int8_t s[10][4];
+};
+
+static const struct stroke_glyph strokes[] = {
+	{ 'V', 2, { {0,0,2,8}, {2,8,4,0} } },
+	{ 'A', 3, { {0,8,2,0}, {2,0,4,8}, {1,5,3,5} } },
+	{ 'F', 3, { {0,0,0,8}, {0,0,4,0}, {0,4,3,4} } },
+	{ 'H', 3, { {0,0,0,8}, {4,0,4,8}, {0,4,4,4} } },
+	{ 'z', 3, { {0,4,4,4}, {4,4,0,8}, {0,8,4,8} } },
+	{ 'C', 3, { {4,0,0,0}, {0,0,0,8}, {0,8,4,8} } },
+	{ 'n', 3, { {0,4,0,8}, {0,4,4,4}, {4,4,4,8} } },
+	{ 'm', 4, { {0,4,0,8}, {0,4,4,4}, {2,4,2,8}, {4,4,4,8} } },
+	{ 'k', 3, { {0,0,0,8}, {0,6,3,3}, {1,5,4,8} } },
+	{ 'M', 4, { {0,8,0,0}, {0,0,2,4}, {2,4,4,0}, {4,0,4,8} } },
+	{ 0x00B5, 3, { {0,4,0,10}, {0,8,4,8}, {4,4,4,8} } },   // micro
+	{ 0x00B0, 4, { {0,0,2,0}, {2,0,2,2}, {2,2,0,2}, {0,2,0,0} } }, // degree
+	{ 0x03A9, 9, { {0,8,1,8}, {1,8,0,5}, {0,5,0,2}, {0,2,1,0}, {1,0,3,0}, {3,0,4,2}, {4,2,4,5}, {4,5,3,8}, {3,8,4,8} } }, // ohm
+	{ '?', 7, { {0,1,1,0}, {1,0,3,0}, {3,0,4,1}, {4,1,4,3}, {4,3,2,5}, {2,5,2,6}, {2,8,2,8} } },
+};
+
+/*
+ * Draws c at x, baseline at y, returns the advance
+ *
+ */
+static int stroke_char(SDL_Renderer *renderer, int x, int y, int u, int t, uint32_t c) {
+	size_t i;
+	int k, dx, dy;
+
+	for (i = 0; i < sizeof(strokes) / sizeof(strokes[0]); i++) {
+		if (strokes[i].c != c) continue;
+		for (k = 0; k < strokes[i].n; k++) {
+			const int8_t *s = strokes[i].s[k];
+
+			// thickened by drawing it t x t times over
+			for (dx = 0; dx < t; dx++) for (dy = 0; dy < t; dy++) {
+				SDL_RenderDrawLine(renderer, x + s[0] *u + dx, y + (s[1] - 8) *u + dy, x + s[2] *u + dx, y + (s[3] - 8) *u + dy);
+			}
+		}
+		break;
+	}
+
+	return c == ' ' ? 0 : 6 *u;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: render_segments
+  Returns Type	: int
+  ----Parameter List
+  1. SDL_Renderer *renderer,
+  2. struct glb *g,
+  3. const struct seg_layout *l,
+  4. struct adm20_display *screen, what's on screen
+  5. const struct adm20_reading *r,
+  ------------------
+  Exit Codes	: 1 if something was presented, 0 if the screen was already right
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	The change check is on the raw segment bytes, two patterns the
+	decode table doesn't know would both format as a blank.  Any
+	change redraws the lot, it's only a few dozen rectangles.
+	Unlit segments are drawn faintly like a real LCD.
+
+\------------------------------------------------------------------*/
+static int render_segments(SDL_Renderer *renderer, struct glb *g, const struct seg_layout *l, struct adm20_display *screen, const struct adm20_reading *r) {
+	SDL_Color on = g->font_color, bg = g->background_color, off;
+	char key[64];
+	const char *p;
+	int i, x, t;
+
+	snprintf(key, sizeof(key), "%02x%02x%02x%02x%02x%u%u", r->segments[0], r->segments[1], r->segments[2], r->segments[3], r->flags & (ADM20_READING_NEGATIVE | ADM20_READING_STALE), r->prefix, r->unit);
+	if (!adm20_display_update(screen, key)) return 0;
+
+	off.r = bg.r + (on.r - bg.r) /8;
+	off.g = bg.g + (on.g - bg.g) /8;
+	off.b = bg.b + (on.b - bg.b) /8;
+	off.a = 255;
+
+	SDL_SetRenderDrawColor(renderer, bg.r, bg.g, bg.b, 255);
+	SDL_RenderClear(renderer);
+
+	if (r->flags & ADM20_READING_NEGATIVE) {
+		SDL_Rect minus = { l->x - l->signw, l->y + l->dh /2 - l->t /2, l->signw *3 /4, l->t };
+
+		SDL_SetRenderDrawColor(renderer, on.r, on.g, on.b, 255);
+		SDL_RenderFillRect(renderer, &minus);
+	}
+
+	for (i = 0, x = l->x; i < 4; i++, x += l->pitch) {
+		seg_draw_digit(renderer, l, x, r->segments[i] & ADM20_SEGMENT_MASK, on, off);
+
+		if (i > 0 && (r->segments[i] & ADM20_SEGMENT_DP)) {
+			SDL_Rect dp = { x - (l->pitch - l->dw) /2 - l->t /2, l->y + l->dh - l->t, l->t, l->t };
+
+			SDL_SetRenderDrawColor(renderer, on.r, on.g, on.b, 255);
+			SDL_RenderFillRect(renderer, &dp);
+		}
+	}
+
+	/*
+	 * Prefix, unit and the stale marker, along the baseline
+	 *
+	 */
+	SDL_SetRenderDrawColor(renderer, on.r, on.g, on.b, 255);
+	t = l->t /2 > 1 ? l->t /2 : 1;
+	x += l->dw /3;
+	for (p = adm20_prefix_text[r->prefix]; *p; ) x += stroke_char(renderer, x, l->y + l->dh - t, l->u, t, adm20_utf8_next(&p));
+	for (p = adm20_unit_text[r->unit]; *p; ) x += stroke_char(renderer, x, l->y + l->dh - t, l->u, t, adm20_utf8_next(&p));
+	if (r->flags & ADM20_READING_STALE) stroke_char(renderer, x, l->y + l->dh - t, l->u, t, '?');
+
+	SDL_SetRenderDrawColor(renderer, bg.r, bg.g, bg.b, 255);
+	present(renderer);
+
+	return 1;
+}
+
+
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220307
   Function Name	: main
@@ -386,22 +1149,22 @@ Changes:
 int main ( int argc, char **argv ) {
 
 	SDL_Event event;
-	SDL_Surface *surface;
-	SDL_Texture *texture;
 
 	char linetmp[SSIZE]; // temporary string for building main line of text
-	char prefix[SSIZE]; // Units prefix u, m, k, M etc
-	char units[SSIZE];  // Measurement units F, V, A, R
-	char mmmode[SSIZE]; // Multimeter mode, Resistance/diode/cap etc
-
-	uint8_t d[SSIZE];
-	uint8_t dt[SSIZE];      // Serial data packet
-	int dt_loaded = 0;	// set when we have our first valid data
-	uint8_t dps = 0;     // Number of decimal places
+	char line1[SSIZE];
+
+	struct adm20_reading reading; // Last reading drawn
+	struct acquisition acq;  // Port, capture and replay, owned by the acquisition thread
+	struct adm20_handoff handoff; // FlexBV output file, if -o was given
+	struct adm20_fanout_cursor display; // Our place in the fan-out ring
+	struct flexbv_consumer flexbv; // FlexBV file writer, if -o was given
+	struct latency latency;
+	struct glyph_atlas atlas, *glyphs = NULL; // Pre-rendered characters, unless --no-atlas
+	SDL_Texture *canvas = NULL; // What's on screen, only the changes get drawn in to it
+	struct adm20_display screen; // Cells currently showing
+	struct seg_layout layout;    // Where the segments go, --segments only
+	SDL_Thread *acq_thread, *flexbv_thread_id = NULL;
 	struct glb g;        // Global structure for passing variables around
-	int i = 0;           // Generic counter
-	char temp_char;        // Temporary character
-	char tfn[4096];
 	bool quit = false;
 
 	glbs = &g;
@@ -423,12 +1186,58 @@ int main ( int argc, char **argv ) {
 	if (g.font_size < 10) g.font_size = 10;
 	if (g.font_size > 200) g.font_size = 200;
 
-	if (g.output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g.output_file);
+	memset(&acq, 0, sizeof(acq));
+	acq.g = &g;
+	acq.stop_fd = -1;
+	adm20_reconnect_init(&acq.reconnect);
+
+	if (adm20_handoff_open(&handoff, g.output_file)) exit(1);
+	if (g.shm_name && !(acq.shm = adm20_shm_create(g.shm_name))) exit(1);
+
+	/*
+	 * Handle the COM Port, or the capture standing in for it
+	 */
+	if (g.replay_file) {
+		if (adm20_replay_open(&acq.replay, g.replay_file, g.replay_speed)) exit(1);
+		adm20_reader_init(&acq.reader, -1);
+	} else if (!g.serial_params.device) {
+		if (adm20_detect_port(&g.serial_params, g.serial_config, &acq.reader, g.debug) < 0) exit(1);
+	} else {
+		if (adm20_open_port(&g.serial_params, g.serial_config) < 0) exit(1);
+		adm20_reader_init(&acq.reader, g.serial_params.fd);
+	}
+	if (g.low_latency && g.serial_params.fd >= 0) adm20_serial_low_latency(&g.serial_params, ADM20_LATENCY_DRIVER | ADM20_LATENCY_WHOLE_FRAMES);
+	adm20_health_init(&acq.health);
+	adm20_health_port(&acq.health, g.serial_params.fd);
+
+	acq.capture.fd = -1;
+	if (g.capture_file && adm20_capture_open(&acq.capture, g.capture_file, g.capture_sync)) exit(1);
+
+	acq.stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (acq.stop_fd < 0) {
+		fprintf(stderr,"%s:%d: Unable to create eventfd (%s)\r\n", FL, strerror(errno));
+		exit(1);
+	}
 
 	/*
-	 * Handle the COM Port
+	 * SIGUSR1 is blocked before SDL or any of our threads start so
+	 * they all inherit it blocked, the acquisition thread unblocks
+	 * it for itself.  No SA_RESTART, so its poll() returns.
+	 *
 	 */
-	open_port(&g.serial_params, g.serial_config);
+	{
+		struct sigaction sa;
+		sigset_t usr1;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = dump_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR1, &sa, NULL);
+		sigemptyset(&usr1);
+		sigaddset(&usr1, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+	}
+	adm20_latency_init(&stages);
 
 	/*
 	 * Setup SDL2 and fonts
@@ -437,265 +1246,314 @@ int main ( int argc, char **argv ) {
 
 	SDL_Init(SDL_INIT_VIDEO);
 	TTF_Init();
-	TTF_Font *font = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size);
+	TTF_Font *font = NULL;
+
+	/*
+	 * Without the font we can still draw the segments
+	 *
+	 */
+	if (!g.segments) {
+		font = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size);
+		if (!font) {
+			fprintf(stderr,"Error trying to open font :( falling back to drawing segments\r\n");
+			g.segments = 1;
+		}
+	}
 
 	/*
 	 * Get the required window size.
 	 *
-	 * Parameters passed can override the font self-detect sizing
+	 * Parameters passed can override the font self-detect sizing,
+	 * the segments are sized off the font size all the same.
 	 *
 	 */
-	TTF_SizeText(font, "-12.34mV  ", &g.window_width, &g.window_height);
+	if (font) {
+		TTF_SizeText(font, "-12.34mV  ", &g.window_width, &g.window_height);
+	} else {
+		g.window_height = g.font_size *125 /100;
+		g.window_width = g.font_size *47 /10;
+	}
 	if (g.wx_forced) g.window_width = g.wx_forced;
 	if (g.wy_forced) g.window_height = g.wy_forced;
 
-	SDL_Window *window = SDL_CreateWindow("BSIDE ADM20", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, 0);
-	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
-	if (!font) {
-		fprintf(stderr,"Error trying to open font :( \r\n");
-		exit(1);
+	/*
+	 * The status line goes on below all that, in a font small
+	 * enough to keep the whole line in about the same width.
+	 *
+	 */
+	memset(&status, 0, sizeof(status));
+	if (g.status) {
+		status.font = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size /6 < 10 ? 10 : g.font_size /6);
+		if (status.font) {
+			status.strip.y = g.window_height;
+			status.strip.w = g.window_width;
+			status.strip.h = TTF_FontLineSkip(status.font);
+		} else {
+			fprintf(stderr,"Error trying to open font for the status line, carrying on without it\r\n");
+		}
 	}
 
+	SDL_Window *window = SDL_CreateWindow("BSIDE ADM20", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height + status.strip.h, g.segments ? SDL_WINDOW_RESIZABLE : 0);
+	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
+
 	/* Select the color for drawing. It is set to red here. */
 	SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255 );
 
 	/* Clear the entire screen to our selected color. */
 	SDL_RenderClear(renderer);
+	SDL_RenderPresent(renderer);
 
 	//SDL_Color color = { 55, 255, 55 };
 
+	if (font && !g.no_atlas && !atlas_build(renderer, font, g.font_color, &atlas)) glyphs = &atlas;
+	seg_layout_calc(g.window_width, g.window_height, &layout);
+	if (glyphs) {
+		canvas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, g.window_width, g.window_height);
+		if (canvas) {
+			SDL_SetRenderTarget(renderer, canvas);
+			SDL_RenderClear(renderer);
+			SDL_SetRenderTarget(renderer, NULL);
+		}
+	}
+	adm20_display_init(&screen);
+
+	reading_event = SDL_RegisterEvents(1);
+	if (reading_event == (Uint32)-1) {
+		fprintf(stderr,"%s:%d: Unable to register the reading event (%s)\r\n", FL, SDL_GetError());
+		exit(1);
+	}
+
+	/*
+	 * Everyone subscribes before the acquisition thread starts
+	 * publishing.
+	 *
+	 */
+	adm20_fanout_init(&fanout);
+	if (adm20_fanout_subscribe(&fanout, &display, "display")) exit(1);
+	if (handoff.ifd >= 0) {
+		flexbv.g = &g;
+		flexbv.handoff = &handoff;
+		if (adm20_fanout_subscribe(&fanout, &flexbv.cursor, "FlexBV")) exit(1);
+		flexbv_thread_id = SDL_CreateThread(flexbv_thread, "flexbv", &flexbv);
+	}
+
+	acq_thread = SDL_CreateThread(acquisition_thread, "acquisition", &acq);
+	if (!acq_thread || (handoff.ifd >= 0 && !flexbv_thread_id)) {
+		fprintf(stderr,"%s:%d: Unable to start threads (%s)\r\n", FL, SDL_GetError());
+		exit(1);
+	}
+
+	memset(&latency, 0, sizeof(latency));
+	line1[0] = '\0';
 
 	/*
 	 *
-	 * Parent will terminate us... else we'll become a zombie
-	 * and hope that the almighty PID 1 will reap us
+	 * Sleep in SDL_WaitEvent() until there's either something from
+	 * the user or a new reading to show.
 	 *
 	 */
-	while (!quit) {
-		char line1[1024];
-		char logline[1024];
-		char *p, *q;
-		double v = 0.0;
-		int end_of_frame_received = 0;
-		ssize_t bytes_read = 0;
-
-		while (SDL_PollEvent(&event)) {
-			switch (event.type)
-			{
-				case SDL_KEYDOWN:
-					switch( event.key.keysym.sym ){
-						case SDLK_q:
-							quit = true;
-							break;
-					}
+	while (!quit && SDL_WaitEvent(&event)) {
+		struct adm20_reading r;
+		int fresh = 0;
 
-				case SDL_QUIT:
-					quit = true;
-					break;
-			}
-		}
+		switch (event.type)
+		{
+			case SDL_KEYDOWN:
+				switch( event.key.keysym.sym ){
+					case SDLK_q:
+						quit = true;
+						break;
+				}
 
-		linetmp[0] = '\0';
+			case SDL_QUIT:
+				quit = true;
+				break;
 
-		/*
-		 * Time to start receiving the serial block data
-		 *
-		 * We initially "stage" here waiting for there to
-		 * be something happening on the com port.  Soon as
-		 * something happens, then we move forward to trying
-		 * to read the data.
-		 *
-		 */
+			case SDL_WINDOWEVENT:
+				if (!line1[0]) break;
 
-		if (g.debug) { fprintf(stderr,"DATA START: "); }
-		end_of_frame_received = 0;
-		i = 0;
-		do {
-			unsigned char temp_char;
-			bytes_read = read(g.serial_params.fd, &temp_char, 1);
-			if (bytes_read) {
-				d[i] = temp_char;
-				if (g.debug) { fprintf(stderr,"%02x ", d[i]); }
-				//if (g.debug) { fprintf(stderr,"%02x ", d[i] >> 4); }
-
-				i++;
-
-				if (temp_char == 0x55) {
-					end_of_frame_received = 1;
+				if (g.segments) {
+					if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+						status.strip.y = event.window.data2 - status.strip.h;
+						status.strip.w = event.window.data1;
+						seg_layout_calc(event.window.data1, event.window.data2 - status.strip.h, &layout);
+					}
+					if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED || event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+						adm20_display_invalidate(&screen);
+						render_segments(renderer, &g, &layout, &screen, &reading);
+					}
 					break;
 				}
-			}
-		} while ((bytes_read > 0) && (i < sizeof(d)) && (!end_of_frame_received));
-
-		if (g.debug) { fprintf(stderr,":END [%d bytes]\r\n", i); }
 
-		/*
-		 * Validate the received data
-		 *
-		 */
-		if (i != DATA_FRAME_SIZE) {
-			if (g.debug) { fprintf(stderr,"Invalid number of bytes, expected %d, received %d, loading previous frame\r\n", DATA_FRAME_SIZE, i); }
-			if (dt_loaded) memcpy(d, dt, sizeof(d));
-		} else {
-			memcpy(dt, d, sizeof(d)); // make a copy.
-			dt_loaded = 1;
+				/*
+				 * The canvas still has everything, it just
+				 * needs putting back on screen.
+				 *
+				 */
+				if (event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+					if (canvas) {
+						SDL_Rect dst = { 0, 0, g.window_width, g.window_height };
+
+						SDL_RenderCopy(renderer, canvas, NULL, &dst);
+						present(renderer);
+					} else {
+						adm20_display_invalidate(&screen);
+						render_line(renderer, font, glyphs, canvas, &g, &screen, line1);
+					}
+				}
+				break;
 		}
 
-		/*
-		 * Initialise the strings used for units, prefix and mode
-		 * so we don't end up with uncleared prefixes etc
-		 * ( see https://www.youtube.com/watch?v=5HUyEykicEQ )
-		 *
-		 * Prefix string initialised to single space, prevents 
-		 * annoying string width jump (on monospace, can't stop
-		 * it with variable width strings unless we draw the 
-		 * prefix+units separately in a fixed location
-		 *
-		 */
-		snprintf(prefix, sizeof(prefix), " ");
-		units[0] = '\0';
-		mmmode[0] = '\0';
+		if (event.type != reading_event) continue;
 
 		/*
-		 * Decode our data.
-		 *
-		 * While the data sheet gives a very nice matrix for the RANGE and FUNCTION values
-		 * it's probably more human-readable to break it down in to longer code on a per
-		 * function selection.
-		 *
-		 * linetmp : contains the value we want show
-		 * mmode   : contains the meter mode (resistance, volts, amps etc)
-		 *  L"\u00B0C" = 'C
-		 *  L"\u00B0F" = 'F
-		 *  L"\u2126"  = ohms char
-		 *  L"\u00B5"  = mu char (micro)
+		 * Clear the pending flag before draining so a reading that
+		 * lands while we're drawing gets an event of its own.
 		 *
 		 */
+		__atomic_store_n(&reading_pending, 0, __ATOMIC_RELEASE);
+		while (adm20_fanout_next(&display, &r)) { reading = r; fresh = 1; }
+		if (!fresh) continue;
 
+		adm20_reading_format(&reading, linetmp, sizeof(linetmp), ADM20_FORMAT_DISPLAY);
+		snprintf(line1, sizeof(line1), "%-40s", linetmp);
+		//		snprintf(line2, sizeof(line2), "%-40s", mmmode);
+		//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
 
-		if (d[16] & 0x80) snprintf(mmmode,sizeof(mmmode),"REL");
-		if (d[16] & 0x20) snprintf(mmmode,sizeof(mmmode),"AUTO");
-
-		if (d[17] & 0x40) snprintf(mmmode,sizeof(mmmode),"hFE");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"%%");
-		if (d[17] & 0x08) snprintf(mmmode,sizeof(mmmode),"MIN");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"min-max");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"MAX");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"USB");
+		if (!g.quiet) fprintf(stderr,"%s\r",line1); fflush(stderr);
 
-		if (d[18] & 0x80) snprintf(units,sizeof(units),"F");
-		if (d[18] & 0x40) snprintf(prefix,sizeof(prefix),"n");
-		if (d[18] & 0x20) snprintf(prefix,sizeof(prefix),"%s",uu);
-		if (d[18] & 0x02) snprintf(units,sizeof(units),"%sF",dd);
-		if (d[18] & 0x01) snprintf(units,sizeof(units),"%sC",dd);
+		/*
+		 * The counters belong to the acquisition thread, they're
+		 * only read here and a torn one just shows for a reading.
+		 *
+		 */
+		if (status.font) {
+			char text[SSIZE];
 
-		if (d[19] & 0x80) snprintf(units,sizeof(units),"Hz");
-		if (d[19] & 0x40) snprintf(units,sizeof(units),"%s",oo);
-		if (d[19] & 0x20) snprintf(prefix,sizeof(prefix),"k");
-		if (d[19] & 0x10) snprintf(prefix,sizeof(prefix),"M");
-		if (d[19] & 0x08) snprintf(units,sizeof(units),"V");
-		if (d[19] & 0x04) snprintf(units,sizeof(units),"A");
-		if (d[19] & 0x02) snprintf(prefix,sizeof(prefix),"m");
-		if (d[19] & 0x01) snprintf(prefix,sizeof(prefix),"%s",uu);
+			adm20_health_format(&acq.health, &acq.reader, text, sizeof(text));
+			if (status_update(renderer, text, g.font_color, g.background_color)) adm20_display_invalidate(&screen);
+		}
 
 		{
-			char value[128];
-			int dp = 0;
-			/*
-				value = digit(&d[7]) *1000;
-				value += digit(&d[6]) *100;
-				value += digit(&d[5]) *10;
-				value += digit(&d[4]) *1;
-				*/
-			/*
-				switch (dp) {
-				case 1: value /= 10; break;
-				case 2: value /= 100; break;
-				case 3: value /= 1000; break;
-				case 4: value /= 10000; break;
-				}
-				*/
-			snprintf(linetmp,sizeof(linetmp), "%s%c%s%c%s%c%s%c%s%s"
-					, d[8]&0x08?"-":" "
-					, digit(d[7])
-					, d[6]&0x80?".":""
-					, digit(d[6])
-					, d[5]&0x80?".":""
-					, digit(d[5])
-					, d[4]&0x80?".":""
-					, digit(d[4])
-					, prefix
-					, units
-					);
-			snprintf(logline, sizeof(logline), "%s%c%s%c%s%c%s%c%s%s"
-					, d[8]&0x08?"-":""
-					, digit(d[7])
-					, d[6]&0x80?".":""
-					, digit(d[6])
-					, d[5]&0x80?".":""
-					, digit(d[5])
-					, d[4]&0x80?".":""
-					, digit(d[4])
-					, prefix
-					, units
-					);
-
-
+			uint64_t t0 = adm20_monotonic_ns();
+
+			if (g.segments) {
+				if (!render_segments(renderer, &g, &layout, &screen, &reading)) continue;
+			} else if (!render_line(renderer, font, glyphs, canvas, &g, &screen, line1)) continue;
+			t0 = adm20_monotonic_ns() - t0;
+			latency.draws++;
+			latency.draw_total += t0;
+			adm20_latency_record(&stages, ADM20_STAGE_RENDER, t0);
 		}
 
 		/*
+		 * A replayed reading carries the time it was captured,
+		 * latency only means something when it's live.
 		 *
-		 * END OF DECODING
 		 */
+		if (!g.replay_file) {
+			uint64_t dt = adm20_monotonic_ns() - reading.timestamp;
+
+			latency.count++;
+			latency.total += dt;
+			if (dt > latency.max) latency.max = dt;
+			adm20_latency_record(&stages, ADM20_STAGE_SCREEN, dt);
+			if (g.debug) fprintf(stderr,"Reading to pixel %.3f ms\r\n", dt / 1e6);
+		}
 
+	} // while(1)
 
-		snprintf(line1, sizeof(line1), "%-40s", linetmp);
-		//		snprintf(line2, sizeof(line2), "%-40s", mmmode);
-		//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
-
-		if (!g.quiet) fprintf(stderr,"%s\r",line1); fflush(stderr);
-
-		{
-			SDL_RenderClear(renderer);
-			surface = TTF_RenderUTF8_Solid(font, line1, g.font_color);
-			texture = SDL_CreateTextureFromSurface(renderer, surface);
-
-			int texW = 0;
-			int texH = 0;
-			SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
-			SDL_Rect dstrect = { 0, 0, texW, texH };
-			SDL_RenderCopy(renderer, texture, NULL, &dstrect);
-			SDL_RenderPresent(renderer);
-			SDL_DestroyTexture(texture);
-			SDL_FreeSurface(surface);
-
-		}
+	/*
+	 * Stop the acquisition thread first, then let the consumers
+	 * run out what's left in the ring.
+	 *
+	 */
+	__atomic_store_n(&acq.stop, 1, __ATOMIC_RELEASE);
+	eventfd_write(acq.stop_fd, 1);
+	SDL_WaitThread(acq_thread, NULL);
+
+	adm20_fanout_close(&fanout);
+	if (flexbv_thread_id) SDL_WaitThread(flexbv_thread_id, NULL);
+
+	adm20_capture_close(&acq.capture);
+	adm20_health_poll(&acq.health, acq.reader.fd, 0);
+
+	if (latency.count) {
+		fprintf(stderr,"\r\nReading to pixel: %llu readings drawn, avg %.3f ms, max %.3f ms\r\n"
+				, (unsigned long long)latency.count
+				, latency.total / 1e6 / latency.count
+				, latency.max / 1e6
+				);
+	}
+	adm20_display_report(&screen, stderr);
+	if (latency.draws) {
+		fprintf(stderr,"\r\nDrew %llu readings %s, avg %.1f us per draw, %.0f draws/s\r\n"
+				, (unsigned long long)latency.draws
+				, g.segments ? "as segments" : glyphs ? "from the glyph atlas" : "through TTF"
+				, latency.draw_total / 1e3 / latency.draws
+				, latency.draw_total ? latency.draws / (latency.draw_total / 1e9) : 0.0
+				);
+	}
+	if (display.overruns || (handoff.ifd >= 0 && flexbv.cursor.overruns)) {
+		fprintf(stderr,"\r\nOverruns: display %llu, FlexBV %llu\r\n"
+				, (unsigned long long)display.overruns
+				, handoff.ifd >= 0 ? (unsigned long long)flexbv.cursor.overruns : 0ULL
+				);
+	}
 
+	if (g.output_file) {
+		fprintf(stderr,"\r\nFlexBV took %llu readings, waiting avg %.1f ms max %.1f ms, up to %.1f ms old\r\n"
+				, (unsigned long long)handoff.pickups
+				, handoff.pickups ? handoff.wait_total / 1e6 / handoff.pickups : 0.0
+				, handoff.wait_max / 1e6
+				, handoff.age_max / 1e6
+				);
+		adm20_fanout_release(&flexbv.cursor);
+	}
+	adm20_fanout_release(&display);
+	adm20_handoff_close(&handoff);
+	close(acq.stop_fd);
+	adm20_reconnect_close(&acq.reconnect);
+	if (acq.reconnect.drops) {
+		fprintf(stderr,"\r\nLost the port %u times, down %.0f ms in all, longest %.0f ms\r\n"
+				, acq.reconnect.drops
+				, acq.reconnect.down_total / 1e6
+				, acq.reconnect.down_max / 1e6
+				);
+	}
 
-		if (g.output_file) {
-			/*
-			 * Only write the file out if it doesn't
-			 * exist. 
-			 *
-			 */
-			if (!fileExists(g.output_file)) {
-				FILE *f;
-				f = fopen(tfn,"w");
-				if (f) {
-					fprintf(f,"%s", logline);
-					fclose(f);
-					rename(tfn, g.output_file);
-				}
-			}
-		}
+	if (acq.shm) {
+		adm20_shm_detach(acq.shm);
+		adm20_shm_unlink(g.shm_name);
+	}
+	adm20_close_port(&g.serial_params);
 
-	} // while(1)
+	if (g.replay_file) {
+		/*
+		 * End to end throughput, parser through to every sink
+		 *
+		 */
+		double secs = (adm20_monotonic_ns() - acq.replay.start) / 1e9;
+		uint64_t frames = acq.reader.frames_ok + acq.reader.frames_rejected;
+
+		fprintf(stderr,"\r\nReplayed %llu frames ( ok %llu, rejected %llu ) in %.3f s, %.0f frames/s\r\n"
+				, (unsigned long long)frames
+				, (unsigned long long)acq.reader.frames_ok
+				, (unsigned long long)acq.reader.frames_rejected
+				, secs
+				, secs > 0 ? frames / secs : 0.0
+				);
+		adm20_replay_close(&acq.replay);
+	}
 
-	if (g.serial_params.fd) close(g.serial_params.fd);
+	adm20_latency_dump(&stages, g.stats_file);
+	adm20_health_dump(&acq.health, &acq.reader, g.replay_file ? g.replay_file : g.serial_params.device, g.stats_file);
 
-	SDL_DestroyTexture(texture);
-	SDL_FreeSurface(surface);
-	TTF_CloseFont(font);
+	if (canvas) SDL_DestroyTexture(canvas);
+	if (glyphs) atlas_free(glyphs);
+	if (font) TTF_CloseFont(font);
+	if (status.texture) SDL_DestroyTexture(status.texture);
+	if (status.font) TTF_CloseFont(status.font);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	TTF_Quit();
@@ -8,12 +8,15 @@
  *
  */
 
+#include <poll.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
@@ -22,6 +25,16 @@
 #include <errno.h>
 #include <X11/Xlib.h>
 
+#include "adm20-frame.h"
+#include "adm20-decode.h"
+#include "adm20-serial.h"
+#include "adm20-capture.h"
+#include "adm20-handoff.h"
+#include "adm20-shm.h"
+#include "adm20-display.h"
+#include "adm20-latency.h"
+#include "adm20-health.h"
+
 #define FL __FILE__,__LINE__
 
 /*
@@ -40,22 +53,6 @@
 #define SSIZE 1024
 
 #define DATA_FRAME_SIZE 22
-#define ee ""
-#define uu "\u00B5"
-#define kk "k"
-#define MM "M"
-#define mm "m"
-#define nn "n"
-#define pp "p"
-#define dd "\u00B0"
-#define oo "\u03A9"
-
-struct serial_params_s {
-	char *device;
-	int fd, n;
-	int cnt, size, s_cnt;
-	struct termios oldtp, newtp;
-};
 
 struct meter_param {
 	char mode[20];
@@ -71,8 +68,17 @@ struct glb {
 	uint16_t flags;
 	char *com_address;
 	char *output_file;
-
+	char *capture_file;
+	int capture_sync;
+	char *replay_file;
+	double replay_speed;
+	char *shm_name;
+	char *stats_file;
+	uint8_t status;
+
+	char *serial_config;
 	struct serial_params_s serial_params;
+	uint8_t low_latency;
 
 };
 
@@ -86,37 +92,50 @@ struct glb {
  */
 struct glb *glbs;
 
-bool fileExists(const char *filename) {
-	struct stat buf;
-	return (stat(filename, &buf) == 0);
-}
+/*
+ * Anything good from the meter within this long keeps the
+ * reading fresh, after it the display shows it as stale.
+ *
+ */
+#define STALE_AFTER_MS 2000
+
+/*
+ * The event loop's file descriptors, unused ones are left at -1
+ * and poll() skips them.
+ *
+ */
+enum { PFD_X11, PFD_SIGNAL, PFD_STALE, PFD_PORT, PFD_HOTPLUG, PFD_HANDOFF, PFD_REPLAY, PFD_COUNT };
 
+/*
+ * What woke the loop up, to show it really is idle between
+ * readings.  Sent on SIGUSR1 and at exit.
+ *
+ */
+struct loop_stats {
+	uint64_t start;
+	uint64_t wakeups;
+	uint64_t x11, port, timer, handoff;
+	uint64_t draws, requests;   // X requests it took to show the changes
+};
 
-char digit( unsigned char dg ) {
-
-	int d;
-	char g;
-
-	switch ((dg) & 0x7F) {
-		case 0x5F: g = '0'; d = 0; break;
-		case 0x06: g = '1'; d = 1; break;
-		case 0x6B: g = '2'; d = 2; break;
-		case 0x2F: g = '3'; d = 3; break;
-		case 0x36: g = '4'; d = 4; break;
-		case 0x3D: g = '5'; d = 5; break;
-		case 0x7D: g = '6'; d = 6; break;
-		case 0x07: g = '7'; d = 7; break;
-		case 0x7F: g = '8'; d = 8; break;
-		case 0x3F: g = '9'; d = 9; break;
-		case 0x79: g = 'E'; d = 0; break;
-		case 0x58: g = 'L'; d = 0; break;
-		default: g = ' ';
-					//		default: fprintf(stderr,"Unknown 7-segment data '%d / %02x'\r\n", dg, dg);
-	}
-	//	fprintf(stderr,"%d / %c", d, dg);
-	return g;
+static void loop_report(const struct loop_stats *l, FILE *f) {
+	double secs = (adm20_monotonic_ns() - l->start) / 1e9;
+
+	fprintf(f,"\r\nEvent loop: %llu wakeups in %.1f s ( %.2f/s ) [ X11 %llu, port %llu, timers %llu, FlexBV %llu ]\r\n"
+			, (unsigned long long)l->wakeups
+			, secs
+			, secs > 0 ? l->wakeups / secs : 0.0
+			, (unsigned long long)l->x11
+			, (unsigned long long)l->port
+			, (unsigned long long)l->timer
+			, (unsigned long long)l->handoff
+			);
+	if (l->draws) fprintf(f,"X11: %llu updates drawn, %.1f requests each\r\n", (unsigned long long)l->draws, (double)l->requests / l->draws);
 }
 
+static struct adm20_latency stages;
+
+
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220248
   Function Name	: init
@@ -139,6 +158,18 @@ int init(struct glb *g) {
 	g->flags = 0;
 	g->com_address = NULL;
 	g->output_file = NULL;
+	g->capture_file = NULL;
+	g->capture_sync = ADM20_CAPTURE_SYNC_DEFAULT;
+	g->replay_file = NULL;
+	g->replay_speed = 1.0;
+	g->shm_name = NULL;
+	g->stats_file = NULL;
+	g->status = 0;
+	g->serial_config = (char *)ADM20_DEFAULT_SERIAL_CONFIG;
+	g->serial_params.device = NULL;
+	g->serial_params.fd = -1;
+	g->serial_params.low_latency = 0;
+	g->low_latency = 0;
 
 	return 0;
 }
@@ -152,8 +183,17 @@ void show_help(void) {
 			"\r\n"
 			"\t-h: This help\r\n"
 			"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
+			"\t\t(default: look for it on every /dev/ttyUSB*, /dev/ttyACM* and /dev/serial/by-id port)\r\n"
 			"\t-s <[9600|4800|2400|1200]:[7|8][o|e|n][1|2]>, eg: -s 2400:8n1\r\n"
 			"\t-o <output file> ( used by FlexBV to read the data )\r\n"
+			"\t-c <capture file> ( append the raw frames, for replay later )\r\n"
+			"\t-cs <seconds between capture file syncs, 0 = only on exit>, eg: -cs 5\r\n"
+			"\t--replay <capture file>: Play a capture back instead of reading the meter\r\n"
+			"\t--speed <Nx|max>: Replay speed, eg: --speed 10x (default 1x)\r\n"
+			"\t--low-latency: Have the serial driver pass bytes on straight away\r\n"
+			"\t-m <shared memory name>: Publish readings for local readers, eg: -m /bside-adm20\r\n"
+			"\t--stats <file>: Append the latency and link stats as JSON here on SIGUSR1 and at exit (default stderr)\r\n"
+			"\t--status: Show the link health counters under the reading\r\n"
 			"\t-d: debug enabled\r\n"
 			"\t-q: quiet output\r\n"
 			"\t-v: show version\r\n"
@@ -220,6 +260,70 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 					}
 					break;
 
+				case 'c':
+					/*
+					 * -c <file> capture every frame we receive
+					 * -cs <seconds> how often to fsync() it
+					 *
+					 */
+					i++;
+					if (i >= argc) {
+						fprintf(stdout,"Insufficient parameters; -c <capture file> or -cs <seconds>\n");
+						exit(1);
+					}
+					if (argv[i-1][2] == 's') g->capture_sync = atoi(argv[i]);
+					else g->capture_file = argv[i];
+					break;
+
+				case '-':
+					/*
+					 * --replay <capture file> [--speed <Nx|max>]
+					 * --low-latency
+					 * --stats <file>
+					 * --status
+					 *
+					 */
+					if (!strcmp(argv[i], "--low-latency")) {
+						g->low_latency = 1;
+					} else if (!strcmp(argv[i], "--status")) {
+						g->status = 1;
+					} else if (!strcmp(argv[i], "--stats")) {
+						i++;
+						if (i >= argc) {
+							fprintf(stdout,"Insufficient parameters; --stats <file>\n");
+							exit(1);
+						}
+						g->stats_file = argv[i];
+					} else if (!strcmp(argv[i], "--replay") || !strcmp(argv[i], "--speed")) {
+						i++;
+						if (i >= argc) {
+							fprintf(stdout,"Insufficient parameters; %s requires a value\n", argv[i-1]);
+							exit(1);
+						}
+						if (argv[i-1][2] == 'r') {
+							g->replay_file = argv[i];
+						} else if (adm20_replay_speed(argv[i], &g->replay_speed)) {
+							fprintf(stdout,"Invalid replay speed '%s', expected eg 10x or max\n", argv[i]);
+							exit(1);
+						}
+					}
+					break;
+
+				case 'm':
+					/*
+					 * POSIX shared memory segment to publish every
+					 * reading in to, see adm20-shm.h
+					 *
+					 */
+					i++;
+					if (i < argc) {
+						g->shm_name = argv[i];
+					} else {
+						fprintf(stdout,"Insufficient parameters; -m <shared memory name>\n");
+						exit(1);
+					}
+					break;
+
 				case 'd': g->debug = 1; break;
 
 				case 'q': g->quiet = 1; break;
@@ -230,6 +334,13 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 							 break;
 
 				case 's':
+							 i++;
+							 if (i < argc) {
+								 g->serial_config = argv[i];
+							 } else {
+								 fprintf(stdout,"Insufficient parameters; -s <serial port config>\n");
+								 exit(1);
+							 }
 							 break;
 
 				default: break;
@@ -242,40 +353,86 @@ int parse_parameters(struct glb *g, int argc, char **argv ) {
 
 
 
-/*
- * Default parameters are 2400:8n1, given that the multimeter
- * is shipped like this and cannot be changed then we shouldn't
- * have to worry about needing to make changes, but we'll probably
- * add that for future changes.
- *
- */
-void open_port(struct serial_params_s *s) {
-	int r; 
+/*-----------------------------------------------------------------\
+  Function Name	: draw_cells
+  Returns Type	: void
+  ----Parameter List
+  1. Display *display,
+  2. Pixmap buffer, the off-screen copy of the window
+  3. Window win,
+  4. GC gc,
+  5. XFontStruct *font_info, fixed width
+  6. struct adm20_display *screen, cells to show
+  7. uint64_t dirty, which of them to draw
+  8. unsigned long fg, bg,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	Each run of changed cells is cleared and drawn in to the
+	pixmap with one request apiece, then the span they cover is
+	copied to the window in one go so it never shows a half drawn
+	line.  XDrawString16() takes the codepoints directly so the
+	micro, ohm and degree signs come out right from an ISO 10646
+	font.
 
-	s->fd = open( s->device, O_RDWR | O_NOCTTY |O_NDELAY );
-	if (s->fd <0) {
-		perror( s->device );
+\------------------------------------------------------------------*/
+static void draw_cells(Display *display, Pixmap buffer, Window win, GC gc, XFontStruct *font_info, struct adm20_display *screen, uint64_t dirty, unsigned long fg, unsigned long bg) {
+	XRectangle runs[ADM20_DISPLAY_CELLS];
+	XChar2b text[ADM20_DISPLAY_CELLS];
+	int first[ADM20_DISPLAY_CELLS];
+	int cw = font_info->max_bounds.width;
+	int top = 40 - font_info->ascent;
+	int height = font_info->ascent + font_info->descent;
+	int i, n = 0, left = -1, right = 0;
+
+	for (i = 0; i < screen->count; i++) {
+		text[i].byte1 = (screen->cell[i] >> 8) & 0xFF;
+		text[i].byte2 = screen->cell[i] & 0xFF;
+
+		if (!(dirty & (1ULL << i))) continue;
+
+		if (n && first[n -1] + runs[n -1].width / cw == i) {
+			runs[n -1].width += cw;
+		} else {
+			first[n] = i;
+			runs[n].x = 10 + i *cw;
+			runs[n].y = top;
+			runs[n].width = cw;
+			runs[n].height = height;
+			n++;
+		}
+		if (left < 0) left = 10 + i *cw;
+		right = 10 + (i +1) *cw;
 	}
+	if (!n) return;
 
-	fcntl(s->fd,F_SETFL,0);
-	tcgetattr(s->fd,&(s->oldtp)); // save current serial port settings 
-	tcgetattr(s->fd,&(s->newtp)); // save current serial port settings in to what will be our new settings
-	cfmakeraw(&(s->newtp));
-	s->newtp.c_cflag = B2400 | CS8 |  CREAD | CRTSCTS ; // Adjust the settings to suit our BSIDE-ADM20 / 2400-8n1
+	XSetForeground(display, gc, bg);
+	XFillRectangles(display, buffer, gc, runs, n);
+	XSetForeground(display, gc, fg);
+	for (i = 0; i < n; i++) XDrawString16(display, buffer, gc, runs[i].x, 40, &text[first[i]], runs[i].width / cw);
 
-	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
-	if (r) {
-		fprintf(stderr,"%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
-		exit(1);
-	}
+	XCopyArea(display, buffer, win, gc, left, top, right - left, height, left, top);
 }
 
-uint8_t a2h( uint8_t a ) {
-	a -= 0x30;
-	if (a < 10) return a;
-	a -= 7;
-	return a;
+/*
+ * The link health line along the bottom, only called when it's
+ * changed.  It's plain ASCII so XDrawString() will do.
+ *
+ */
+static void draw_status(Display *display, Pixmap buffer, Window win, GC gc, XFontStruct *font, int y, int width, const char *text, unsigned long fg, unsigned long bg) {
+	int top = y - font->ascent;
+	int height = font->ascent + font->descent;
+
+	XSetForeground(display, gc, bg);
+	XFillRectangle(display, buffer, gc, 0, top, width, height);
+	XSetForeground(display, gc, fg);
+	XDrawString(display, buffer, gc, 10, y, text, strlen(text));
+	XCopyArea(display, buffer, win, gc, 0, top, width, height, 0, top);
 }
+
+
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220307
   Function Name	: main
@@ -295,36 +452,50 @@ Changes:
 \------------------------------------------------------------------*/
 int main ( int argc, char **argv ) {
 
-	GC gc;
+	GC gc, status_gc = 0;
 	XGCValues values;
-	unsigned long valuemask = GCCapStyle|GCJoinStyle;
+	unsigned long valuemask = GCCapStyle|GCJoinStyle|GCGraphicsExposures;
 	XFontStruct *font_info;
+	XFontStruct *status_font = NULL; // only with --status
 	char *font_name = "-*-terminus-*-r-*-*-32-*";
 	Window win;
+	Pixmap buffer;          // Off-screen copy of the window, drawn in to then copied out
+	unsigned int buffer_width, buffer_height;
 	Display *display;
 	int x11_fd;
-	fd_set in_fds;
-	struct timeval tv;
 	XEvent xev;
+	Atom wm_delete;
+	struct pollfd pfd[PFD_COUNT];   // Everything the loop waits on
+	struct adm20_reconnect reconnect; // Watching for the port to come back after it's gone
+	struct loop_stats loop;
+	struct itimerspec stale_after;
+	uint64_t replay_armed = 0;      // record the replay timer is set for, +1
+	uint64_t polled = 0;            // when we last went in to poll()
+	int changed = 0;                // reading needs showing
+	int status_y = 0;               // baseline of the link health line
+	char status_line[SSIZE];        // link health as last drawn
+	int quit = 0;
+	char line1[1024];
 
 
 	char linetmp[SSIZE]; // temporary string for building main line of text
-	char prefix[SSIZE]; // Units prefix u, m, k, M etc
-	char units[SSIZE];  // Measurement units F, V, A, R
-	char mmmode[SSIZE]; // Multimeter mode, Resistance/diode/cap etc
 
 	//uint8_t dfake[] = { 0xf0, 0x11, 0x02, 0x00, 0x44, 0x33, 0x44, 0x36, 0x00, 0x05 }; // 2.7965V [ DC Volts ]
 	//uint8_t dfake[] = { 0xf0, 0x11, 0x04, 0x02, 0x44, 0x33, 0x44, 0x36, 0x00, 0x05 }; // 27.965kOhms [ Resistance ]
 	//uint8_t dfake[] = { 0xf0, 0x11, 0x04, 0x02, 0x44, 0x33, 0x44, 0x36, 0x10, 0x05 }; // -27.965kOhms [ Resistance ]
 
-	uint8_t d[SSIZE];
-	uint8_t dt[SSIZE];      // Serial data packet
+	struct adm20_reading reading; // Last decoded reading
 	int dt_loaded = 0;	// set when we have our first valid data
-	uint8_t dps = 0;     // Number of decimal places
+	struct adm20_reader reader; // Buffered frame reader for the serial port
+	struct adm20_capture capture; // Raw frame capture file, if -c was given
+	struct adm20_replay replay; // Capture being played back, if --replay was given
+	struct adm20_handoff handoff; // FlexBV output file, if -o was given
+	struct adm20_shm *shm = NULL; // Shared memory publication, if -m was given
+	struct adm20_display screen; // Cells currently showing in the window
+	struct adm20_health health; // Frame gaps and the kernel's line error counts
 	struct glb g;        // Global structure for passing variables around
 	int i = 0;           // Generic counter
 	char temp_char;        // Temporary character
-	char tfn[4096];
 
 	/* this variable will be used to store the "default" screen of the  */
 	/* X server. usually an X server has only one screen, so we're only */
@@ -382,12 +553,27 @@ int main ( int argc, char **argv ) {
 	 */
 	parse_parameters(&g, argc, argv);
 
-	if (g.output_file) snprintf(tfn,sizeof(tfn),"%s.tmp",g.output_file);
+	if (adm20_handoff_open(&handoff, g.output_file)) exit(1);
+	if (g.shm_name && !(shm = adm20_shm_create(g.shm_name))) exit(1);
 
 	/*
-	 * Handle the COM Port
+	 * Handle the COM Port, or the capture standing in for it
 	 */
-	open_port(&g.serial_params);
+	if (g.replay_file) {
+		if (adm20_replay_open(&replay, g.replay_file, g.replay_speed)) exit(1);
+		adm20_reader_init(&reader, -1);
+	} else if (!g.serial_params.device) {
+		if (adm20_detect_port(&g.serial_params, g.serial_config, &reader, g.debug) < 0) exit(1);
+	} else {
+		if (adm20_open_port(&g.serial_params, g.serial_config) < 0) exit(1);
+		adm20_reader_init(&reader, g.serial_params.fd);
+	}
+	if (g.low_latency && g.serial_params.fd >= 0) adm20_serial_low_latency(&g.serial_params, ADM20_LATENCY_DRIVER);
+	adm20_health_init(&health);
+	adm20_health_port(&health, g.serial_params.fd);
+
+	capture.fd = -1;
+	if (g.capture_file && adm20_capture_open(&capture, g.capture_file, g.capture_sync)) exit(1);
 
 	/*
 	 * Set up X11
@@ -401,10 +587,12 @@ int main ( int argc, char **argv ) {
 			WhitePixel(display, screen_num));
 
 	// You don't need all of these. Make the mask as you normally would.
+	// Pointer motion is left out, every wiggle of the mouse over the
+	// window would otherwise wake the event loop for nothing.
 	XSelectInput(display, win, 
 			//ExposureMask | KeyPressMask | KeyReleaseMask | PointerMotionMask |
 			//ButtonPressMask | ButtonReleaseMask  | StructureNotifyMask 
-			ExposureMask | PointerMotionMask |
+			ExposureMask |
 			ButtonPressMask | ButtonReleaseMask  | StructureNotifyMask 
 			);
 
@@ -416,232 +604,408 @@ int main ( int argc, char **argv ) {
 
 	values.cap_style = CapButt;
 	values.join_style = JoinBevel;
+	values.graphics_exposures = False; // XCopyArea() from the pixmap never needs NoExpose events back
 	gc = XCreateGC(display, win, valuemask, &values);
-	if (gc < 0) {
+	if (!gc) {
 		fprintf(stderr, "XCreateGC: \n");
 		exit(1);
 	}
 
 	XSetFont(display, gc, font_info->fid);
+
+	/*
+	 * The status line gets a small font and a GC of its own,
+	 * falling back to the "fixed" every server has.
+	 *
+	 */
+	if (g.status) {
+		status_font = XLoadQueryFont(display, "-*-terminus-*-r-*-*-12-*");
+		if (!status_font) status_font = XLoadQueryFont(display, "fixed");
+		if (status_font) {
+			status_gc = XCreateGC(display, win, valuemask, &values);
+			XSetFont(display, status_gc, status_font->fid);
+		} else {
+			fprintf(stderr,"%s:%d: Unable to load a font for the status line\r\n", FL);
+		}
+	}
+	status_line[0] = '\0';
+
+	/*
+	 * Back the window with a pixmap big enough for the whole line,
+	 * starting out the same black as the window.
+	 *
+	 */
+	buffer_width = 20 + ADM20_DISPLAY_CELLS *font_info->max_bounds.width;
+	buffer_height = 40 + font_info->descent;
+	if (status_font) {
+		status_y = buffer_height + 6 + status_font->ascent;
+		buffer_height = status_y + status_font->descent + 4;
+	}
+	if (buffer_width < 300) buffer_width = 300;
+	if (buffer_height < 100) buffer_height = 100;
+	buffer = XCreatePixmap(display, win, buffer_width, buffer_height, DefaultDepth(display, screen_num));
+	XSetForeground(display, gc, black_pixel);
+	XFillRectangle(display, buffer, gc, 0, 0, buffer_width, buffer_height);
+	XSetWindowBackgroundPixmap(display, win, None);
+	wm_delete = XInternAtom(display, "WM_DELETE_WINDOW", False);
+	XSetWMProtocols(display, win, &wm_delete, 1);
 	XMapWindow(display, win);
 	XFlush(display);
 	x11_fd = ConnectionNumber(display);
+	adm20_display_init(&screen);
+
+	memset(&stale_after, 0, sizeof(stale_after));
+	stale_after.it_value.tv_sec = STALE_AFTER_MS / 1000;
+	stale_after.it_value.tv_nsec = (STALE_AFTER_MS % 1000) *1000000L;
 
 	/*
 	 *
 	 * Parent will terminate us... else we'll become a zombie
 	 * and hope that the almighty PID 1 will reap us
 	 *
+	 * SIGINT/SIGTERM (and SIGUSR1 for a report) come in through a
+	 * signalfd like everything else, so the loop finishes what it
+	 * was doing and flushes the capture file on the way out.
+	 *
 	 */
-	while (1) {
-		char line1[1024];
-		char *p, *q;
-		double v = 0.0;
-		int end_of_frame_received = 0;
-		int num_ready_fds;
-		ssize_t bytes_read = 0;
-
-		FD_ZERO(&in_fds);
-		FD_SET(x11_fd, &in_fds);
-		tv.tv_usec = 250000;
-		tv.tv_sec = 0;
-		/*
-		num_ready_fds = select(x11_fd +1, &in_fds, NULL, NULL, &tv);
-		if (num_ready_fds > 0) {
-			fprintf(stderr,"%s:%d: Events received\r\n", FL );
-		} else if (num_ready_fds == 0) {
-			fprintf(stderr,"%s:%d: Timer fired off\r\n", FL);
-		} else {
-			fprintf(stderr,"%s:%d: Error occurred reading file descriptor count \r\n", FL);
-		}
-		*/
+	{
+		sigset_t mask;
+
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		sigaddset(&mask, SIGUSR1);
+		sigprocmask(SIG_BLOCK, &mask, NULL);
+		pfd[PFD_SIGNAL].fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	}
+	pfd[PFD_X11].fd = x11_fd;
+	pfd[PFD_STALE].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	pfd[PFD_PORT].fd = g.replay_file ? -1 : reader.fd;
+	pfd[PFD_HOTPLUG].fd = -1;
+	adm20_reconnect_init(&reconnect);
+	pfd[PFD_HANDOFF].fd = handoff.ifd;
+	pfd[PFD_REPLAY].fd = g.replay_file ? timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC) : -1;
+	if (pfd[PFD_SIGNAL].fd < 0 || pfd[PFD_STALE].fd < 0 || (g.replay_file && pfd[PFD_REPLAY].fd < 0)) {
+		fprintf(stderr,"%s:%d: Unable to set up the event loop (%s)\r\n", FL, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < PFD_COUNT; i++) pfd[i].events = POLLIN;
 
-		linetmp[0] = '\0';
+	memset(&loop, 0, sizeof(loop));
+	loop.start = adm20_monotonic_ns();
+	adm20_latency_init(&stages);
 
+	while (!quit) {
+		const uint8_t *frame;
+		int status, timeout = -1, n;
+		uint64_t t;
+
+		/*
+		 * Xlib may already have events read in and queued, those
+		 * won't show on the fd so they have to be taken first.
+		 *
+		 */
 		while (XPending(display)) {
 			XNextEvent(display, &xev);
 			if(xev.type==Expose) {
-				XFillRectangle(display, win, DefaultGC(display, screen_num), 0, 0, 300, 100);
+				// Straight from the pixmap, nothing to redraw
+				XCopyArea(display, buffer, win, gc, xev.xexpose.x, xev.xexpose.y, xev.xexpose.width, xev.xexpose.height, xev.xexpose.x, xev.xexpose.y);
 			}
-			/* exit on key press */
-			if(xev.type==KeyPress)
-				break;
 
 			// Handle Windows Close Event
-			if(xev.type==ClientMessage)
-				break;
+			if(xev.type==ClientMessage && (Atom)xev.xclient.data.l[0] == wm_delete)
+				quit = 1;
 		} // while pending X events.
 
 		/*
-		 * Time to start receiving the serial block data
+		 * Every complete frame already in the reader's ring
 		 *
-		 * We initially "stage" here waiting for there to
-		 * be something happening on the com port.  Soon as
-		 * something happens, then we move forward to trying
-		 * to read the data.
+		 */
+		while ((status = adm20_reader_next(&reader, &frame)) != ADM20_FRAME_MORE) {
+			if (status == ADM20_FRAME_REJECTED) {
+				if (capture.fd >= 0) adm20_capture_write(&capture, reader.fill_time, ADM20_CAPTURE_REJECTED, frame, frame ? ADM20_FRAME_SIZE : 0);
+
+				/*
+				 * Noise, a truncated frame or one no meter could
+				 * send (two decimal points, two units lit).  Show
+				 * the previous frame again but flag it as stale so
+				 * nobody mistakes it for a fresh reading.
+				 *
+				 */
+				if (g.debug) { fprintf(stdout,"Rejected %u byte frame [ ok %llu, rejected %llu, discarded %llu bytes ], loading previous frame\r\n", reader.frame_len, (unsigned long long)reader.frames_ok, (unsigned long long)reader.frames_rejected, (unsigned long long)reader.bytes_discarded); }
+				if (!dt_loaded) continue;
+				reading.flags |= ADM20_READING_STALE;
+			} else {
+				if (capture.fd >= 0) adm20_capture_write(&capture, reader.fill_time, ADM20_CAPTURE_OK, frame, ADM20_FRAME_SIZE);
+				if (g.debug) {
+					fprintf(stdout,"DATA START: ");
+					for (i = 0; i < DATA_FRAME_SIZE; i++) fprintf(stdout,"%02x ", frame[i]);
+					fprintf(stdout,":END [%d bytes]\r\n", DATA_FRAME_SIZE);
+				}
+				/*
+				 * Replayed frames carry the time they were captured,
+				 * only the stages from here on mean anything then.
+				 *
+				 */
+				t = adm20_monotonic_ns();
+				if (!g.replay_file) adm20_latency_record(&stages, ADM20_STAGE_ASSEMBLY, t - reader.fill_time);
+				adm20_decode(frame, reader.fill_time, &reading);
+				adm20_latency_record(&stages, ADM20_STAGE_DECODE, adm20_monotonic_ns() - t);
+				adm20_health_frame(&health, reader.fill_time);
+				adm20_health_poll(&health, reader.fd, t);
+				dt_loaded = 1;
+
+				// Nothing good for this long and the display goes stale
+				timerfd_settime(pfd[PFD_STALE].fd, 0, &stale_after, NULL);
+			}
+			if (shm) {
+				t = adm20_monotonic_ns();
+				adm20_shm_publish(shm, &reading);
+				adm20_latency_record(&stages, ADM20_STAGE_SHM, adm20_monotonic_ns() - t);
+			}
+			changed = 1;
+		}
+
+		/*
+		 * Only the newest reading gets shown, however many came
+		 * in since we last looked.
 		 *
 		 */
+		if (changed) {
+			adm20_reading_format(&reading, linetmp, sizeof(linetmp), ADM20_FORMAT_DISPLAY);
+			snprintf(line1, sizeof(line1), "%-40s", linetmp);
+			//		snprintf(line2, sizeof(line2), "%-40s", mmmode);
+			//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
 
-		if (g.debug) { fprintf(stdout,"DATA START: "); }
-		end_of_frame_received = 0;
-		i = 0;
-		do {
-			char temp_char;
-			bytes_read = read(g.serial_params.fd, &temp_char, 1);
-			if (bytes_read) {
-				d[i] = temp_char;
-				if (g.debug) { fprintf(stdout,"%02x ", d[i]); }
+			if (!g.quiet) fprintf(stdout,"%s\r",line1); fflush(stdout);
 
-				i++;
+			/*
+			 * Only touch the window where the reading changed, a
+			 * steady meter costs nothing past this compare.
+			 *
+			 * On screen here means the requests have gone to the
+			 * X server, when it gets them drawn is up to it.
+			 *
+			 */
+			{
+				uint64_t dirty = adm20_display_update(&screen, line1);
+
+				if (dirty) {
+					unsigned long before = NextRequest(display);
+
+					t = adm20_monotonic_ns();
+					draw_cells(display, buffer, win, gc, font_info, &screen, dirty, white_pixel, black_pixel);
+					XFlush(display);
+					adm20_latency_record(&stages, ADM20_STAGE_RENDER, adm20_monotonic_ns() - t);
+					if (!g.replay_file && !(reading.flags & ADM20_READING_STALE)) adm20_latency_record(&stages, ADM20_STAGE_SCREEN, adm20_monotonic_ns() - reading.timestamp);
+					loop.draws++;
+					loop.requests += NextRequest(display) - before;
+				}
+			}
 
-				if (temp_char == 0x55) {
-					end_of_frame_received = 1;
-					break;
+			if (status_font) {
+				char text[SSIZE];
+
+				adm20_health_format(&health, &reader, text, sizeof(text));
+				if (strcmp(text, status_line)) {
+					draw_status(display, buffer, win, status_gc, status_font, status_y, buffer_width, text, white_pixel, black_pixel);
+					snprintf(status_line, sizeof(status_line), "%s", text);
 				}
 			}
-		} while ((bytes_read > 0) && (i < sizeof(d)) && (!end_of_frame_received));
+			changed = 0;
+		}
 
-		if (g.debug) { fprintf(stdout,":END [%d bytes]\r\n", i); }
+		if (handoff.want && dt_loaded && !(reading.flags & ADM20_READING_STALE)) {
+			/*
+			 * Only write the file out once FlexBV has taken the
+			 * last one, and never hand it a stale reading.
+			 *
+			 */
+			adm20_reading_format(&reading, linetmp, sizeof(linetmp), ADM20_FORMAT_DISPLAY);
+			if (adm20_handoff_publish(&handoff, linetmp, reading.timestamp) > 0) {
+				if (!g.replay_file) adm20_latency_record(&stages, ADM20_STAGE_FLEXBV, adm20_monotonic_ns() - reading.timestamp);
+				if (g.debug) fprintf(stderr,"%s:%d: %s => %s\r\n", FL, linetmp, g.output_file);
+			}
+		}
 
 		/*
-		 * Validate the received data
+		 * A replay stands in for the port.  At max speed it's fed a
+		 * record per pass without waiting, otherwise a timer is set
+		 * for when the next one is due.
 		 *
 		 */
-		if (i != DATA_FRAME_SIZE) {
-			if (g.debug) { fprintf(stdout,"Invalid number of bytes, expected %d, received %d, loading previous frame\r\n", DATA_FRAME_SIZE, i); }
-			if (dt_loaded) memcpy(d, dt, sizeof(d));
-		} else {
-			memcpy(dt, d, sizeof(d)); // make a copy.
-			dt_loaded = 1;
+		if (g.replay_file) {
+			uint64_t due = adm20_replay_due(&replay);
+
+			if (replay.next >= replay.map.count) break;
+			if (!due) {
+				adm20_replay_feed(&replay, &reader);
+				timeout = 0;
+			} else if (replay_armed != replay.next +1) {
+				struct itimerspec its;
+
+				memset(&its, 0, sizeof(its));
+				its.it_value.tv_sec = due / 1000000000ULL;
+				its.it_value.tv_nsec = due % 1000000000ULL;
+				if (!its.it_value.tv_sec && !its.it_value.tv_nsec) its.it_value.tv_nsec = 1;
+				timerfd_settime(pfd[PFD_REPLAY].fd, TFD_TIMER_ABSTIME, &its, NULL);
+				replay_armed = replay.next +1;
+			}
 		}
 
 		/*
-		 * Initialise the strings used for units, prefix and mode
-		 * so we don't end up with uncleared prefixes etc
-		 * ( see https://www.youtube.com/watch?v=5HUyEykicEQ )
-		 *
-		 * Prefix string initialised to single space, prevents 
-		 * annoying string width jump (on monospace, can't stop
-		 * it with variable width strings unless we draw the 
-		 * prefix+units separately in a fixed location
+		 * Port's gone, see if it's back yet.  It's only actually
+		 * opened when its name has turned up or it's time for
+		 * another blind try.
 		 *
 		 */
-		snprintf(prefix, sizeof(prefix), " ");
-		units[0] = '\0';
-		mmmode[0] = '\0';
+		if (reconnect.lost) {
+			if (adm20_reconnect_try(&reconnect, &g.serial_params) >= 0) {
+				adm20_reader_attach(&reader, g.serial_params.fd);
+				adm20_health_port(&health, g.serial_params.fd);
+				pfd[PFD_PORT].fd = reader.fd;
+				pfd[PFD_HOTPLUG].fd = -1;
+			} else {
+				int t = adm20_reconnect_timeout(&reconnect);
+
+				if (timeout < 0 || t < timeout) timeout = t;
+			}
+		}
 
-		/*
-		 * Decode our data.
-		 *
-		 * While the data sheet gives a very nice matrix for the RANGE and FUNCTION values
-		 * it's probably more human-readable to break it down in to longer code on a per
-		 * function selection.
-		 *
-		 * linetmp : contains the value we want show
-		 * mmode   : contains the meter mode (resistance, volts, amps etc)
-		 *  L"\u00B0C" = 'C
-		 *  L"\u00B0F" = 'F
-		 *  L"\u2126"  = ohms char
-		 *  L"\u00B5"  = mu char (micro)
-		 *
-		 */
+		XFlush(display);
+		polled = adm20_monotonic_ns();
+		n = poll(pfd, PFD_COUNT, timeout);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr,"%s:%d: poll() failed (%s)\r\n", FL, strerror(errno));
+			break;
+		}
+		if (timeout) loop.wakeups++;
+
+		if (pfd[PFD_SIGNAL].revents) {
+			struct signalfd_siginfo si;
+
+			while (read(pfd[PFD_SIGNAL].fd, &si, sizeof(si)) == sizeof(si)) {
+				if (si.ssi_signo == SIGUSR1) {
+					loop_report(&loop, stderr);
+					adm20_latency_dump(&stages, g.stats_file);
+					adm20_health_poll(&health, reader.fd, 0);
+					adm20_health_dump(&health, &reader, g.replay_file ? g.replay_file : g.serial_params.device, g.stats_file);
+				} else quit = 1;
+			}
+		}
 
+		if (pfd[PFD_PORT].revents) {
+			ssize_t got;
+
+			loop.port++;
+			got = adm20_reader_fill(&reader);
+			if (got > 0) adm20_latency_record(&stages, ADM20_STAGE_READ_WAIT, reader.fill_time - polled);
+			if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+				adm20_health_poll(&health, reader.fd, 0);
+				adm20_reconnect_lost(&reconnect, &g.serial_params, got);
+				reader.fd = pfd[PFD_PORT].fd = -1;
+				pfd[PFD_HOTPLUG].fd = reconnect.ifd;
+				adm20_reading_disconnected(&reading, reconnect.lost);
+				dt_loaded = 0;
+				if (shm) adm20_shm_publish(shm, &reading);
+				changed = 1;
+			}
+		}
 
-		if (d[16] & 0x80) snprintf(mmmode,sizeof(mmmode),"REL");
-		if (d[16] & 0x20) snprintf(mmmode,sizeof(mmmode),"AUTO");
-
-		if (d[17] & 0x40) snprintf(mmmode,sizeof(mmmode),"hFE");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"%%");
-		if (d[17] & 0x08) snprintf(mmmode,sizeof(mmmode),"MIN");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"min-max");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"MAX");
-		if (d[17] & 0x20) snprintf(mmmode,sizeof(mmmode),"USB");
-
-		if (d[18] & 0x80) snprintf(units,sizeof(units),"F");
-		if (d[18] & 0x40) snprintf(prefix,sizeof(prefix),"n");
-		if (d[18] & 0x20) snprintf(prefix,sizeof(prefix),"%s",uu);
-		if (d[18] & 0x02) snprintf(units,sizeof(units),"%sF",dd);
-		if (d[18] & 0x01) snprintf(units,sizeof(units),"%sC",dd);
-
-		if (d[19] & 0x80) snprintf(units,sizeof(units),"Hz");
-		if (d[19] & 0x40) snprintf(units,sizeof(units),"%s",oo);
-		if (d[19] & 0x20) snprintf(prefix,sizeof(prefix),"k");
-		if (d[19] & 0x10) snprintf(prefix,sizeof(prefix),"M");
-		if (d[19] & 0x08) snprintf(units,sizeof(units),"V");
-		if (d[19] & 0x04) snprintf(units,sizeof(units),"A");
-		if (d[19] & 0x02) snprintf(prefix,sizeof(prefix),"m");
-		if (d[19] & 0x01) snprintf(prefix,sizeof(prefix),"%s",uu);
-
-		{
-			char value[128];
-			int dp = 0;
-			/*
-				value = digit(&d[7]) *1000;
-				value += digit(&d[6]) *100;
-				value += digit(&d[5]) *10;
-				value += digit(&d[4]) *1;
-				*/
-			/*
-				switch (dp) {
-				case 1: value /= 10; break;
-				case 2: value /= 100; break;
-				case 3: value /= 1000; break;
-				case 4: value /= 10000; break;
-				}
-				*/
-			snprintf(linetmp,sizeof(linetmp), "%s%c%s%c%s%c%s%c%s%s"
-					, d[8]&0x08?"-":" "
-					, digit(d[7])
-					, d[6]&0x80?".":""
-					, digit(d[6])
-					, d[5]&0x80?".":""
-					, digit(d[5])
-					, d[4]&0x80?".":""
-					, digit(d[4])
-					, prefix
-					, units
-					);
+		if (pfd[PFD_HOTPLUG].revents) loop.port++;
+
+		if (pfd[PFD_X11].revents) loop.x11++;
+
+		if (pfd[PFD_STALE].revents) {
+			uint64_t expirations;
+
+			loop.timer++;
+			if (read(pfd[PFD_STALE].fd, &expirations, sizeof(expirations)) > 0 && dt_loaded && !(reading.flags & ADM20_READING_STALE)) {
+				if (g.debug) fprintf(stdout,"Nothing from the meter for %d ms, reading is stale\r\n", STALE_AFTER_MS);
+				reading.flags |= ADM20_READING_STALE;
+				if (shm) adm20_shm_publish(shm, &reading);
+				changed = 1;
+			}
+		}
+
+		if (pfd[PFD_REPLAY].revents) {
+			uint64_t expirations;
+
+			loop.timer++;
+			if (read(pfd[PFD_REPLAY].fd, &expirations, sizeof(expirations)) > 0) adm20_replay_feed(&replay, &reader);
 		}
 
 		/*
+		 * FlexBV just took the file, it gets the reading we
+		 * already have at the top of the next pass rather than
+		 * waiting for the next.
 		 *
-		 * END OF DECODING
 		 */
+		if (pfd[PFD_HANDOFF].revents) {
+			loop.handoff++;
+			if (adm20_handoff_check(&handoff) && g.debug) fprintf(stdout,"FlexBV took its reading after %.1f ms, %.1f ms old\r\n", handoff.wait_last / 1e6, handoff.age_last / 1e6);
+		}
 
+	} // while(1)
 
-		snprintf(line1, sizeof(line1), "%-40s", linetmp);
-		//		snprintf(line2, sizeof(line2), "%-40s", mmmode);
-		//		snprintf(line3, sizeof(line3), "V.%03d", BUILD_VER);
-
-		if (!g.quiet) fprintf(stdout,"%s\r",line1); fflush(stdout);
+	loop_report(&loop, stderr);
+	adm20_latency_dump(&stages, g.stats_file);
+	adm20_health_poll(&health, reader.fd, 0);
+	adm20_health_dump(&health, &reader, g.replay_file ? g.replay_file : g.serial_params.device, g.stats_file);
+	if (status_font) {
+		XFreeGC(display, status_gc);
+		XFreeFont(display, status_font);
+	}
+	XFreePixmap(display, buffer);
+	close(pfd[PFD_SIGNAL].fd);
+	close(pfd[PFD_STALE].fd);
+	if (pfd[PFD_REPLAY].fd >= 0) close(pfd[PFD_REPLAY].fd);
+	adm20_reconnect_close(&reconnect);
+	if (reconnect.drops) {
+		fprintf(stderr,"\r\nLost the port %u times, down %.0f ms in all, longest %.0f ms\r\n"
+				, reconnect.drops
+				, reconnect.down_total / 1e6
+				, reconnect.down_max / 1e6
+				);
+	}
 
-		XSetForeground(display, gc, black_pixel);
-		XFillRectangle(display, win, DefaultGC(display, screen_num), 0, 0, 300, 100);
-		XSetForeground(display, gc, white_pixel);
-		XDrawString(display, win, gc, 10, 40, line1, strlen (line1));
+	adm20_capture_close(&capture);
+	adm20_display_report(&screen, stderr);
 
-		if (g.output_file) {
-			/*
-			 * Only write the file out if it doesn't
-			 * exist. 
-			 *
-			 */
-			if (!fileExists(g.output_file)) {
-				FILE *f;
-				fprintf(stderr,"%s:%d: output filename = %s\r\n", FL, g.output_file);
-				f = fopen(tfn,"w");
-				if (f) {
-					fprintf(f,"%s", linetmp);
-					fprintf(stderr,"%s:%d: %s => %s\r\n", FL, linetmp, tfn);
-					fclose(f);
-					rename(tfn, g.output_file);
-				}
-			}
-		}
+	if (g.output_file) {
+		fprintf(stderr,"\r\nFlexBV took %llu readings, waiting avg %.1f ms max %.1f ms, up to %.1f ms old\r\n"
+				, (unsigned long long)handoff.pickups
+				, handoff.pickups ? handoff.wait_total / 1e6 / handoff.pickups : 0.0
+				, handoff.wait_max / 1e6
+				, handoff.age_max / 1e6
+				);
+	}
+	adm20_handoff_close(&handoff);
 
-	} // while(1)
+	if (shm) {
+		adm20_shm_detach(shm);
+		adm20_shm_unlink(g.shm_name);
+	}
+	adm20_close_port(&g.serial_params);
 
-	if (g.serial_params.fd) close(g.serial_params.fd);
+	if (g.replay_file) {
+		/*
+		 * End to end throughput, parser through to every sink
+		 *
+		 */
+		double secs = (adm20_monotonic_ns() - replay.start) / 1e9;
+		uint64_t frames = reader.frames_ok + reader.frames_rejected;
+
+		fprintf(stderr,"\r\nReplayed %llu frames ( ok %llu, rejected %llu ) in %.3f s, %.0f frames/s\r\n"
+				, (unsigned long long)frames
+				, (unsigned long long)reader.frames_ok
+				, (unsigned long long)reader.frames_rejected
+				, secs
+				, secs > 0 ? frames / secs : 0.0
+				);
+		adm20_replay_close(&replay);
+	}
 
 	return 0;
 
@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <wchar.h>
 
+#include "adm20-decode.h"
+
 /*
  * Should be defined in the Makefile to pass to the compiler from
  * the github build revision
@@ -58,33 +60,6 @@
 #define dd L"\u00B0"
 #define oo L"\u03A9"
 
-char digit( unsigned char dg ) {
-	 
-	int d;
-	char g;
-
-	switch ((dg) & 0x7F) {
-		case 0x5F: g = '0'; d = 0; break;
-		case 0x06: g = '1'; d = 1; break;
-		case 0x6B: g = '2'; d = 2; break;
-		case 0x2F: g = '3'; d = 3; break;
-		case 0x36: g = '4'; d = 4; break;
-		case 0x3D: g = '5'; d = 5; break;
-		case 0x7D: g = '6'; d = 6; break;
-		case 0x07: g = '7'; d = 7; break;
-		case 0x7F: g = '8'; d = 8; break;
-		case 0x3F: g = '9'; d = 9; break;
-		case 0x79: g = 'E'; d = 0; break;
-		case 0x58: g = 'L'; d = 0; break;
-		default: g = ' ';
-//		default: fprintf(stderr,"Unknown 7-segment data '%d / %02x'\r\n", dg, dg);
-	}
-//	fprintf(stderr,"%d / %c", d, dg);
-	return g;
-}
-
-
-
 struct meter_param {
 	wchar_t mode[20];
 	wchar_t units[20];
@@ -895,13 +870,13 @@ struct meter_param {
 				*/
 				StringCbPrintf(linetmp,sizeof(linetmp), L"%s%c%s%c%s%c%s%c%s%s"
 						, d[8]&0x08?L"-":L" "
-						, digit(d[7])
+						, adm20_digit(d[7])
 						, d[6]&0x80?L".":L""
-						, digit(d[6])
+						, adm20_digit(d[6])
 						, d[5]&0x80?L".":L""
-						, digit(d[5])
+						, adm20_digit(d[5])
 						, d[4]&0x80?L".":L""
-						, digit(d[4])
+						, adm20_digit(d[4])
 						, prefix
 						, units
 						);